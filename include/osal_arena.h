@@ -0,0 +1,51 @@
+
+#ifndef H_OSAL_ARENA
+#define H_OSAL_ARENA
+
+/* A small-object allocator with one arena (heap) per thread.
+ *
+ * Each thread allocates from its own slabs, one slab per size class,
+ * so an allocation is a pop from the thread's own free list or a
+ * pointer bump in its current slab, with no lock and no atomic
+ * operation. Freeing on the allocating thread is a push onto that
+ * list. Freeing on any other thread pushes the object, with one CAS,
+ * onto a per-class remote list of the owning arena, which the owner
+ * takes back in one go when its own list runs dry.
+ *
+ * When a thread exits, its arena (with everything still allocated from
+ * it) is handed to the next new thread instead of being freed, so
+ * objects may outlive the thread that allocated them.
+ *
+ * Objects up to 16384 bytes come from slabs; larger ones are passed
+ * through to the system allocator. Every object is 16-byte aligned.
+ *
+ * Slabs are never freed or shared between arenas: a freed object only
+ * goes back to its own arena's free list for its size class, so the
+ * memory held in slabs stays at its high-water mark until the process
+ * exits and is never returned to the system.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_arena_dump (void);
+
+   /* Allocate size bytes from the calling thread's arena. Returns NULL
+    * if out of memory. The memory is not zeroed.
+    */
+   void *osal_arena_alloc (size_t size);
+
+   /* Free an object returned by osal_arena_alloc(), from any thread.
+    * NULL is ignored.
+    */
+   void osal_arena_free (void *ptr);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
+
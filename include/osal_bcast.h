@@ -0,0 +1,79 @@
+#ifndef H_OSAL_BCAST
+#define H_OSAL_BCAST
+
+/* A bounded broadcast ring (after the LMAX Disruptor). A single
+ * producer publishes messages and every consumer sees every message,
+ * in order. Each consumer has its own cursor, which only moves past a
+ * message when the consumer releases it with osal_bcast_release(); a
+ * consumer may also be gated on other consumers, in which case it only
+ * sees a message once all the consumers it depends on have released
+ * it. The producer only reuses a slot once the slowest consumer has
+ * released it.
+ *
+ * Exactly one thread may call osal_bcast_nq(), and each consumer id
+ * must only be used by one thread at a time. All consumers must be
+ * added before the first message is published.
+ */
+typedef struct osal_bcast_t osal_bcast_t;
+
+// The maximum number of consumers a ring can have.
+#define OSAL_BCAST_MAX_CONSUMERS    64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_bcast_dump (osal_bcast_t *bcast);
+
+   /* Create a broadcast ring of nelements. Returns NULL on error or
+    * a pointer to an object of type osal_bcast_t on success. A
+    * power-of-two nelements avoids a division on every call.
+    */
+   osal_bcast_t *osal_bcast_new (size_t nelements);
+
+   /* Delete an object of type osal_bcast_t, which is returned from a
+    * successful call to osal_bcast_new().
+    */
+   void osal_bcast_del (osal_bcast_t *bcast);
+
+   /* Add a consumer to the ring. The consumer sees a message only
+    * after each of the ndepends consumers in the array depends_on
+    * has released it (depends_on may be NULL if ndepends is 0).
+    * Every id in depends_on must have been returned by an earlier
+    * call to this function.
+    *
+    * Returns the new consumer's id, or (size_t)-1 on error.
+    */
+   size_t osal_bcast_consumer_add (osal_bcast_t *bcast,
+                                   const size_t *depends_on, size_t ndepends);
+
+   /* Publish a message to all consumers. Returns true on success and
+    * false if the slowest consumer has not yet released the slot
+    * that the message needs. Must only be called by the producer.
+    */
+   bool osal_bcast_nq (osal_bcast_t *bcast, void *message);
+
+   /* Retrieve the next message for the given consumer. Returns true
+    * on success and false if there is no message that this consumer
+    * may see yet. See osal_ccq_dq() for dst and nq_time.
+    *
+    * The message stays in the ring, and is not seen by the consumers
+    * gated on this one, until it is released.
+    */
+   bool osal_bcast_dq (osal_bcast_t *bcast, size_t consumer,
+                       void **dst, uint64_t *nq_time);
+
+   /* Release every message that the given consumer has retrieved so
+    * far, once it has finished with them. Releasing after each
+    * osal_bcast_dq() or after a run of them are both fine; until a
+    * message is released its slot cannot be reused.
+    */
+   void osal_bcast_release (osal_bcast_t *bcast, size_t consumer);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
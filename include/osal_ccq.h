@@ -0,0 +1,238 @@
+
+#ifndef H_OSAL_CCQ
+#define H_OSAL_CCQ
+
+typedef struct osal_ccq_t osal_ccq_t;
+
+// Pass as the timeout to the _wait() calls to wait indefinitely.
+#define OSAL_CCQ_WAIT_FOREVER       ((uint64_t)-1)
+
+// The number of buckets in the residency histogram of osal_ccq_stats_t.
+#define OSAL_CCQ_STATS_BUCKETS      32
+
+/* A snapshot of a queue's statistics, see osal_ccq_stats(). The
+ * counters are totals since osal_ccq_stats_enable() was called.
+ *
+ * residency_ns is a histogram of the time, in nanoseconds, that each
+ * retrieved message spent on the queue: bucket 0 counts messages that
+ * spent less than 1ns, and bucket n counts those that spent at least
+ * 2^(n-1)ns and less than 2^n ns. The last bucket also counts all
+ * longer times (from about one second).
+ */
+typedef struct osal_ccq_stats_t {
+   uint64_t nq_count;      // Messages placed onto the queue
+   uint64_t dq_count;      // Messages retrieved from the queue
+   uint64_t nq_full;       // Enqueue attempts that found the queue full
+   uint64_t dq_empty;      // Dequeue attempts that found the queue empty
+   uint64_t depth;         // Messages on the queue at the snapshot
+   uint64_t max_depth;     // Highest depth seen by an enqueue
+   uint64_t capacity;
+   uint64_t residency_ns[OSAL_CCQ_STATS_BUCKETS];
+} osal_ccq_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_ccq_dump (osal_ccq_t *ccq);
+
+   /* Create a bounded queue of nelements. Returns NULL
+    * on error or a pointer to an object of type osal
+    * ccq_t on success;
+    *
+    * The queue is lock-free for any number of producers and
+    * consumers. A power-of-two nelements avoids a division on
+    * every call.
+    */
+   osal_ccq_t *osal_ccq_new (size_t nelements);
+
+   /* Create a bounded queue of nelements, each of which is a
+    * message of exactly elem_size bytes stored inline in the
+    * queue. Messages are copied in with osal_ccq_nq_data() and out
+    * with osal_ccq_dq_data() (or built and read in place with
+    * osal_ccq_reserve() and osal_ccq_claim()), so neither side needs
+    * to allocate or free anything per message.
+    *
+    * The pointer functions (osal_ccq_nq(), osal_ccq_dq() and
+    * friends) only work on queues whose elem_size is the size of a
+    * pointer, as is the case for every queue from osal_ccq_new().
+    */
+   osal_ccq_t *osal_ccq_new_sized (size_t nelements, size_t elem_size);
+
+   /* Create a queue, as with osal_ccq_new_sized(), in memory that
+    * can be shared with other processes on the same host. With a
+    * name the queue is a POSIX shared memory object (the name must
+    * start with a '/' and must not already exist) that other
+    * processes attach to with osal_ccq_shm_open(). With a NULL name
+    * the queue is an anonymous memfd (Linux only), and other
+    * processes attach with osal_ccq_shm_open_fd() on a descriptor
+    * that they inherited (across fork(), or via SCM_RIGHTS) from
+    * osal_ccq_shm_fd(). The memfd is close-on-exec.
+    *
+    * Once attached, messages are exchanged with no system calls
+    * except to wake a process that is blocked in a _wait() call.
+    * Only copy-in/copy-out and reserve/claim messages make sense
+    * between processes; pointers do not. The nq_time of a message
+    * is relative to the osal_timer_init() of the process that sent
+    * it.
+    *
+    * All processes must be built for the same architecture. Each
+    * process calls osal_ccq_del() on its own handle; the queue
+    * itself persists until the name is removed with
+    * osal_ccq_shm_unlink() (or the last memfd is closed).
+    *
+    * Returns NULL on error. Not supported on Windows.
+    */
+   osal_ccq_t *osal_ccq_shm_new (const char *name, size_t nelements, size_t elem_size);
+   osal_ccq_t *osal_ccq_shm_open (const char *name);
+   osal_ccq_t *osal_ccq_shm_open_fd (int fd);
+   bool osal_ccq_shm_unlink (const char *name);
+
+   /* Returns the file descriptor of a shared memory queue, or -1
+    * for an in-process queue. The descriptor remains owned by the
+    * queue.
+    */
+   int osal_ccq_shm_fd (osal_ccq_t *ccq);
+
+   /* Returns a file descriptor (a Linux eventfd) that becomes
+    * readable when messages are placed onto the queue, so that the
+    * queue can be waited on with poll(), select() or epoll together
+    * with sockets. Returns -1 on error or on other platforms. The
+    * descriptor is owned by the queue and is closed by
+    * osal_ccq_del().
+    *
+    * Notifications are coalesced: after the descriptor is signalled
+    * no further writes are made to it until osal_ccq_fd_ack() is
+    * called, however many messages arrive. So the consumer must:
+    *    1. call osal_ccq_fd_ack(),
+    *    2. then dequeue until the queue reports empty,
+    * once after first getting the descriptor and again every time it
+    * is reported readable.
+    *
+    * Only producers using this handle signal the descriptor; for a
+    * shared memory queue, producers in other processes do not.
+    */
+   int osal_ccq_fd (osal_ccq_t *ccq);
+   void osal_ccq_fd_ack (osal_ccq_t *ccq);
+
+   /* Start collecting statistics for all operations made through
+    * this handle. Collection costs a few relaxed atomic adds per
+    * call, plus a clock read per dequeue for the residency
+    * histogram; until this is called it costs one branch. Returns
+    * false if the counters could not be allocated. Calling it again
+    * has no effect; collection cannot be turned off.
+    */
+   bool osal_ccq_stats_enable (osal_ccq_t *ccq);
+
+   /* Place a snapshot of the statistics into dst. The depth and
+    * capacity are always filled in; the counters are zero unless
+    * osal_ccq_stats_enable() has been called. The counters are read
+    * one at a time while the queue is in use, so they are
+    * individually accurate but not necessarily consistent with each
+    * other. osal_ccq_dump() also prints them.
+    */
+   void osal_ccq_stats (osal_ccq_t *ccq, osal_ccq_stats_t *dst);
+
+   /* Delete an object of type osal_ccq_t, which is returned
+    * from a successful call to osal_ccq_new().
+    */
+   void osal_ccq_del (osal_ccq_t *ccq);
+
+   /* Place a message onto the queue, returns true on success and
+    * false if the queue is full.
+    */
+   bool osal_ccq_nq (osal_ccq_t *ccq, void *message);
+
+   /* Retrieves a message from the queue. Returns true on
+    * success and false if there are no messages. Errors are
+    * not possible.
+    *
+    * The message is placed in dst, the time that the message
+    * was added to the queue is placed in 'nq_time'. This is in
+    * nanoseconds, from osal_timer_since_start_ns(), so that the
+    * time a message spent on the queue can be measured even when
+    * it is well under a microsecond.
+    *
+    * If nq_time is NULL, it is ignored. The parameter dst
+    * must point to a valid pointer.
+    */
+   bool osal_ccq_dq (osal_ccq_t *ccq, void **dst, uint64_t *nq_time);
+
+   /* Place up to n messages from the array msgs onto the queue,
+    * in order. All the messages share a single enqueue time and
+    * the free slots are claimed in one go. Returns the number of
+    * messages placed onto the queue, which is less than n if the
+    * queue did not have room for all of them (zero if it is full).
+    * The messages that were not placed are msgs[ret] onwards.
+    */
+   size_t osal_ccq_nq_n (osal_ccq_t *ccq, void **msgs, size_t n);
+
+   /* Retrieve up to max messages from the queue into the array
+    * dst, in order, claiming them in one go. The enqueue time of
+    * each message is placed in the corresponding element of times
+    * (see osal_ccq_dq()) unless times is NULL. Returns the number
+    * of messages retrieved, zero if the queue is empty.
+    */
+   size_t osal_ccq_dq_n (osal_ccq_t *ccq, void **dst, uint64_t *times, size_t max);
+
+   /* As osal_ccq_nq(), but if the queue is full the calling thread
+    * sleeps until a consumer frees a slot or until timeout_us
+    * microseconds have passed. Use OSAL_CCQ_WAIT_FOREVER for no
+    * timeout. Returns false only on timeout, or at once (as
+    * osal_ccq_nq() does) if the elements are not pointers.
+    */
+   bool osal_ccq_nq_wait (osal_ccq_t *ccq, void *message, uint64_t timeout_us);
+
+   /* As osal_ccq_dq(), but if the queue is empty the calling thread
+    * sleeps until a producer adds a message or until timeout_us
+    * microseconds have passed. Use OSAL_CCQ_WAIT_FOREVER for no
+    * timeout. Returns false only on timeout, or at once (as
+    * osal_ccq_dq() does) if the elements are not pointers.
+    *
+    * Sleeping threads do not use any CPU. Producers only make the
+    * wakeup system call when there is a thread waiting.
+    */
+   bool osal_ccq_dq_wait (osal_ccq_t *ccq, void **dst, uint64_t *nq_time,
+                          uint64_t timeout_us);
+
+   /* Copy elem_size bytes from src into the next free slot of a
+    * queue created with osal_ccq_new_sized(). Returns true on
+    * success and false if the queue is full.
+    */
+   bool osal_ccq_nq_data (osal_ccq_t *ccq, const void *src);
+
+   /* Copy the next message (elem_size bytes) of a queue created with
+    * osal_ccq_new_sized() into dst. Returns true on success and false
+    * if there are no messages. The enqueue time is placed in nq_time
+    * unless it is NULL.
+    */
+   bool osal_ccq_dq_data (osal_ccq_t *ccq, void *dst, uint64_t *nq_time);
+
+   /* Zero-copy enqueue. osal_ccq_reserve() returns a pointer to the
+    * elem_size bytes of the next free slot, or NULL if the queue is
+    * full. The producer builds the message in place and then passes
+    * the same pointer to osal_ccq_commit() to publish it.
+    *
+    * Consumers cannot see a reserved slot, nor any slot reserved
+    * after it, until it is committed, so commit promptly.
+    */
+   void *osal_ccq_reserve (osal_ccq_t *ccq);
+   void osal_ccq_commit (osal_ccq_t *ccq, void *payload);
+
+   /* Zero-copy dequeue. osal_ccq_claim() returns a pointer to the
+    * elem_size bytes of the next message, or NULL if the queue is
+    * empty, and places the enqueue time in nq_time unless it is
+    * NULL. The consumer reads the message in place and then passes
+    * the same pointer to osal_ccq_release() to hand the slot back.
+    */
+   const void *osal_ccq_claim (osal_ccq_t *ccq, uint64_t *nq_time);
+   void osal_ccq_release (osal_ccq_t *ccq, const void *payload);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
+
@@ -0,0 +1,74 @@
+
+#ifndef H_OSAL_OBJPOOL
+#define H_OSAL_OBJPOOL
+
+/* A pool of pre-created objects. All the objects are allocated once, in
+ * a single block with each object on its own cache lines, and optionally
+ * initialised by the caller at creation time; after that, acquiring and
+ * releasing an object never allocates, and the object keeps whatever
+ * state its last user left in it.
+ *
+ * Free objects live on a lock-free stack whose head carries a tag
+ * against ABA. In front of that, each thread keeps a small magazine of
+ * free objects, so that a thread that releases and re-acquires objects
+ * does not touch the shared stack at all, and needs no locks or atomic
+ * read-modify-writes to use its own magazine. A pool has a fixed number
+ * of magazines, which threads claim on first use of the pool and give
+ * up when they exit (see osal_thread_slot()); threads that find them
+ * all taken use the shared stack. When the magazine and the stack are
+ * both empty, an acquire takes objects from other threads' magazines
+ * before giving up, so no object is ever stranded in the magazine of a
+ * thread that is idle or has gone away.
+ */
+typedef struct osal_objpool_t osal_objpool_t;
+
+// Called once for every object when the pool is created (init) and
+// deleted (fini). init returns false to fail the creation.
+typedef bool (osal_objpool_init_t) (void *object, void *param);
+typedef void (osal_objpool_fini_t) (void *object, void *param);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_objpool_dump (osal_objpool_t *pool);
+
+   /* Create a pool of nobjects objects of obj_size bytes each, calling
+    * init (if not NULL) on each one. fini (if not NULL) is called on
+    * each one by osal_objpool_del(). Returns NULL on error.
+    */
+   osal_objpool_t *osal_objpool_new (size_t nobjects, size_t obj_size,
+                                     osal_objpool_init_t *init,
+                                     osal_objpool_fini_t *fini,
+                                     void *param);
+
+   /* Delete an object of type osal_objpool_t, which is returned from
+    * a successful call to osal_objpool_new(). Every object must have
+    * been released.
+    */
+   void osal_objpool_del (osal_objpool_t *pool);
+
+   /* Take a free object from the pool. Returns NULL if every object is
+    * in use.
+    */
+   void *osal_objpool_acquire (osal_objpool_t *pool);
+
+   /* As osal_objpool_acquire(), but if every object is in use wait up
+    * to timeout_us microseconds ((uint64_t)-1 waits with no timeout)
+    * for one to be released. Returns NULL on timeout.
+    */
+   void *osal_objpool_acquire_wait (osal_objpool_t *pool, uint64_t timeout_us);
+
+   /* Return an object obtained from osal_objpool_acquire() to the
+    * pool.
+    */
+   void osal_objpool_release (osal_objpool_t *pool, void *object);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
+
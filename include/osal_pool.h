@@ -0,0 +1,76 @@
+
+#ifndef H_OSAL_POOL
+#define H_OSAL_POOL
+
+/* A thread pool: a fixed set of worker threads, created once, that run
+ * small tasks submitted by any thread. Submitting a task does not
+ * create a thread or allocate memory.
+ *
+ * Each worker owns a work-stealing (Chase-Lev) deque. Tasks submitted
+ * from inside a task go onto the submitting worker's own deque, and
+ * are run by that worker newest-first; tasks submitted from any other
+ * thread go onto a shared injector queue. A worker with nothing of its
+ * own to do takes from the injector and then steals the oldest task
+ * from randomly chosen workers, and only sleeps (on a futex) once all
+ * of those are empty.
+ *
+ * There is no ordering between tasks.
+ */
+typedef struct osal_pool_t osal_pool_t;
+
+typedef void (osal_pool_task_t) (void *);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_pool_dump (osal_pool_t *pool);
+
+   /* Create a pool of nworkers threads (one per online CPU if nworkers
+    * is zero). Each worker's deque, and the injector queue, holds
+    * nelements tasks (rounded up to a power of two). Returns NULL on
+    * error.
+    */
+   osal_pool_t *osal_pool_new (size_t nworkers, size_t nelements);
+
+   /* Wait for all outstanding tasks, then stop the workers and delete
+    * an object of type osal_pool_t, which is returned from a
+    * successful call to osal_pool_new().
+    */
+   void osal_pool_del (osal_pool_t *pool);
+
+   /* Run fptr(param) on one of the workers. If the queue the task
+    * would go on is full, the task is run immediately on the calling
+    * thread instead, so this always succeeds.
+    */
+   void osal_pool_submit (osal_pool_t *pool, osal_pool_task_t *fptr, void *param);
+
+   /* Block until every task submitted so far (and every task those
+    * tasks submit) has completed. Must not be called from inside a
+    * task, as the calling task is itself outstanding; use
+    * osal_pool_join() there.
+    */
+   void osal_pool_wait_all (osal_pool_t *pool);
+
+   /* As osal_pool_submit(), but *join is incremented now and
+    * decremented once the task has completed. Zero *join before
+    * the first submit.
+    */
+   void osal_pool_submit_join (osal_pool_t *pool, osal_pool_task_t *fptr,
+                               void *param, size_t *join);
+
+   /* Wait until *join drops to zero, i.e. until all the tasks submitted
+    * against it have completed. The caller runs pending tasks while
+    * waiting, so this is safe to call from inside a task (fork-join)
+    * and from any other thread.
+    */
+   void osal_pool_join (osal_pool_t *pool, size_t *join);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
+
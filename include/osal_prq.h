@@ -0,0 +1,54 @@
+#ifndef H_OSAL_PRQ
+#define H_OSAL_PRQ
+
+/* A bounded concurrent priority queue with a small, fixed number of
+ * priority levels. Each level is an osal_ccq_t, and a bitmap records
+ * which levels may be non-empty, so that a dequeue finds the highest
+ * non-empty level with a single bit-scan instead of polling every
+ * level. Messages of the same priority are FIFO.
+ *
+ * Priority 0 is the highest.
+ */
+typedef struct osal_prq_t osal_prq_t;
+
+// The maximum number of priority levels a queue can have.
+#define OSAL_PRQ_MAX_LEVELS      32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_prq_dump (osal_prq_t *prq);
+
+   /* Create a priority queue with nlevels priority levels (at most
+    * OSAL_PRQ_MAX_LEVELS), each of which can hold nelements
+    * messages. Returns NULL on error.
+    */
+   osal_prq_t *osal_prq_new (size_t nlevels, size_t nelements);
+
+   /* Delete an object of type osal_prq_t, which is returned from a
+    * successful call to osal_prq_new().
+    */
+   void osal_prq_del (osal_prq_t *prq);
+
+   /* Place a message onto the queue at the given priority. Returns
+    * true on success and false if that priority level is full or
+    * the priority is out of range.
+    */
+   bool osal_prq_nq (osal_prq_t *prq, void *message, size_t priority);
+
+   /* Retrieve the oldest message of the highest priority present.
+    * Returns true on success and false if the queue is empty. See
+    * osal_ccq_dq() for dst and nq_time. The message's priority is
+    * placed in priority unless it is NULL.
+    */
+   bool osal_prq_dq (osal_prq_t *prq, void **dst, uint64_t *nq_time,
+                     size_t *priority);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
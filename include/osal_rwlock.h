@@ -0,0 +1,97 @@
+
+#ifndef H_OSAL_RWLOCK
+#define H_OSAL_RWLOCK
+
+/* Two locks for read-mostly data.
+ *
+ * osal_rwlock_t is a reader-writer lock whose reader counts are spread
+ * over many cache lines (the calling thread's osal_thread_index()
+ * chooses the line), so that readers on different threads do not
+ * write to the same cache line. Taking a read lock while no writer is
+ * active is one atomic add on the reader's own line. Writers are
+ * expensive: a writer waits for every reader count to drain. Writers
+ * take priority over new readers.
+ *
+ * osal_seqlock_t is a sequence lock for small plain data that is
+ * copied out by readers. Readers never write shared memory at all;
+ * instead they retry if a writer was active while they copied. Writers
+ * never wait for readers.
+ */
+typedef struct osal_rwlock_t osal_rwlock_t;
+
+// Treat the fields as private; they are only here so that a seqlock
+// can be declared without an allocation. Zero-initialise (or call
+// osal_seqlock_init()) before use.
+typedef struct osal_seqlock_t {
+   uint32_t seq;
+   uint32_t lock;
+} osal_seqlock_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_rwlock_dump (osal_rwlock_t *rwlock);
+
+   /* Create a reader-writer lock. Returns NULL on error.
+    */
+   osal_rwlock_t *osal_rwlock_new (void);
+
+   /* Delete an object of type osal_rwlock_t, which is returned from
+    * a successful call to osal_rwlock_new(). It must not be held.
+    */
+   void osal_rwlock_del (osal_rwlock_t *rwlock);
+
+   /* Take and release a shared (read) lock. Any number of threads may
+    * hold the read lock at once. Not recursive: a thread holding the
+    * read lock must not take it again, as a waiting writer would block
+    * the second acquisition.
+    */
+   void osal_rwlock_read_lock (osal_rwlock_t *rwlock);
+   void osal_rwlock_read_unlock (osal_rwlock_t *rwlock);
+
+   /* Take and release the exclusive (write) lock.
+    */
+   void osal_rwlock_write_lock (osal_rwlock_t *rwlock);
+   void osal_rwlock_write_unlock (osal_rwlock_t *rwlock);
+
+
+   void osal_seqlock_init (osal_seqlock_t *seqlock);
+
+   /* A read section looks like:
+    *
+    *    uint32_t seq;
+    *    do {
+    *       seq = osal_seqlock_read_begin (&lock);
+    *       ... copy the data out ...
+    *    } while (osal_seqlock_read_retry (&lock, seq));
+    *
+    * The copy may see a torn value (it is retried), so nothing read
+    * inside the section may be dereferenced or otherwise trusted until
+    * osal_seqlock_read_retry() returns false.
+    */
+   uint32_t osal_seqlock_read_begin (osal_seqlock_t *seqlock);
+   bool osal_seqlock_read_retry (osal_seqlock_t *seqlock, uint32_t seq);
+
+   /* Bracket an update of the protected data. Writers are serialised
+    * with each other by a fast mutex.
+    */
+   void osal_seqlock_write_begin (osal_seqlock_t *seqlock);
+   void osal_seqlock_write_end (osal_seqlock_t *seqlock);
+
+   /* Convenience wrappers that copy len bytes between the protected
+    * data and a private copy, inside a complete read or write section.
+    */
+   void osal_seqlock_read (osal_seqlock_t *seqlock, void *dst,
+                           const void *src, size_t len);
+   void osal_seqlock_write (osal_seqlock_t *seqlock, void *dst,
+                            const void *src, size_t len);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
+
@@ -0,0 +1,77 @@
+#ifndef H_OSAL_SHQ
+#define H_OSAL_SHQ
+
+/* A sharded queue: a set of osal_ccq_t lanes that look like a single
+ * queue to callers. Each producer registers with the queue and is given
+ * its own lane, and each consumer registers and is given a home lane,
+ * which it drains first, stealing from the other lanes in round-robin
+ * order only when the home lane is empty. Lanes are handed out to the
+ * least used first, so with at least as many lanes as registered
+ * producers, producers never contend with each other.
+ *
+ * A producer or consumer handle must only be used by one thread at a
+ * time.
+ *
+ * Messages are only ever in FIFO order within a lane; there is no
+ * ordering between lanes.
+ */
+typedef struct osal_shq_t osal_shq_t;
+
+// By default, a producer whose own lane is full spills over onto the
+// other lanes. With this flag it never does, so all the messages from
+// one producer stay in one lane, in the order they were sent; the
+// enqueue fails instead when that lane is full.
+#define OSAL_SHQ_FIFO_PER_LANE      (1 << 0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_shq_dump (osal_shq_t *shq);
+
+   /* Create a sharded queue of nlanes lanes, each of which holds
+    * lane_elements messages. The flags are zero or more of the
+    * OSAL_SHQ_* flags above. Returns NULL on error.
+    */
+   osal_shq_t *osal_shq_new (size_t nlanes, size_t lane_elements, unsigned flags);
+
+   /* Delete an object of type osal_shq_t, which is returned from
+    * a successful call to osal_shq_new().
+    */
+   void osal_shq_del (osal_shq_t *shq);
+
+   /* Register a producer or a consumer, returning its handle, which
+    * is the lane it was given: the lane with the fewest producers (or
+    * consumers) registered on it. When there are more producers than
+    * lanes some of them share a lane, which is still correct but
+    * contended.
+    */
+   size_t osal_shq_producer_add (osal_shq_t *shq);
+   size_t osal_shq_consumer_add (osal_shq_t *shq);
+
+   /* Unregister a producer or consumer, so that its lane can be given
+    * to the next one to register. The handle must not be used again.
+    */
+   void osal_shq_producer_remove (osal_shq_t *shq, size_t producer);
+   void osal_shq_consumer_remove (osal_shq_t *shq, size_t consumer);
+
+   /* Place a message onto the producer's lane. Returns true on success
+    * and false if the queue is full.
+    */
+   bool osal_shq_nq (osal_shq_t *shq, size_t producer, void *message);
+
+   /* Retrieve a message from the consumer's home lane, or from any
+    * other lane if the home lane is empty. Returns true on success and
+    * false if every lane is empty. See osal_ccq_dq() for dst and
+    * nq_time.
+    */
+   bool osal_shq_dq (osal_shq_t *shq, size_t consumer,
+                     void **dst, uint64_t *nq_time);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
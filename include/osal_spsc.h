@@ -0,0 +1,55 @@
+#ifndef H_OSAL_SPSC
+#define H_OSAL_SPSC
+
+/* A bounded single-producer/single-consumer queue. Exactly one thread
+ * may call osal_spsc_nq() and exactly one (other) thread may call
+ * osal_spsc_dq() on the same queue. For any other arrangement of
+ * threads use osal_ccq_t instead.
+ *
+ * Neither side performs an atomic read-modify-write; the producer and
+ * consumer indices live on separate cache lines and each side keeps a
+ * cached copy of the other side's index, so the shared lines are only
+ * touched when the cached copy says the queue is full (or empty).
+ */
+typedef struct osal_spsc_t osal_spsc_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_spsc_dump (osal_spsc_t *spsc);
+
+   /* Create a bounded queue of nelements. Returns NULL
+    * on error or a pointer to an object of type osal
+    * spsc_t on success. A power-of-two nelements avoids a
+    * division on every call.
+    */
+   osal_spsc_t *osal_spsc_new (size_t nelements);
+
+   /* Delete an object of type osal_spsc_t, which is returned
+    * from a successful call to osal_spsc_new().
+    */
+   void osal_spsc_del (osal_spsc_t *spsc);
+
+   /* Place a message onto the queue, returns true on success and
+    * false if the queue is full. Must only be called from the
+    * producer thread.
+    */
+   bool osal_spsc_nq (osal_spsc_t *spsc, void *message);
+
+   /* Retrieves a message from the queue. Returns true on
+    * success and false if there are no messages. Must only be
+    * called from the consumer thread.
+    *
+    * The message is placed in dst, which must point to a valid
+    * pointer.
+    */
+   bool osal_spsc_dq (osal_spsc_t *spsc, void **dst);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,152 @@
+
+#ifndef H_OSAL_TIMER
+#define H_OSAL_TIMER
+
+
+typedef struct osal_timer_t osal_timer_t;
+
+// Clock sources, see osal_timer_clock_select().
+#define OSAL_TIMER_CLOCK_AUTO       0
+#define OSAL_TIMER_CLOCK_OS         1
+#define OSAL_TIMER_CLOCK_TSC        2
+
+// Convenience macros to convert to/from microseconds
+#define osal_timer_convert_us_to_s(x)\
+   (double)((double)x / 1000000.0)
+#define osal_timer_convert_us_to_ms(x)\
+   (double)((double)x * 1000.0)
+#define osal_timer_convert_s_to_us(x)\
+   (uint64_t)((uint64_t)x * (uint64_t)1000000ULL)
+#define osal_timer_convert_ms_to_us(x)\
+   (uint64_t)((uint64_t)x * (uint64_t)1000ULL)
+
+// Convenience macros to convert to/from nanoseconds
+#define osal_timer_convert_ns_to_s(x)\
+   (double)((double)x / 1000000000.0)
+#define osal_timer_convert_ns_to_us(x)\
+   (uint64_t)((uint64_t)x / (uint64_t)1000ULL)
+#define osal_timer_convert_us_to_ns(x)\
+   (uint64_t)((uint64_t)x * (uint64_t)1000ULL)
+#define osal_timer_convert_ms_to_ns(x)\
+   (uint64_t)((uint64_t)x * (uint64_t)1000000ULL)
+#define osal_timer_convert_s_to_ns(x)\
+   (uint64_t)((uint64_t)x * (uint64_t)1000000000ULL)
+
+// A stopwatch for timing the laps of a loop. Treat the fields as
+// private; the structure is public so that stopwatches can be declared
+// on the stack or embedded in other objects without allocating. A
+// stopwatch belongs to the thread that uses it.
+typedef struct osal_stopwatch_t {
+   uint64_t start_ns;
+   uint64_t lap_ns;
+} osal_stopwatch_t;
+
+// Totals of lap times. Each accumulator must only be written by one
+// thread (normally one per thread per thing being timed), but may be
+// read at any time by any thread with osal_stopwatch_acc_merge().
+typedef struct osal_stopwatch_acc_t {
+   uint64_t count;
+   uint64_t total_ns;
+   uint64_t min_ns;           // UINT64_MAX while count is zero.
+   uint64_t max_ns;
+} osal_stopwatch_acc_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Initialise all the timer structures and values. This selects
+   // the clock with OSAL_TIMER_CLOCK_AUTO, which takes about 20ms to
+   // calibrate the TSC when there is one.
+   void osal_timer_init (void);
+
+   // Choose the clock behind every timer function:
+   //    OSAL_TIMER_CLOCK_OS     CLOCK_MONOTONIC (QueryPerformanceCounter
+   //                            on Windows).
+   //    OSAL_TIMER_CLOCK_TSC    The CPU timestamp counter, calibrated
+   //                            against the OS clock the first time it
+   //                            is selected (concurrent callers wait for
+   //                            that one calibration). Only x86-64 CPUs
+   //                            with an invariant TSC.
+   //    OSAL_TIMER_CLOCK_AUTO   The TSC if it is usable, else the OS
+   //                            clock.
+   // Returns false, leaving the clock unchanged, if the requested clock
+   // is not usable. Until the first call, the OS clock is used.
+   //
+   // The two clocks only agree at the moment of calibration, so time
+   // may jump, forwards or backwards, at any later switch. Select the
+   // clock once, before taking timestamps or setting timers; a
+   // timestamp or timer must not span a clock switch.
+   bool osal_timer_clock_select (int clock);
+
+   // Returns the clock in use (never OSAL_TIMER_CLOCK_AUTO), and its
+   // name for display.
+   int osal_timer_clock (void);
+   const char *osal_timer_clock_name (int clock);
+
+   // Returns the number of microseconds that have elapsed since this
+   // function was last called on the calling thread. Each thread has
+   // its own mark: on a thread's first call it returns 0, except on
+   // the thread that called osal_timer_init(), where it returns the
+   // number of microseconds since then. For anything more than one
+   // interval per thread, use an osal_stopwatch_t.
+   uint64_t osal_timer_mark_us (void);
+
+   // Returns the number of microseconds since the program init().
+   uint64_t osal_timer_since_start (void);
+
+   // The same as osal_timer_mark_us() and osal_timer_since_start(), in
+   // nanoseconds. The mark is per thread too, and separate from the
+   // microsecond mark. Use these to time anything that may take less than a
+   // microsecond; the microsecond calls truncate it to zero.
+   uint64_t osal_timer_mark_ns (void);
+   uint64_t osal_timer_since_start_ns (void);
+
+   // Sets a timer for expiry in the future, in us. The caller must
+   // use osal_timer_expired() to determine if the timer has expired.
+   // Use reset() for reusing an existing timer, or set() for
+   // allocating a new timer
+   osal_timer_t *osal_timer_set (uint64_t micros);
+   bool osal_timer_reset (osal_timer_t *xt, uint64_t micros);
+
+   // The same as osal_timer_set() and osal_timer_reset(), in ns. Timers
+   // keep their expiry in nanoseconds whichever call set them.
+   osal_timer_t *osal_timer_set_ns (uint64_t nanos);
+   bool osal_timer_reset_ns (osal_timer_t *xt, uint64_t nanos);
+
+   // Start (or restart) a stopwatch; this also starts its first lap.
+   void osal_stopwatch_start (osal_stopwatch_t *sw);
+
+   // Returns the nanoseconds since the last lap ended (or since the
+   // start), and starts the next lap.
+   uint64_t osal_stopwatch_lap_ns (osal_stopwatch_t *sw);
+
+   // Returns the nanoseconds since the stopwatch was started.
+   uint64_t osal_stopwatch_elapsed_ns (const osal_stopwatch_t *sw);
+
+   // Empty an accumulator, add one time to it, or end a lap of the
+   // stopwatch and add the lap time to it (returning the lap time).
+   void osal_stopwatch_acc_init (osal_stopwatch_acc_t *acc);
+   void osal_stopwatch_acc_add (osal_stopwatch_acc_t *acc, uint64_t ns);
+   uint64_t osal_stopwatch_lap_acc (osal_stopwatch_t *sw,
+                                    osal_stopwatch_acc_t *acc);
+
+   // Add the totals of src to dst. src may be in use by its own thread
+   // meanwhile; dst must not be.
+   void osal_stopwatch_acc_merge (osal_stopwatch_acc_t *dst,
+                                  const osal_stopwatch_acc_t *src);
+
+   // Check if a timer expired. Timer must have been set with
+   // osal_timer_set() above.
+   bool osal_timer_expired (osal_timer_t *xt);
+
+   // Cancel and delete a timer.
+   void osal_timer_del (osal_timer_t *xt);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
+
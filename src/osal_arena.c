@@ -0,0 +1,268 @@
+
+#if 1
+#ifdef PLATFORM_POSIX
+#define _GNU_SOURCE 200809L
+#endif
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#ifdef PLATFORM_Windows
+#include <malloc.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "osal_arena.h"
+#include "osal_thread.h"
+#include "osal_atomic.h"
+
+#define CACHELINE_SIZE     64
+
+// Slabs are SLAB_SIZE bytes and aligned to SLAB_SIZE, so the slab (and
+// its header) of any object is found by masking the object's address.
+// Large objects get a block of their own, also SLAB_SIZE-aligned, with
+// the same header.
+#define SLAB_SIZE          ((size_t)64 * 1024)
+#define SLAB_HDR_SIZE      CACHELINE_SIZE
+
+// Size classes are powers of two from 16 to 16384 bytes; even the
+// largest leaves a 64k slab three quarters full. Only bigger objects
+// get a block of their own, whose SLAB_SIZE alignment then costs at
+// most four times their size in address space.
+#define CLASS_MIN_SHIFT    4
+#define CLASS_COUNT        11
+#define CLASS_LARGE        CLASS_COUNT
+
+struct arena_slab_t {
+   struct arena_heap_t *heap;
+   uint32_t size_class;
+};
+
+// A free object is a link in one of the free lists.
+struct arena_free_t {
+   struct arena_free_t *next;
+};
+
+// The owner's fields and the remote list (written by other threads)
+// are on separate cache lines.
+struct arena_class_t {
+   struct arena_free_t *local;
+   uint8_t *bump;
+   uint8_t *end;
+   uint8_t pad_local[CACHELINE_SIZE - 3 * sizeof (void *)];
+   void *remote;
+   uint8_t pad_remote[CACHELINE_SIZE - sizeof (void *)];
+};
+
+struct arena_heap_t {
+   struct arena_class_t classes[CLASS_COUNT];
+   struct arena_heap_t *next_abandoned;
+};
+
+static OSAL_THREAD_LOCAL struct arena_heap_t *arena_self;
+
+// Heaps of threads that have exited, waiting to be adopted.
+static struct arena_heap_t *arena_abandoned;
+static uint32_t arena_abandoned_lock;
+
+static uint64_t arena_nheaps;
+static uint64_t arena_nslabs;
+static uint64_t arena_nlarge;
+
+static void *arena_block_alloc (size_t size)
+{
+#ifdef PLATFORM_Windows
+   return _aligned_malloc (size, SLAB_SIZE);
+#else
+   void *ret = NULL;
+   return posix_memalign (&ret, SLAB_SIZE, size) == 0 ? ret : NULL;
+#endif
+}
+
+static void arena_block_free (void *block)
+{
+#ifdef PLATFORM_Windows
+   _aligned_free (block);
+#else
+   free (block);
+#endif
+}
+
+static struct arena_slab_t *arena_slab (void *ptr)
+{
+   return (struct arena_slab_t *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static size_t arena_class (size_t size)
+{
+   size_t c = 0;
+   while (c < CLASS_COUNT && ((size_t)1 << (c + CLASS_MIN_SHIFT)) < size) {
+      c++;
+   }
+   return c;
+}
+
+/* On POSIX a thread-specific key destructor hands the heap of an
+ * exiting thread to the abandoned list. Windows has no equivalent for
+ * plain TLS, so there the heap of an exiting thread is leaked.
+ */
+#ifdef PLATFORM_POSIX
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void arena_abandon (void *param)
+{
+   struct arena_heap_t *heap = param;
+   arena_self = NULL;
+
+   osal_ftex_lock (&arena_abandoned_lock, "arena");
+   heap->next_abandoned = arena_abandoned;
+   arena_abandoned = heap;
+   osal_ftex_unlock (&arena_abandoned_lock, "arena");
+}
+
+static void arena_key_create (void)
+{
+   pthread_key_create (&arena_key, arena_abandon);
+}
+#endif
+
+static struct arena_heap_t *arena_heap_slow (void)
+{
+   struct arena_heap_t *heap;
+
+   osal_ftex_lock (&arena_abandoned_lock, "arena");
+   if ((heap = arena_abandoned)) {
+      arena_abandoned = heap->next_abandoned;
+      heap->next_abandoned = NULL;
+   }
+   osal_ftex_unlock (&arena_abandoned_lock, "arena");
+
+   if (!heap) {
+      if (!(heap = calloc (1, sizeof *heap))) {
+         return NULL;
+      }
+      osal_atomic_fetch_add_u64 (&arena_nheaps, 1, OSAL_ATOMIC_RELAXED);
+   }
+
+#ifdef PLATFORM_POSIX
+   pthread_once (&arena_key_once, arena_key_create);
+   pthread_setspecific (arena_key, heap);
+#endif
+
+   return arena_self = heap;
+}
+
+static struct arena_heap_t *arena_heap (void)
+{
+   return arena_self ? arena_self : arena_heap_slow ();
+}
+
+static void *arena_refill (struct arena_heap_t *heap, struct arena_class_t *cls,
+                           size_t c)
+{
+   size_t size = (size_t)1 << (c + CLASS_MIN_SHIFT);
+
+   // Everything freed by other threads since the last refill.
+   struct arena_free_t *remote = osal_atomic_xchg_ptr (&cls->remote, NULL,
+                                                       OSAL_ATOMIC_ACQUIRE);
+   if (remote) {
+      cls->local = remote->next;
+      return remote;
+   }
+
+   struct arena_slab_t *slab = arena_block_alloc (SLAB_SIZE);
+   if (!slab) {
+      return NULL;
+   }
+   osal_atomic_fetch_add_u64 (&arena_nslabs, 1, OSAL_ATOMIC_RELAXED);
+
+   slab->heap = heap;
+   slab->size_class = (uint32_t)c;
+   cls->bump = (uint8_t *)slab + SLAB_HDR_SIZE + size;
+   cls->end = (uint8_t *)slab + SLAB_SIZE;
+   return (uint8_t *)slab + SLAB_HDR_SIZE;
+}
+
+void osal_arena_dump (void)
+{
+   fprintf (stdout, "heaps:          %" PRIu64 "\n",
+            osal_atomic_load_u64 (&arena_nheaps, OSAL_ATOMIC_RELAXED));
+   fprintf (stdout, "slabs:          %" PRIu64 " (%zu bytes each)\n",
+            osal_atomic_load_u64 (&arena_nslabs, OSAL_ATOMIC_RELAXED), SLAB_SIZE);
+   fprintf (stdout, "large:          %" PRIu64 "\n",
+            osal_atomic_load_u64 (&arena_nlarge, OSAL_ATOMIC_RELAXED));
+}
+
+void *osal_arena_alloc (size_t size)
+{
+   size_t c = arena_class (size);
+
+   if (c == CLASS_LARGE) {
+      if (size > SIZE_MAX - SLAB_HDR_SIZE) {
+         return NULL;
+      }
+      struct arena_slab_t *slab = arena_block_alloc (SLAB_HDR_SIZE + size);
+      if (!slab) {
+         return NULL;
+      }
+      osal_atomic_fetch_add_u64 (&arena_nlarge, 1, OSAL_ATOMIC_RELAXED);
+      slab->heap = NULL;
+      slab->size_class = CLASS_LARGE;
+      return (uint8_t *)slab + SLAB_HDR_SIZE;
+   }
+
+   struct arena_heap_t *heap = arena_heap ();
+   if (!heap) {
+      return NULL;
+   }
+
+   struct arena_class_t *cls = &heap->classes[c];
+   struct arena_free_t *ret = cls->local;
+   if (ret) {
+      cls->local = ret->next;
+      return ret;
+   }
+
+   size_t csize = (size_t)1 << (c + CLASS_MIN_SHIFT);
+   if (cls->bump && cls->bump + csize <= cls->end) {
+      void *bumped = cls->bump;
+      cls->bump += csize;
+      return bumped;
+   }
+
+   return arena_refill (heap, cls, c);
+}
+
+void osal_arena_free (void *ptr)
+{
+   if (!ptr) {
+      return;
+   }
+
+   struct arena_slab_t *slab = arena_slab (ptr);
+   if (slab->size_class == CLASS_LARGE) {
+      arena_block_free (slab);
+      return;
+   }
+
+   struct arena_free_t *obj = ptr;
+   struct arena_class_t *cls = &slab->heap->classes[slab->size_class];
+   if (slab->heap == arena_self) {
+      obj->next = cls->local;
+      cls->local = obj;
+      return;
+   }
+
+   void *head = osal_atomic_load_ptr (&cls->remote, OSAL_ATOMIC_RELAXED);
+   do {
+      obj->next = head;
+   } while (!(osal_atomic_cas_weak_ptr (&cls->remote, &head, obj,
+                                        OSAL_ATOMIC_RELEASE, OSAL_ATOMIC_RELAXED)));
+}
+
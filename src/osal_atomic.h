@@ -0,0 +1,338 @@
+
+#ifndef H_OSAL_ATOMIC
+#define H_OSAL_ATOMIC
+
+/* Atomic operations on 32-bit and 64-bit integers (unsigned and
+ * signed), size_t and pointer-sized values, as
+ * static inline functions so that each one compiles down to a single
+ * instruction (or a short LL/SC loop) at the call site, with no
+ * function call and no stronger ordering than the caller asks for.
+ *
+ * Every operation takes the memory order(s) to use, one of the
+ * OSAL_ATOMIC_* orders below. Pass a constant; the compiler falls
+ * back to SEQ_CST if it cannot see the value.
+ *
+ * These are thin wrappers around the GCC/clang __atomic builtins,
+ * which the rest of the library also relies on.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OSAL_ATOMIC_RELAXED      __ATOMIC_RELAXED
+#define OSAL_ATOMIC_ACQUIRE      __ATOMIC_ACQUIRE
+#define OSAL_ATOMIC_RELEASE      __ATOMIC_RELEASE
+#define OSAL_ATOMIC_ACQ_REL      __ATOMIC_ACQ_REL
+#define OSAL_ATOMIC_SEQ_CST      __ATOMIC_SEQ_CST
+
+// Tell the CPU that the caller is spinning (x86 PAUSE, ARM YIELD), to
+// save power and let a sibling hyperthread run.
+static inline void osal_cpu_relax (void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+   __builtin_ia32_pause ();
+#elif defined (__aarch64__) || defined (__arm__)
+   __asm__ __volatile__ ("yield" ::: "memory");
+#else
+   __atomic_signal_fence (__ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void osal_atomic_fence (int order)
+{
+   __atomic_thread_fence (order);
+}
+
+/* ***************************************************** */
+// 32-bit
+
+static inline uint32_t osal_atomic_load_u32 (const uint32_t *target, int order)
+{
+   return __atomic_load_n (target, order);
+}
+
+static inline void osal_atomic_store_u32 (uint32_t *target, uint32_t value, int order)
+{
+   __atomic_store_n (target, value, order);
+}
+
+static inline uint32_t osal_atomic_xchg_u32 (uint32_t *target, uint32_t value, int order)
+{
+   return __atomic_exchange_n (target, value, order);
+}
+
+// The fetch_* functions return the value before the operation.
+static inline uint32_t osal_atomic_fetch_add_u32 (uint32_t *target, uint32_t value, int order)
+{
+   return __atomic_fetch_add (target, value, order);
+}
+
+static inline uint32_t osal_atomic_fetch_sub_u32 (uint32_t *target, uint32_t value, int order)
+{
+   return __atomic_fetch_sub (target, value, order);
+}
+
+static inline uint32_t osal_atomic_fetch_or_u32 (uint32_t *target, uint32_t value, int order)
+{
+   return __atomic_fetch_or (target, value, order);
+}
+
+static inline uint32_t osal_atomic_fetch_and_u32 (uint32_t *target, uint32_t value, int order)
+{
+   return __atomic_fetch_and (target, value, order);
+}
+
+// If *target equals *expected, store desired into it and return true.
+// Otherwise copy *target into *expected and return false. The weak
+// variant may fail spuriously, and is cheaper inside a retry loop on
+// some CPUs.
+static inline bool osal_atomic_cas_u32 (uint32_t *target, uint32_t *expected,
+                                        uint32_t desired,
+                                        int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, false,
+                                       success, failure);
+}
+
+static inline bool osal_atomic_cas_weak_u32 (uint32_t *target, uint32_t *expected,
+                                             uint32_t desired,
+                                             int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, true,
+                                       success, failure);
+}
+
+/* ***************************************************** */
+// 64-bit
+
+static inline uint64_t osal_atomic_load_u64 (const uint64_t *target, int order)
+{
+   return __atomic_load_n (target, order);
+}
+
+static inline void osal_atomic_store_u64 (uint64_t *target, uint64_t value, int order)
+{
+   __atomic_store_n (target, value, order);
+}
+
+static inline uint64_t osal_atomic_xchg_u64 (uint64_t *target, uint64_t value, int order)
+{
+   return __atomic_exchange_n (target, value, order);
+}
+
+static inline uint64_t osal_atomic_fetch_add_u64 (uint64_t *target, uint64_t value, int order)
+{
+   return __atomic_fetch_add (target, value, order);
+}
+
+static inline uint64_t osal_atomic_fetch_sub_u64 (uint64_t *target, uint64_t value, int order)
+{
+   return __atomic_fetch_sub (target, value, order);
+}
+
+static inline uint64_t osal_atomic_fetch_or_u64 (uint64_t *target, uint64_t value, int order)
+{
+   return __atomic_fetch_or (target, value, order);
+}
+
+static inline uint64_t osal_atomic_fetch_and_u64 (uint64_t *target, uint64_t value, int order)
+{
+   return __atomic_fetch_and (target, value, order);
+}
+
+static inline bool osal_atomic_cas_u64 (uint64_t *target, uint64_t *expected,
+                                        uint64_t desired,
+                                        int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, false,
+                                       success, failure);
+}
+
+static inline bool osal_atomic_cas_weak_u64 (uint64_t *target, uint64_t *expected,
+                                             uint64_t desired,
+                                             int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, true,
+                                       success, failure);
+}
+
+/* ***************************************************** */
+// size_t
+
+static inline size_t osal_atomic_load_size (const size_t *target, int order)
+{
+   return __atomic_load_n (target, order);
+}
+
+static inline void osal_atomic_store_size (size_t *target, size_t value, int order)
+{
+   __atomic_store_n (target, value, order);
+}
+
+static inline size_t osal_atomic_xchg_size (size_t *target, size_t value, int order)
+{
+   return __atomic_exchange_n (target, value, order);
+}
+
+static inline size_t osal_atomic_fetch_add_size (size_t *target, size_t value, int order)
+{
+   return __atomic_fetch_add (target, value, order);
+}
+
+static inline size_t osal_atomic_fetch_sub_size (size_t *target, size_t value, int order)
+{
+   return __atomic_fetch_sub (target, value, order);
+}
+
+static inline size_t osal_atomic_fetch_or_size (size_t *target, size_t value, int order)
+{
+   return __atomic_fetch_or (target, value, order);
+}
+
+static inline size_t osal_atomic_fetch_and_size (size_t *target, size_t value, int order)
+{
+   return __atomic_fetch_and (target, value, order);
+}
+
+static inline bool osal_atomic_cas_size (size_t *target, size_t *expected,
+                                         size_t desired,
+                                         int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, false,
+                                       success, failure);
+}
+
+static inline bool osal_atomic_cas_weak_size (size_t *target, size_t *expected,
+                                              size_t desired,
+                                              int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, true,
+                                       success, failure);
+}
+
+/* ***************************************************** */
+// Signed 32-bit
+
+static inline int32_t osal_atomic_load_i32 (const int32_t *target, int order)
+{
+   return __atomic_load_n (target, order);
+}
+
+static inline void osal_atomic_store_i32 (int32_t *target, int32_t value, int order)
+{
+   __atomic_store_n (target, value, order);
+}
+
+static inline int32_t osal_atomic_xchg_i32 (int32_t *target, int32_t value, int order)
+{
+   return __atomic_exchange_n (target, value, order);
+}
+
+static inline int32_t osal_atomic_fetch_add_i32 (int32_t *target, int32_t value, int order)
+{
+   return __atomic_fetch_add (target, value, order);
+}
+
+static inline int32_t osal_atomic_fetch_sub_i32 (int32_t *target, int32_t value, int order)
+{
+   return __atomic_fetch_sub (target, value, order);
+}
+
+static inline bool osal_atomic_cas_i32 (int32_t *target, int32_t *expected,
+                                        int32_t desired,
+                                        int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, false,
+                                       success, failure);
+}
+
+static inline bool osal_atomic_cas_weak_i32 (int32_t *target, int32_t *expected,
+                                             int32_t desired,
+                                             int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, true,
+                                       success, failure);
+}
+
+/* ***************************************************** */
+// Signed 64-bit
+
+static inline int64_t osal_atomic_load_i64 (const int64_t *target, int order)
+{
+   return __atomic_load_n (target, order);
+}
+
+static inline void osal_atomic_store_i64 (int64_t *target, int64_t value, int order)
+{
+   __atomic_store_n (target, value, order);
+}
+
+static inline int64_t osal_atomic_xchg_i64 (int64_t *target, int64_t value, int order)
+{
+   return __atomic_exchange_n (target, value, order);
+}
+
+static inline int64_t osal_atomic_fetch_add_i64 (int64_t *target, int64_t value, int order)
+{
+   return __atomic_fetch_add (target, value, order);
+}
+
+static inline int64_t osal_atomic_fetch_sub_i64 (int64_t *target, int64_t value, int order)
+{
+   return __atomic_fetch_sub (target, value, order);
+}
+
+static inline bool osal_atomic_cas_i64 (int64_t *target, int64_t *expected,
+                                        int64_t desired,
+                                        int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, false,
+                                       success, failure);
+}
+
+static inline bool osal_atomic_cas_weak_i64 (int64_t *target, int64_t *expected,
+                                             int64_t desired,
+                                             int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, true,
+                                       success, failure);
+}
+
+/* ***************************************************** */
+// Pointers
+
+static inline void *osal_atomic_load_ptr (void *const *target, int order)
+{
+   return __atomic_load_n (target, order);
+}
+
+static inline void osal_atomic_store_ptr (void **target, void *value, int order)
+{
+   __atomic_store_n (target, value, order);
+}
+
+static inline void *osal_atomic_xchg_ptr (void **target, void *value, int order)
+{
+   return __atomic_exchange_n (target, value, order);
+}
+
+static inline bool osal_atomic_cas_ptr (void **target, void **expected,
+                                        void *desired,
+                                        int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, false,
+                                       success, failure);
+}
+
+static inline bool osal_atomic_cas_weak_ptr (void **target, void **expected,
+                                             void *desired,
+                                             int success, int failure)
+{
+   return __atomic_compare_exchange_n (target, expected, desired, true,
+                                       success, failure);
+}
+
+#endif
+
+
@@ -0,0 +1,246 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_bcast.h"
+#include "osal_timer.h"
+#include "osal_atomic.h"
+
+/* All cursors only ever increase; the slot index is the cursor modulo
+ * array_len.
+ *
+ *    published               the number of messages the producer has
+ *                            published, written only by the producer
+ *    consumers[i].next       the number of messages consumer i has
+ *                            retrieved, private to consumer i
+ *    consumers[i].cursor     the number of messages consumer i has
+ *                            released, written only by consumer i
+ *
+ * Consumer i may retrieve message n once n < published and n < the
+ * cursor of every consumer it depends on. The producer may publish
+ * message n once n - array_len < the cursor of every consumer. Since
+ * only released messages count, a dependent consumer never sees a
+ * message that an upstream consumer is still working on, and the
+ * producer never overwrites one.
+ *
+ * Each side keeps a cached copy of the limit it last computed, so the
+ * other sides' cache lines are only read when the cached limit says
+ * that there is nothing more to do.
+ */
+#define CACHELINE_SIZE     64
+
+struct message_t {
+   void *message;
+   uint64_t nq_time;
+};
+
+// The cursor, which the producer and the dependent consumers poll, has
+// a cache line of its own, away from the fields only the consumer
+// itself touches. The array of consumers is cache line aligned.
+struct bcast_consumer_t {
+   size_t cursor;
+   char pad0[CACHELINE_SIZE - sizeof (size_t)];
+
+   size_t next;
+   size_t cached_limit;
+   uint64_t depends_on;    // Bit n set if gated on consumer n
+   char pad1[CACHELINE_SIZE - 2 * sizeof (size_t) - sizeof (uint64_t)];
+};
+
+struct osal_bcast_t {
+   struct message_t *array;
+   size_t array_len;
+   bool pow2;
+   uint8_t *raw;
+   struct bcast_consumer_t *consumers;
+   size_t nconsumers;
+   char pad0[CACHELINE_SIZE];
+
+   size_t published;
+   size_t cached_min;
+   char pad1[CACHELINE_SIZE - 2 * sizeof (size_t)];
+};
+
+static inline struct message_t *bcast_slot (osal_bcast_t *bcast, size_t pos)
+{
+   if (bcast->pow2) {
+      return &bcast->array[pos & (bcast->array_len - 1)];
+   }
+   return &bcast->array[pos % bcast->array_len];
+}
+
+
+void osal_bcast_dump (osal_bcast_t *bcast)
+{
+   if (!bcast) {
+      fprintf (stdout, "NULL bcast_t object\n");
+      return;
+   }
+
+   size_t published = osal_atomic_load_size (&bcast->published, OSAL_ATOMIC_RELAXED);
+   fprintf (stdout, "published %zu, %zu slots\n", published, bcast->array_len);
+   for (size_t i=0; i<bcast->nconsumers; i++) {
+      size_t cursor = osal_atomic_load_size (&bcast->consumers[i].cursor, OSAL_ATOMIC_RELAXED);
+      size_t next = osal_atomic_load_size (&bcast->consumers[i].next, OSAL_ATOMIC_RELAXED);
+      fprintf (stdout, "consumer %zu: cursor %zu, behind by %zu, %zu unreleased, "
+                       "depends on 0x%" PRIx64 "\n",
+               i, cursor, published - cursor, next - cursor,
+               bcast->consumers[i].depends_on);
+   }
+}
+
+osal_bcast_t *osal_bcast_new (size_t nelements)
+{
+   bool error = true;
+   osal_bcast_t *ret = NULL;
+
+   if (!nelements) {
+      goto cleanup;
+   }
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      goto cleanup;
+   }
+
+   if (!(ret->array = malloc (sizeof *ret->array * nelements))) {
+      goto cleanup;
+   }
+
+   if (!(ret->raw = calloc (1, OSAL_BCAST_MAX_CONSUMERS * sizeof *ret->consumers
+                                + CACHELINE_SIZE))) {
+      goto cleanup;
+   }
+   ret->consumers = (struct bcast_consumer_t *)
+      (ret->raw + (CACHELINE_SIZE - ((uintptr_t)ret->raw % CACHELINE_SIZE)));
+
+   ret->array_len = nelements;
+   ret->pow2 = (nelements & (nelements - 1)) == 0;
+
+   error = false;
+cleanup:
+   if (error) {
+      osal_bcast_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void osal_bcast_del (osal_bcast_t *bcast)
+{
+   if (!bcast)
+      return;
+
+   free (bcast->raw);
+   free (bcast->array);
+
+   free (bcast);
+}
+
+size_t osal_bcast_consumer_add (osal_bcast_t *bcast,
+                                const size_t *depends_on, size_t ndepends)
+{
+   if (bcast->nconsumers >= OSAL_BCAST_MAX_CONSUMERS) {
+      return (size_t)-1;
+   }
+
+   uint64_t mask = 0;
+   for (size_t i=0; i<ndepends; i++) {
+      if (depends_on[i] >= bcast->nconsumers) {
+         return (size_t)-1;
+      }
+      mask |= (uint64_t)1 << depends_on[i];
+   }
+
+   size_t id = bcast->nconsumers;
+   struct bcast_consumer_t *consumer = &bcast->consumers[id];
+   consumer->cursor = bcast->published;
+   consumer->next = consumer->cursor;
+   consumer->cached_limit = consumer->cursor;
+   consumer->depends_on = mask;
+
+   osal_atomic_store_size (&bcast->nconsumers, id + 1, OSAL_ATOMIC_RELEASE);
+
+   return id;
+}
+
+bool osal_bcast_nq (osal_bcast_t *bcast, void *message)
+{
+   uint64_t now = osal_timer_since_start_ns ();
+   size_t pos = bcast->published;
+
+   // Only find the slowest consumer when the cached one says that
+   // the slot we need has not been reclaimed.
+   if (pos - bcast->cached_min >= bcast->array_len) {
+      size_t nconsumers = osal_atomic_load_size (&bcast->nconsumers, OSAL_ATOMIC_ACQUIRE);
+      size_t min = pos;
+      for (size_t i=0; i<nconsumers; i++) {
+         size_t cursor = osal_atomic_load_size (&bcast->consumers[i].cursor, OSAL_ATOMIC_ACQUIRE);
+         if (cursor < min) {
+            min = cursor;
+         }
+      }
+      bcast->cached_min = min;
+      if (pos - min >= bcast->array_len) {
+         return false;
+      }
+   }
+
+   struct message_t *slot = bcast_slot (bcast, pos);
+   slot->message = message;
+   slot->nq_time = now;
+   osal_atomic_store_size (&bcast->published, pos + 1, OSAL_ATOMIC_RELEASE);
+
+   return true;
+}
+
+bool osal_bcast_dq (osal_bcast_t *bcast, size_t consumer,
+                    void **dst, uint64_t *nq_time)
+{
+   struct bcast_consumer_t *self = &bcast->consumers[consumer];
+   size_t pos = self->next;
+
+   // Only look at the producer and the consumers we depend on when the
+   // cached limit says that there is nothing for us.
+   if (pos == self->cached_limit) {
+      size_t limit = osal_atomic_load_size (&bcast->published, OSAL_ATOMIC_ACQUIRE);
+      uint64_t deps = self->depends_on;
+      for (size_t i=0; deps; i++, deps >>= 1) {
+         if (!(deps & 1)) {
+            continue;
+         }
+         size_t cursor = osal_atomic_load_size (&bcast->consumers[i].cursor, OSAL_ATOMIC_ACQUIRE);
+         if (cursor < limit) {
+            limit = cursor;
+         }
+      }
+      self->cached_limit = limit;
+      if (pos == limit) {
+         return false;
+      }
+   }
+
+   struct message_t *slot = bcast_slot (bcast, pos);
+   *dst = slot->message;
+   if (nq_time) {
+      *nq_time = slot->nq_time;
+   }
+
+   // Only a relaxed store: nobody else reads next except for the dump.
+   osal_atomic_store_size (&self->next, pos + 1, OSAL_ATOMIC_RELAXED);
+
+   return true;
+}
+
+void osal_bcast_release (osal_bcast_t *bcast, size_t consumer)
+{
+   struct bcast_consumer_t *self = &bcast->consumers[consumer];
+
+   // Releasing the cursor lets dependent consumers see these messages
+   // and lets the producer reuse their slots.
+   osal_atomic_store_size (&self->cursor, self->next, OSAL_ATOMIC_RELEASE);
+}
+
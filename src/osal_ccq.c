@@ -1,37 +1,256 @@
+#if 1
+#ifdef PLATFORM_POSIX
+#define _GNU_SOURCE 200809L
+#endif
+#endif
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
+
+#ifdef PLATFORM_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "osal_ccq.h"
 #include "osal_thread.h"
 #include "osal_timer.h"
+#include "osal_atomic.h"
 
-#undef USE_MUTEX
-#define USE_FTEX 1
+/* The queue is a bounded MPMC ring in which every slot carries its own
+ * sequence number (after Dmitry Vyukov's design). Producers and
+ * consumers each own a cursor, and each cursor lives on its own cache
+ * line, so the only shared write that a producer and a consumer ever
+ * contend on is the slot they are handing over.
+ *
+ * For a slot at position 'pos' (cursors only ever increase; the slot
+ * index is pos modulo array_len):
+ *    sequence == pos               slot is free for the producer at pos
+ *    sequence == pos + 1           slot is filled for the consumer at pos
+ *    sequence == pos + array_len   slot is free for the next lap
+ *
+ * Blocking callers park on an event word (see ccq_wait()): consumers on
+ * nq_event waiting for a message, producers on dq_event waiting for a
+ * free slot. The opposite side only bumps the event and makes the
+ * futex call when the matching waiter count is non-zero.
+ *
+ * Each slot is a message_t header immediately followed by elem_size
+ * bytes of payload. For the pointer queues from osal_ccq_new() the
+ * payload is the void pointer itself; for osal_ccq_new_sized() it is
+ * the caller's fixed-size message, copied in and out of the ring (or
+ * built in place with osal_ccq_reserve()).
+ *
+ * Everything that the threads (or processes) using the queue share is
+ * in one block: the ccq_shared_t header with the cursors and wait words,
+ * followed by the slots at array_offset. The block holds no pointers,
+ * so it can be mapped at a different address in every process that
+ * attaches to it (see osal_ccq_shm_new()). The osal_ccq_t itself is a
+ * per-process handle with a private copy of the immutable geometry.
+ *
+ * A handle may also have an eventfd (see osal_ccq_fd()). It is signalled
+ * at most once between two calls to osal_ccq_fd_ack(): producers only
+ * write to it when they are the first to set efd_signalled.
+ *
+ * A handle may also collect statistics (see osal_ccq_stats_enable()).
+ * The counters are split into shards on separate cache lines, and each
+ * thread only updates the shard picked by its osal_thread_index(), so
+ * threads only share a counter line when there are more threads than
+ * shards. A snapshot sums the shards.
+ */
+#define CACHELINE_SIZE     64
 
-// #define USE_MUTEX 1
-// #undef USE_FTEX
+// Slot headers and strides are rounded to this, so that payloads are
+// suitably aligned for any type.
+#define SLOT_ALIGN         16
+#define SLOT_ROUNDUP(x)    (((x) + SLOT_ALIGN - 1) & ~(size_t)(SLOT_ALIGN - 1))
 
 struct message_t {
-   void *message;
+   size_t sequence;
    uint64_t nq_time;
 };
 
-struct osal_ccq_t {
-   struct message_t *array;
-   size_t array_len;
+#define SLOT_HDR_SIZE      SLOT_ROUNDUP (sizeof (struct message_t))
+
+#define CCQ_MAGIC          0x3051434f     // "OCQ0"
+#define CCQ_VERSION        1
+
+struct ccq_shared_t {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t array_len;
+   uint64_t elem_size;
+   uint64_t stride;
+   uint64_t array_offset;
+   char pad0[CACHELINE_SIZE];
+
    size_t index_insert;
+   char pad1[CACHELINE_SIZE - sizeof (size_t)];
+
    size_t index_retrieve;
-#ifdef USE_MUTEX
-   osal_mutex_t mutex;
+   char pad2[CACHELINE_SIZE - sizeof (size_t)];
+
+   uint32_t nq_event;
+   uint32_t dq_waiters;
+   uint32_t dq_event;
+   uint32_t nq_waiters;
+   char pad3[CACHELINE_SIZE - 4 * sizeof (uint32_t)];
+};
+
+#define SHARED_SIZE        SLOT_ROUNDUP (sizeof (struct ccq_shared_t))
+
+#define STATS_SHARDS       8     // Must be a power of two
+
+struct ccq_stats_shard_t {
+   uint64_t nq_count;
+   uint64_t dq_count;
+   uint64_t nq_full;
+   uint64_t dq_empty;
+   uint64_t residency_ns[OSAL_CCQ_STATS_BUCKETS];
+   char pad[CACHELINE_SIZE];
+};
+
+struct ccq_stats_t {
+   struct ccq_stats_shard_t shards[STATS_SHARDS];
+   uint64_t max_depth;
+};
+
+struct osal_ccq_t {
+   struct ccq_shared_t *shared;
+   unsigned char *array;
+   size_t array_len;
+   size_t elem_size;
+   size_t stride;
+   bool pow2;
+
+   // Only for queues in shared memory.
+   size_t map_len;
+   int fd;
+
+   // Written by consumers, so kept off the line with the geometry.
+   char pad0[CACHELINE_SIZE];
+   int32_t efd;
+   uint32_t efd_signalled;
+
+   void *stats;            // struct ccq_stats_t
+};
+
+static inline struct message_t *ccq_slot (osal_ccq_t *ccq, size_t pos)
+{
+   size_t index = ccq->pow2 ? pos & (ccq->array_len - 1)
+                            : pos % ccq->array_len;
+   return (struct message_t *)(ccq->array + index * ccq->stride);
+}
+
+static inline void *ccq_payload (struct message_t *slot)
+{
+   return (unsigned char *)slot + SLOT_HDR_SIZE;
+}
+
+static inline struct message_t *ccq_payload_slot (void *payload)
+{
+   return (struct message_t *)((unsigned char *)payload - SLOT_HDR_SIZE);
+}
+
+/* Called after the ring has been changed. The fence pairs with the one
+ * in ccq_wait(): either we see the waiter's increment, or the waiter's
+ * re-check sees our change to the ring.
+ */
+static inline void ccq_wake (uint32_t *event, uint32_t *waiters, uint32_t n)
+{
+   osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+   if (osal_atomic_load_u32 (waiters, OSAL_ATOMIC_RELAXED)) {
+      osal_atomic_fetch_add_u32 (event, 1, OSAL_ATOMIC_RELEASE);
+      osal_futex_wake (event, n);
+   }
+}
+
+#ifdef __linux__
+// Make the eventfd readable, unless it already is.
+static void ccq_signal_fd (osal_ccq_t *ccq, int efd)
+{
+   if (osal_atomic_load_u32 (&ccq->efd_signalled, OSAL_ATOMIC_RELAXED)) {
+      return;
+   }
+   if (osal_atomic_xchg_u32 (&ccq->efd_signalled, 1, OSAL_ATOMIC_ACQ_REL)) {
+      return;
+   }
+   eventfd_write (efd, 1);
+}
 #endif
 
-#ifdef USE_FTEX
-   uint32_t mutex;
+// Called after messages have been published.
+static inline void ccq_published (osal_ccq_t *ccq, uint32_t n)
+{
+   ccq_wake (&ccq->shared->nq_event, &ccq->shared->dq_waiters, n);
+#ifdef __linux__
+   int efd = osal_atomic_load_i32 (&ccq->efd, OSAL_ATOMIC_RELAXED);
+   if (efd >= 0) {
+      ccq_signal_fd (ccq, efd);
+   }
 #endif
-};
+}
+
+// Called after slots have been handed back to the producers.
+static inline void ccq_released (osal_ccq_t *ccq, uint32_t n)
+{
+   ccq_wake (&ccq->shared->dq_event, &ccq->shared->nq_waiters, n);
+}
+
+/* Register as a waiter, re-check with 'attempt', and only then park on
+ * the event. The event value is read before registering so that a
+ * wake between the re-check and the futex call makes the futex call
+ * return immediately.
+ *
+ * Returns true if 'attempt' succeeded, false on timeout.
+ */
+static bool ccq_wait (osal_ccq_t *ccq, uint32_t *event, uint32_t *waiters,
+                      uint64_t timeout_us,
+                      bool (*attempt) (osal_ccq_t *, void *), void *arg)
+{
+   uint64_t deadline = (uint64_t)-1;
+   if (timeout_us != OSAL_CCQ_WAIT_FOREVER) {
+      deadline = osal_timer_since_start () + timeout_us;
+   }
+
+   while (true) {
+      if (attempt (ccq, arg)) {
+         return true;
+      }
+
+      uint64_t remaining = OSAL_CCQ_WAIT_FOREVER;
+      if (deadline != (uint64_t)-1) {
+         uint64_t now = osal_timer_since_start ();
+         if (now >= deadline) {
+            return false;
+         }
+         remaining = deadline - now;
+      }
+
+      uint32_t ev = osal_atomic_load_u32 (event, OSAL_ATOMIC_ACQUIRE);
+      osal_atomic_fetch_add_u32 (waiters, 1, OSAL_ATOMIC_RELAXED);
+      osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+
+      bool done = attempt (ccq, arg);
+      if (!done) {
+         osal_futex_wait (event, ev, remaining);
+      }
+
+      osal_atomic_fetch_sub_u32 (waiters, 1, OSAL_ATOMIC_RELAXED);
+      if (done) {
+         return true;
+      }
+   }
+}
 
 
 void osal_ccq_dump (osal_ccq_t *ccq)
@@ -41,45 +260,112 @@ void osal_ccq_dump (osal_ccq_t *ccq)
       return;
    }
 
-#ifdef USE_FTEX
-   fprintf (stdout, "register %" PRIu32 "\n", ccq->mutex);
-#endif
+   size_t insert = osal_atomic_load_size (&ccq->shared->index_insert, OSAL_ATOMIC_RELAXED);
+   size_t retrieve = osal_atomic_load_size (&ccq->shared->index_retrieve, OSAL_ATOMIC_RELAXED);
 
-#ifdef USE_MUTEX
-   fprintf (stdout, "using mutex, no count\n");
-#endif
+   fprintf (stdout, "insert %zu, retrieve %zu, depth %zu/%zu, %zu bytes/message\n",
+            insert, retrieve, insert - retrieve, ccq->array_len, ccq->elem_size);
+
+   if (!ccq->stats) {
+      return;
+   }
 
+   osal_ccq_stats_t stats;
+   osal_ccq_stats (ccq, &stats);
+   fprintf (stdout, "nq %" PRIu64 " (%" PRIu64 " full), "
+                    "dq %" PRIu64 " (%" PRIu64 " empty), max depth %" PRIu64 "\n",
+            stats.nq_count, stats.nq_full,
+            stats.dq_count, stats.dq_empty, stats.max_depth);
+   for (size_t i=0; i<OSAL_CCQ_STATS_BUCKETS; i++) {
+      if (stats.residency_ns[i]) {
+         fprintf (stdout, "   residency < %" PRIu64 "ns: %" PRIu64 "\n",
+                  (uint64_t)1 << i, stats.residency_ns[i]);
+      }
+   }
 }
 
-osal_ccq_t *osal_ccq_new (size_t nelements)
+/* Work out the size of the block needed for the given geometry.
+ * Returns zero if it does not fit in a size_t.
+ */
+static size_t ccq_block_size (size_t nelements, size_t elem_size,
+                              size_t *stride)
+{
+   if (!nelements || !elem_size || elem_size > (size_t)-1 / 2) {
+      return 0;
+   }
+
+   *stride = SLOT_ROUNDUP (SLOT_HDR_SIZE + elem_size);
+   if (nelements > ((size_t)-1 - SHARED_SIZE) / *stride) {
+      return 0;
+   }
+
+   return SHARED_SIZE + *stride * nelements;
+}
+
+// Initialise a freshly allocated (and zeroed) block.
+static void ccq_block_init (struct ccq_shared_t *shared, size_t nelements,
+                            size_t elem_size, size_t stride)
+{
+   shared->version = CCQ_VERSION;
+   shared->array_len = nelements;
+   shared->elem_size = elem_size;
+   shared->stride = stride;
+   shared->array_offset = SHARED_SIZE;
+
+   unsigned char *array = (unsigned char *)shared + SHARED_SIZE;
+   for (size_t i=0; i<nelements; i++) {
+      ((struct message_t *)(array + i * stride))->sequence = i;
+   }
+
+   // Anyone attaching checks the magic last, so it is written last.
+   osal_atomic_store_u32 (&shared->magic, CCQ_MAGIC, OSAL_ATOMIC_RELEASE);
+}
+
+// Create the per-process handle for an initialised block.
+static osal_ccq_t *ccq_handle_new (struct ccq_shared_t *shared,
+                                   size_t map_len, int fd)
 {
-   bool error = true;
    osal_ccq_t *ret = calloc (1, sizeof *ret);
    if (!ret) {
-      goto cleanup;
+      return NULL;
    }
 
-#ifdef USE_MUTEX
-   if (!(osal_mutex_new (&ret->mutex))) {
-      goto cleanup;
+   ret->shared = shared;
+   ret->array = (unsigned char *)shared + shared->array_offset;
+   ret->array_len = (size_t)shared->array_len;
+   ret->elem_size = (size_t)shared->elem_size;
+   ret->stride = (size_t)shared->stride;
+   ret->pow2 = (ret->array_len & (ret->array_len - 1)) == 0;
+   ret->map_len = map_len;
+   ret->fd = fd;
+   ret->efd = -1;
+
+   return ret;
+}
+
+osal_ccq_t *osal_ccq_new (size_t nelements)
+{
+   return osal_ccq_new_sized (nelements, sizeof (void *));
+}
+
+osal_ccq_t *osal_ccq_new_sized (size_t nelements, size_t elem_size)
+{
+   size_t stride;
+   size_t block_len = ccq_block_size (nelements, elem_size, &stride);
+   if (!block_len) {
+      return NULL;
    }
-#endif
-#ifdef USE_FTEX
-   ret->mutex = 0;
-#endif
 
-   if (!(ret->array = malloc (sizeof *ret->array * nelements))) {
-      goto cleanup;
+   struct ccq_shared_t *shared = calloc (1, block_len);
+   if (!shared) {
+      return NULL;
    }
 
-   ret->array_len = nelements;
-   ret->index_retrieve = (size_t)-1;
+   ccq_block_init (shared, nelements, elem_size, stride);
 
-   error = false;
-cleanup:
-   if (error) {
-      osal_ccq_del (ret);
-      ret = NULL;
+   osal_ccq_t *ret = ccq_handle_new (shared, 0, -1);
+   if (!ret) {
+      free (shared);
    }
 
    return ret;
@@ -91,125 +377,699 @@ void osal_ccq_del (osal_ccq_t *ccq)
    if (!ccq)
       return;
 
-#ifdef USE_MUTEX
-   osal_mutex_del (&ccq->mutex);
+#ifdef PLATFORM_POSIX
+   if (ccq->efd >= 0) {
+      close (ccq->efd);
+   }
 #endif
 
-   free (ccq->array);
+   free (ccq->stats);
+
+#ifdef PLATFORM_POSIX
+   if (ccq->map_len) {
+      munmap (ccq->shared, ccq->map_len);
+      close (ccq->fd);
+      free (ccq);
+      return;
+   }
+#endif
+
+   free (ccq->shared);
 
    free (ccq);
 }
 
-bool osal_ccq_nq (osal_ccq_t *ccq, void *message)
+/* **************************************************************
+ * Shared memory queues.
+ */
+#ifdef PLATFORM_POSIX
+
+static osal_ccq_t *ccq_shm_create (int fd, size_t nelements, size_t elem_size)
 {
-   bool ret = false;
-   uint64_t now = osal_timer_since_start();
-#ifdef USE_MUTEX
-   if (!(osal_mutex_acquire(&ccq->mutex))) {
-      goto cleanup;
+   size_t stride;
+   size_t block_len = ccq_block_size (nelements, elem_size, &stride);
+   if (!block_len) {
+      return NULL;
    }
-#endif
-#ifdef USE_FTEX
-   while (!(osal_ftex_acquire (&ccq->mutex, "nq")))
-      ;
 
+   if (ftruncate (fd, (off_t)block_len) != 0) {
+      return NULL;
+   }
+
+   // ftruncate() zero-fills, so the block only needs the non-zero
+   // fields set.
+   void *map = mmap (NULL, block_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      return NULL;
+   }
+
+   ccq_block_init (map, nelements, elem_size, stride);
+
+   osal_ccq_t *ret = ccq_handle_new (map, block_len, fd);
+   if (!ret) {
+      munmap (map, block_len);
+   }
+   return ret;
+}
+
+osal_ccq_t *osal_ccq_shm_new (const char *name, size_t nelements, size_t elem_size)
+{
+   int fd = -1;
+
+   if (name) {
+      fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+   } else {
+#ifdef __linux__
+      fd = memfd_create ("osal_ccq", MFD_CLOEXEC);
 #endif
+   }
 
-   /* **************************************************************
-    * Tricky!
-    */
+   if (fd < 0) {
+      return NULL;
+   }
+
+   osal_ccq_t *ret = ccq_shm_create (fd, nelements, elem_size);
+   if (!ret) {
+      close (fd);
+      if (name) {
+         shm_unlink (name);
+      }
+   }
+
+   return ret;
+}
+
+osal_ccq_t *osal_ccq_shm_open_fd (int fd)
+{
+   struct stat sb;
+   struct ccq_shared_t *shared = NULL;
+   size_t map_len = 0;
+   osal_ccq_t *ret = NULL;
 
-   // If the insertion point matches the retrieval point, the queue
-   // is full and so we have to bail.
-   if (ccq->index_insert == ccq->index_retrieve) {
+   int newfd = dup (fd);
+   if (newfd < 0) {
       goto cleanup;
    }
 
-   // Insert the message (with the time) at the insertion point. We
-   // need to do this because the retrieval point might be unset
-   // ((size_t)-1), and it *can* be that even when the insertion point
-   // is non-zero (queue empties faster than filling).
-   ccq->array[ccq->index_insert].message = message;
-   ccq->array[ccq->index_insert].nq_time = now;
+   if (fstat (newfd, &sb) != 0 || (size_t)sb.st_size < SHARED_SIZE) {
+      goto cleanup;
+   }
 
-   // If the retrieval point is unset ((size_t)-1), then we must
-   // set it to the element we just inserted, which must be, by
-   if (ccq->index_retrieve == (size_t)-1) {
-      ccq->index_retrieve = ccq->index_insert;
+   map_len = (size_t)sb.st_size;
+   shared = mmap (NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, newfd, 0);
+   if (shared == MAP_FAILED) {
+      shared = NULL;
+      goto cleanup;
    }
 
-   // Increment the insertion point and wraparound when we exceed
-   // the arrays capacity.
-   if (++ccq->index_insert >= ccq->array_len) {
-      ccq->index_insert = 0;
+   // The creator may not have finished initialising the block yet, or
+   // this might not be a queue at all. The element size is bounded by
+   // the mapping before it is added to, so that the stride check cannot
+   // wrap, and a zero length (which would make the index mask all ones)
+   // or stride is rejected.
+   if (osal_atomic_load_u32 (&shared->magic, OSAL_ATOMIC_ACQUIRE) != CCQ_MAGIC
+         || shared->version != CCQ_VERSION
+         || shared->array_offset != SHARED_SIZE
+         || shared->elem_size > map_len - SHARED_SIZE
+         || shared->stride == 0
+         || shared->stride < SLOT_HDR_SIZE + shared->elem_size
+         || shared->array_len == 0
+         || shared->array_len > (map_len - SHARED_SIZE) / shared->stride) {
+      goto cleanup;
    }
 
-   // We are done. Now the retrieval will take of of some details.
+   ret = ccq_handle_new (shared, map_len, newfd);
 
-   ret = true;
 cleanup:
+   if (!ret) {
+      if (shared) {
+         munmap (shared, map_len);
+      }
+      if (newfd >= 0) {
+         close (newfd);
+      }
+   }
+   return ret;
+}
 
-#ifdef USE_MUTEX
-   osal_mutex_release(&ccq->mutex);
-#endif
-#ifdef USE_FTEX
-   while (!(osal_ftex_release (&ccq->mutex, "nq")))
-      ;
-#endif
+osal_ccq_t *osal_ccq_shm_open (const char *name)
+{
+   int fd = shm_open (name, O_RDWR, 0);
+   if (fd < 0) {
+      return NULL;
+   }
 
+   osal_ccq_t *ret = osal_ccq_shm_open_fd (fd);
+   close (fd);
    return ret;
 }
 
-bool osal_ccq_dq (osal_ccq_t *ccq, void **dst, uint64_t *nq_time)
+bool osal_ccq_shm_unlink (const char *name)
 {
-   bool ret = false;
+   return shm_unlink (name) == 0;
+}
 
-#ifdef USE_MUTEX
-   if (!(osal_mutex_acquire(&ccq->mutex))) {
-      goto cleanup;
-   }
-#endif
-#ifdef USE_FTEX
-   while (!(osal_ftex_acquire (&ccq->mutex, "dq")))
-      ;
+int osal_ccq_shm_fd (osal_ccq_t *ccq)
+{
+   return ccq->map_len ? ccq->fd : -1;
+}
+
+#else
+
+osal_ccq_t *osal_ccq_shm_new (const char *name, size_t nelements, size_t elem_size)
+{
+   (void)name;
+   (void)nelements;
+   (void)elem_size;
+   return NULL;
+}
+
+osal_ccq_t *osal_ccq_shm_open_fd (int fd)
+{
+   (void)fd;
+   return NULL;
+}
+
+osal_ccq_t *osal_ccq_shm_open (const char *name)
+{
+   (void)name;
+   return NULL;
+}
+
+bool osal_ccq_shm_unlink (const char *name)
+{
+   (void)name;
+   return false;
+}
+
+int osal_ccq_shm_fd (osal_ccq_t *ccq)
+{
+   (void)ccq;
+   return -1;
+}
 
 #endif
 
+static inline struct ccq_stats_shard_t *ccq_stats_shard (struct ccq_stats_t *stats)
+{
+   return &stats->shards[osal_thread_index () & (STATS_SHARDS - 1)];
+}
+
+static inline void ccq_stats_add (uint64_t *counter, uint64_t n)
+{
+   osal_atomic_fetch_add_u64 (counter, n, OSAL_ATOMIC_RELAXED);
+}
+
+// Bucket 0 counts zero, bucket n counts [2^(n-1), 2^n).
+static inline size_t ccq_stats_bucket (uint64_t value)
+{
+   size_t bucket = value ? (size_t)(64 - __builtin_clzll (value)) : 0;
+   return bucket < OSAL_CCQ_STATS_BUCKETS ? bucket : OSAL_CCQ_STATS_BUCKETS - 1;
+}
+
+static void ccq_stats_nq (osal_ccq_t *ccq, struct ccq_stats_t *stats,
+                          size_t count, size_t pos)
+{
+   struct ccq_stats_shard_t *shard = ccq_stats_shard (stats);
+   if (!count) {
+      ccq_stats_add (&shard->nq_full, 1);
+      return;
+   }
+
+   ccq_stats_add (&shard->nq_count, count);
+
+   // Only write the high-water mark when it moves.
+   size_t retrieve = osal_atomic_load_size (&ccq->shared->index_retrieve, OSAL_ATOMIC_RELAXED);
+   uint64_t depth = (uint64_t)(pos + count - retrieve);
+   uint64_t max = osal_atomic_load_u64 (&stats->max_depth, OSAL_ATOMIC_RELAXED);
+   while (depth > max && depth <= ccq->array_len) {
+      if (osal_atomic_cas_weak_u64 (&stats->max_depth, &max, depth,
+                                    OSAL_ATOMIC_RELAXED,
+                                    OSAL_ATOMIC_RELAXED)) {
+         break;
+      }
+   }
+}
+
+static void ccq_stats_dq (osal_ccq_t *ccq, struct ccq_stats_t *stats,
+                          size_t count, size_t pos)
+{
+   struct ccq_stats_shard_t *shard = ccq_stats_shard (stats);
+   if (!count) {
+      ccq_stats_add (&shard->dq_empty, 1);
+      return;
+   }
+
+   ccq_stats_add (&shard->dq_count, count);
+
+   // The claimed slots are ours and were published before we could
+   // claim them, so their timestamps are safe to read.
+   uint64_t now = osal_timer_since_start_ns ();
+   for (size_t i=0; i<count; i++) {
+      uint64_t nq_time = ccq_slot (ccq, pos + i)->nq_time;
+      uint64_t residency = now > nq_time ? now - nq_time : 0;
+      ccq_stats_add (&shard->residency_ns[ccq_stats_bucket (residency)], 1);
+   }
+}
+
+/* Claim up to n consecutive positions starting at the insertion
+ * cursor. Returns the number of positions claimed (zero if the queue
+ * is full) and places the first claimed position in *first.
+ *
+ * The CAS on index_insert is what guarantees exclusivity: positions are
+ * only ever claimed by advancing that cursor, so if it still reads
+ * 'pos' then nobody else owns any position at or after 'pos', and a
+ * slot whose sequence equals its position has already been released
+ * by the consumers of the previous lap.
+ */
+static size_t ccq_claim_insert (osal_ccq_t *ccq, size_t n, size_t *first)
+{
+   size_t pos = osal_atomic_load_size (&ccq->shared->index_insert, OSAL_ATOMIC_RELAXED);
+
+   /* **************************************************************
+    * Tricky!
+    */
+   while (true) {
+      struct message_t *slot = ccq_slot (ccq, pos);
+      size_t seq = osal_atomic_load_size (&slot->sequence, OSAL_ATOMIC_ACQUIRE);
+      intptr_t diff = (intptr_t)(seq - pos);
+
+      // The slot still holds a message from the previous lap, so the
+      // queue is full.
+      if (diff < 0) {
+         struct ccq_stats_t *stats = osal_atomic_load_ptr (&ccq->stats, OSAL_ATOMIC_ACQUIRE);
+         if (stats) {
+            ccq_stats_nq (ccq, stats, 0, pos);
+         }
+         return 0;
+      }
+
+      // Another producer claimed this position before us.
+      if (diff > 0) {
+         pos = osal_atomic_load_size (&ccq->shared->index_insert, OSAL_ATOMIC_RELAXED);
+         continue;
+      }
+
+      // The first slot is free for this lap; see how many of the
+      // following ones are too.
+      size_t count = 1;
+      while (count < n) {
+         slot = ccq_slot (ccq, pos + count);
+         if (osal_atomic_load_size (&slot->sequence, OSAL_ATOMIC_ACQUIRE) != pos + count) {
+            break;
+         }
+         count++;
+      }
+
+      // Try to claim them all at once. On failure the CAS reloads pos
+      // for us and we start again from the new position.
+      if (osal_atomic_cas_weak_size (&ccq->shared->index_insert, &pos, pos + count,
+                                     OSAL_ATOMIC_RELAXED,
+                                     OSAL_ATOMIC_RELAXED)) {
+         struct ccq_stats_t *stats = osal_atomic_load_ptr (&ccq->stats, OSAL_ATOMIC_ACQUIRE);
+         if (stats) {
+            ccq_stats_nq (ccq, stats, count, pos);
+         }
+         *first = pos;
+         return count;
+      }
+   }
+}
+
+/* Claim up to n consecutive positions starting at the retrieval
+ * cursor; the mirror image of ccq_claim_insert(). Returns zero if the
+ * queue is empty.
+ */
+static size_t ccq_claim_retrieve (osal_ccq_t *ccq, size_t n, size_t *first)
+{
+   size_t pos = osal_atomic_load_size (&ccq->shared->index_retrieve, OSAL_ATOMIC_RELAXED);
+
    /* **************************************************************
     * More trickness!
     */
+   while (true) {
+      struct message_t *slot = ccq_slot (ccq, pos);
+      size_t seq = osal_atomic_load_size (&slot->sequence, OSAL_ATOMIC_ACQUIRE);
+      intptr_t diff = (intptr_t)(seq - (pos + 1));
 
-   // If the queue is already empty, bail.
-   if (ccq->index_retrieve == (size_t)-1) {
-      goto cleanup;
+      // Nothing has been published at this position yet, so the queue
+      // is empty (or the producer of this slot has not finished).
+      if (diff < 0) {
+         struct ccq_stats_t *stats = osal_atomic_load_ptr (&ccq->stats, OSAL_ATOMIC_ACQUIRE);
+         if (stats) {
+            ccq_stats_dq (ccq, stats, 0, pos);
+         }
+         return 0;
+      }
+
+      // Another consumer claimed this position before us.
+      if (diff > 0) {
+         pos = osal_atomic_load_size (&ccq->shared->index_retrieve, OSAL_ATOMIC_RELAXED);
+         continue;
+      }
+
+      size_t count = 1;
+      while (count < n) {
+         slot = ccq_slot (ccq, pos + count);
+         if (osal_atomic_load_size (&slot->sequence, OSAL_ATOMIC_ACQUIRE) != pos + count + 1) {
+            break;
+         }
+         count++;
+      }
+
+      if (osal_atomic_cas_weak_size (&ccq->shared->index_retrieve, &pos, pos + count,
+                                     OSAL_ATOMIC_RELAXED,
+                                     OSAL_ATOMIC_RELAXED)) {
+         struct ccq_stats_t *stats = osal_atomic_load_ptr (&ccq->stats, OSAL_ATOMIC_ACQUIRE);
+         if (stats) {
+            ccq_stats_dq (ccq, stats, count, pos);
+         }
+         *first = pos;
+         return count;
+      }
+   }
+}
+
+bool osal_ccq_nq (osal_ccq_t *ccq, void *message)
+{
+   if (ccq->elem_size != sizeof (void *)) {
+      return false;
+   }
+
+   uint64_t now = osal_timer_since_start_ns ();
+   size_t pos;
+
+   if (!(ccq_claim_insert (ccq, 1, &pos))) {
+      return false;
+   }
+
+   // The slot is ours until we publish it by advancing its sequence.
+   struct message_t *slot = ccq_slot (ccq, pos);
+   memcpy (ccq_payload (slot), &message, sizeof message);
+   slot->nq_time = now;
+   osal_atomic_store_size (&slot->sequence, pos + 1, OSAL_ATOMIC_RELEASE);
+
+   ccq_published (ccq, 1);
+
+   return true;
+}
+
+bool osal_ccq_dq (osal_ccq_t *ccq, void **dst, uint64_t *nq_time)
+{
+   if (ccq->elem_size != sizeof (void *)) {
+      return false;
+   }
+
+   size_t pos;
+
+   if (!(ccq_claim_retrieve (ccq, 1, &pos))) {
+      return false;
    }
 
    // Populate the outbound parameters
-   *dst = ccq->array[ccq->index_retrieve].message;
+   struct message_t *slot = ccq_slot (ccq, pos);
+   memcpy (dst, ccq_payload (slot), sizeof *dst);
    if (nq_time) {
-      *nq_time = ccq->array[ccq->index_retrieve].nq_time;
+      *nq_time = slot->nq_time;
    }
 
-   // Increment the retrieval point. There are two possibilities
-   // after incrementing:
-   //    1. We wrap around
-   //    2. We have an empty queue
-   if (++ccq->index_retrieve >= ccq->array_len) {  // Wraparound
-      ccq->index_retrieve = 0;
+   // Hand the slot back to the producers for the next lap.
+   osal_atomic_store_size (&slot->sequence, pos + ccq->array_len, OSAL_ATOMIC_RELEASE);
+
+   ccq_released (ccq, 1);
+
+   return true;
+}
+
+size_t osal_ccq_nq_n (osal_ccq_t *ccq, void **msgs, size_t n)
+{
+   if (!n || ccq->elem_size != sizeof (void *)) {
+      return 0;
    }
-   if (ccq->index_retrieve == ccq->index_insert) { // Empty queue
-      ccq->index_retrieve = (size_t)-1;
+
+   uint64_t now = osal_timer_since_start_ns ();
+   size_t pos;
+   size_t count = ccq_claim_insert (ccq, n, &pos);
+
+   // Each slot is published as soon as it is filled so that consumers
+   // can start on the front of the batch while we fill the rest.
+   for (size_t i=0; i<count; i++) {
+      struct message_t *slot = ccq_slot (ccq, pos + i);
+      memcpy (ccq_payload (slot), &msgs[i], sizeof msgs[i]);
+      slot->nq_time = now;
+      osal_atomic_store_size (&slot->sequence, pos + i + 1, OSAL_ATOMIC_RELEASE);
    }
 
-   ret = true;
-cleanup:
-#ifdef USE_MUTEX
-   osal_mutex_release(&ccq->mutex);
-#endif
-#ifdef USE_FTEX
-   while (!(osal_ftex_release (&ccq->mutex, "dq")))
-      ;
+   if (count) {
+      ccq_published (ccq, (uint32_t)count);
+   }
+
+   return count;
+}
+
+size_t osal_ccq_dq_n (osal_ccq_t *ccq, void **dst, uint64_t *times, size_t max)
+{
+   if (!max || ccq->elem_size != sizeof (void *)) {
+      return 0;
+   }
+
+   size_t pos;
+   size_t count = ccq_claim_retrieve (ccq, max, &pos);
+
+   for (size_t i=0; i<count; i++) {
+      struct message_t *slot = ccq_slot (ccq, pos + i);
+      memcpy (&dst[i], ccq_payload (slot), sizeof dst[i]);
+      if (times) {
+         times[i] = slot->nq_time;
+      }
+      osal_atomic_store_size (&slot->sequence, pos + i + ccq->array_len, OSAL_ATOMIC_RELEASE);
+   }
+
+   if (count) {
+      ccq_released (ccq, (uint32_t)count);
+   }
+
+   return count;
+}
+
+bool osal_ccq_nq_data (osal_ccq_t *ccq, const void *src)
+{
+   void *payload = osal_ccq_reserve (ccq);
+   if (!payload) {
+      return false;
+   }
+
+   memcpy (payload, src, ccq->elem_size);
+   osal_ccq_commit (ccq, payload);
+
+   return true;
+}
+
+bool osal_ccq_dq_data (osal_ccq_t *ccq, void *dst, uint64_t *nq_time)
+{
+   const void *payload = osal_ccq_claim (ccq, nq_time);
+   if (!payload) {
+      return false;
+   }
+
+   memcpy (dst, payload, ccq->elem_size);
+   osal_ccq_release (ccq, payload);
+
+   return true;
+}
+
+void *osal_ccq_reserve (osal_ccq_t *ccq)
+{
+   size_t pos;
+
+   if (!(ccq_claim_insert (ccq, 1, &pos))) {
+      return NULL;
+   }
+
+   return ccq_payload (ccq_slot (ccq, pos));
+}
+
+void osal_ccq_commit (osal_ccq_t *ccq, void *payload)
+{
+   // While reserved, the slot's sequence still holds the position that
+   // was claimed for it.
+   struct message_t *slot = ccq_payload_slot (payload);
+   size_t pos = slot->sequence;
+
+   slot->nq_time = osal_timer_since_start_ns ();
+   osal_atomic_store_size (&slot->sequence, pos + 1, OSAL_ATOMIC_RELEASE);
+
+   ccq_published (ccq, 1);
+}
+
+const void *osal_ccq_claim (osal_ccq_t *ccq, uint64_t *nq_time)
+{
+   size_t pos;
+
+   if (!(ccq_claim_retrieve (ccq, 1, &pos))) {
+      return NULL;
+   }
+
+   struct message_t *slot = ccq_slot (ccq, pos);
+   if (nq_time) {
+      *nq_time = slot->nq_time;
+   }
+
+   return ccq_payload (slot);
+}
+
+void osal_ccq_release (osal_ccq_t *ccq, const void *payload)
+{
+   // While claimed, the slot's sequence is still pos + 1.
+   struct message_t *slot = ccq_payload_slot ((void *)payload);
+   size_t pos = slot->sequence - 1;
+
+   osal_atomic_store_size (&slot->sequence, pos + ccq->array_len, OSAL_ATOMIC_RELEASE);
+
+   ccq_released (ccq, 1);
+}
+
+struct dq_args_t {
+   void **dst;
+   uint64_t *nq_time;
+};
+
+static bool dq_attempt (osal_ccq_t *ccq, void *arg)
+{
+   struct dq_args_t *args = arg;
+   return osal_ccq_dq (ccq, args->dst, args->nq_time);
+}
+
+static bool nq_attempt (osal_ccq_t *ccq, void *arg)
+{
+   return osal_ccq_nq (ccq, arg);
+}
+
+bool osal_ccq_nq_wait (osal_ccq_t *ccq, void *message, uint64_t timeout_us)
+{
+   // Every attempt would fail, so do not wait for one to succeed.
+   if (ccq->elem_size != sizeof (void *)) {
+      return false;
+   }
+
+   return ccq_wait (ccq, &ccq->shared->dq_event, &ccq->shared->nq_waiters, timeout_us,
+                    nq_attempt, message);
+}
+
+bool osal_ccq_dq_wait (osal_ccq_t *ccq, void **dst, uint64_t *nq_time,
+                       uint64_t timeout_us)
+{
+   if (ccq->elem_size != sizeof (void *)) {
+      return false;
+   }
+
+   struct dq_args_t args = { dst, nq_time };
+   return ccq_wait (ccq, &ccq->shared->nq_event, &ccq->shared->dq_waiters, timeout_us,
+                    dq_attempt, &args);
+}
+
+#ifdef __linux__
+
+int osal_ccq_fd (osal_ccq_t *ccq)
+{
+   int efd = osal_atomic_load_i32 (&ccq->efd, OSAL_ATOMIC_ACQUIRE);
+   if (efd >= 0) {
+      return efd;
+   }
+
+   int newfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (newfd < 0) {
+      return -1;
+   }
+
+   // Two threads may race to create it; the loser closes its own.
+   if (!(osal_atomic_cas_i32 (&ccq->efd, &efd, newfd,
+                              OSAL_ATOMIC_SEQ_CST,
+                              OSAL_ATOMIC_ACQUIRE))) {
+      close (newfd);
+      return efd;
+   }
+
+   return newfd;
+}
+
+void osal_ccq_fd_ack (osal_ccq_t *ccq)
+{
+   eventfd_t value;
+   int efd = osal_atomic_load_i32 (&ccq->efd, OSAL_ATOMIC_ACQUIRE);
+   if (efd < 0) {
+      return;
+   }
+
+   // Read before clearing the flag: a producer that sets the flag
+   // after we clear it writes again, and whatever a producer published
+   // before we clear it is found by the caller's drain that follows.
+   eventfd_read (efd, &value);
+   osal_atomic_store_u32 (&ccq->efd_signalled, 0, OSAL_ATOMIC_RELEASE);
+   osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+}
+
+#else
+
+int osal_ccq_fd (osal_ccq_t *ccq)
+{
+   (void)ccq;
+   return -1;
+}
+
+void osal_ccq_fd_ack (osal_ccq_t *ccq)
+{
+   (void)ccq;
+}
+
 #endif
-   return ret;
+
+bool osal_ccq_stats_enable (osal_ccq_t *ccq)
+{
+   if (osal_atomic_load_ptr (&ccq->stats, OSAL_ATOMIC_ACQUIRE)) {
+      return true;
+   }
+
+   struct ccq_stats_t *stats = calloc (1, sizeof *stats);
+   if (!stats) {
+      return false;
+   }
+
+   void *expected = NULL;
+   if (!(osal_atomic_cas_ptr (&ccq->stats, &expected, stats,
+                              OSAL_ATOMIC_RELEASE,
+                              OSAL_ATOMIC_RELAXED))) {
+      free (stats);
+   }
+
+   return true;
+}
+
+void osal_ccq_stats (osal_ccq_t *ccq, osal_ccq_stats_t *dst)
+{
+   memset (dst, 0, sizeof *dst);
+
+   size_t insert = osal_atomic_load_size (&ccq->shared->index_insert, OSAL_ATOMIC_RELAXED);
+   size_t retrieve = osal_atomic_load_size (&ccq->shared->index_retrieve, OSAL_ATOMIC_RELAXED);
+   dst->depth = insert - retrieve;
+   dst->capacity = ccq->array_len;
+
+   struct ccq_stats_t *stats = osal_atomic_load_ptr (&ccq->stats, OSAL_ATOMIC_ACQUIRE);
+   if (!stats) {
+      return;
+   }
+
+   for (size_t i=0; i<STATS_SHARDS; i++) {
+      struct ccq_stats_shard_t *shard = &stats->shards[i];
+      dst->nq_count += osal_atomic_load_u64 (&shard->nq_count, OSAL_ATOMIC_RELAXED);
+      dst->dq_count += osal_atomic_load_u64 (&shard->dq_count, OSAL_ATOMIC_RELAXED);
+      dst->nq_full += osal_atomic_load_u64 (&shard->nq_full, OSAL_ATOMIC_RELAXED);
+      dst->dq_empty += osal_atomic_load_u64 (&shard->dq_empty, OSAL_ATOMIC_RELAXED);
+      for (size_t j=0; j<OSAL_CCQ_STATS_BUCKETS; j++) {
+         dst->residency_ns[j] += osal_atomic_load_u64 (&shard->residency_ns[j],
+                                                       OSAL_ATOMIC_RELAXED);
+      }
+   }
+   dst->max_depth = osal_atomic_load_u64 (&stats->max_depth, OSAL_ATOMIC_RELAXED);
 }
 
@@ -0,0 +1,518 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "osal_histogram.h"
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_atomic.h"
+
+#define CACHELINE_SIZE     64
+
+// Threads claim one of HIST_OWNED shards per histogram, through its
+// osal_thread_slots_t, and give it up when they exit. A claimed shard
+// is only written by its owner, so recording needs no read-modify-write
+// atomics. Threads that find them all taken share the last shard, with
+// atomic adds.
+#define HIST_OWNED         8
+#define HIST_SHARDS        (HIST_OWNED + 1)
+
+static const uint8_t hist_magic[4] = { 'O', 'H', 'S', '1' };
+
+/* A value v below 2^p (p being the precision) has bucket v. Above
+ * that, v is shifted right by e, just enough to leave p significant
+ * bits, and the bucket is e * 2^(p-1) plus what is left; each power of
+ * two from 2^p up thus gets 2^(p-1) buckets of equal width, following
+ * on from the exact ones.
+ *
+ * Each shard is a header followed by its counts, and shards are
+ * rounded up to whole cache lines.
+ */
+struct hist_shard_t {
+   uint64_t sum;
+   uint64_t min;
+   uint64_t max;
+   uint64_t counts[];
+};
+
+struct osal_histogram_t {
+   uint64_t max_value;
+   unsigned precision;
+   size_t nbuckets;
+   size_t stride;
+
+   uint8_t *raw;
+   uint8_t *shards;
+   osal_thread_slots_t *slots;
+};
+
+static size_t hist_index (unsigned precision, uint64_t value)
+{
+   if (value < ((uint64_t)1 << precision)) {
+      return (size_t)value;
+   }
+   unsigned e = (unsigned)(64 - __builtin_clzll (value)) - precision;
+   return ((size_t)e << (precision - 1)) + (size_t)(value >> e);
+}
+
+// The largest value counted in the bucket.
+static uint64_t hist_highest (unsigned precision, size_t index)
+{
+   if (index < ((size_t)1 << precision)) {
+      return index;
+   }
+   unsigned e = (unsigned)(index >> (precision - 1)) - 1;
+   uint64_t mantissa = index - ((size_t)e << (precision - 1));
+   return ((mantissa + 1) << e) - 1;
+}
+
+static struct hist_shard_t *hist_shard (osal_histogram_t *hist, size_t i)
+{
+   return (struct hist_shard_t *)(hist->shards + i * hist->stride);
+}
+
+static void hist_shard_reset (osal_histogram_t *hist, struct hist_shard_t *shard)
+{
+   for (size_t b=0; b<hist->nbuckets; b++) {
+      osal_atomic_store_u64 (&shard->counts[b], 0, OSAL_ATOMIC_RELAXED);
+   }
+   osal_atomic_store_u64 (&shard->sum, 0, OSAL_ATOMIC_RELAXED);
+   osal_atomic_store_u64 (&shard->min, UINT64_MAX, OSAL_ATOMIC_RELAXED);
+   osal_atomic_store_u64 (&shard->max, 0, OSAL_ATOMIC_RELAXED);
+}
+
+static void hist_owned_add (uint64_t *counter, uint64_t n)
+{
+   osal_atomic_store_u64 (counter, osal_atomic_load_u64 (counter, OSAL_ATOMIC_RELAXED) + n,
+                          OSAL_ATOMIC_RELAXED);
+}
+
+// Only write the min and max when they move.
+static void hist_shard_minmax (struct hist_shard_t *shard, uint64_t min, uint64_t max)
+{
+   uint64_t cur = osal_atomic_load_u64 (&shard->min, OSAL_ATOMIC_RELAXED);
+   while (min < cur
+            && !(osal_atomic_cas_weak_u64 (&shard->min, &cur, min,
+                                           OSAL_ATOMIC_RELAXED, OSAL_ATOMIC_RELAXED)))
+      ;
+   cur = osal_atomic_load_u64 (&shard->max, OSAL_ATOMIC_RELAXED);
+   while (max > cur
+            && !(osal_atomic_cas_weak_u64 (&shard->max, &cur, max,
+                                           OSAL_ATOMIC_RELAXED, OSAL_ATOMIC_RELAXED)))
+      ;
+}
+
+static void hist_add (osal_histogram_t *hist, size_t b, uint64_t count,
+                      uint64_t sum, uint64_t min, uint64_t max)
+{
+   size_t self = osal_thread_slot (hist->slots);
+
+   if (self < HIST_OWNED) {
+      struct hist_shard_t *shard = hist_shard (hist, self);
+      hist_owned_add (&shard->counts[b], count);
+      hist_owned_add (&shard->sum, sum);
+      if (min < osal_atomic_load_u64 (&shard->min, OSAL_ATOMIC_RELAXED)) {
+         osal_atomic_store_u64 (&shard->min, min, OSAL_ATOMIC_RELAXED);
+      }
+      if (max > osal_atomic_load_u64 (&shard->max, OSAL_ATOMIC_RELAXED)) {
+         osal_atomic_store_u64 (&shard->max, max, OSAL_ATOMIC_RELAXED);
+      }
+      return;
+   }
+
+   struct hist_shard_t *shard = hist_shard (hist, HIST_OWNED);
+   osal_atomic_fetch_add_u64 (&shard->counts[b], count, OSAL_ATOMIC_RELAXED);
+   osal_atomic_fetch_add_u64 (&shard->sum, sum, OSAL_ATOMIC_RELAXED);
+   hist_shard_minmax (shard, min, max);
+}
+
+static uint64_t hist_bucket (osal_histogram_t *hist, size_t b)
+{
+   uint64_t ret = 0;
+   for (size_t i=0; i<HIST_SHARDS; i++) {
+      ret += osal_atomic_load_u64 (&hist_shard (hist, i)->counts[b], OSAL_ATOMIC_RELAXED);
+   }
+   return ret;
+}
+
+void osal_histogram_dump (osal_histogram_t *hist)
+{
+   if (!hist) {
+      fprintf (stdout, "NULL histogram_t object\n");
+      return;
+   }
+
+   static const double pct[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+   static const char *names[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+   uint64_t values[sizeof pct / sizeof pct[0]];
+
+   osal_histogram_percentiles (hist, pct, values, sizeof pct / sizeof pct[0]);
+
+   fprintf (stdout, "count:          %" PRIu64 "\n", osal_histogram_count (hist));
+   fprintf (stdout, "min:            %" PRIu64 "\n", osal_histogram_min (hist));
+   fprintf (stdout, "mean:           %.1f\n", osal_histogram_mean (hist));
+   for (size_t i=0; i<sizeof pct / sizeof pct[0]; i++) {
+      fprintf (stdout, "%-16s%" PRIu64 "\n", names[i], values[i]);
+   }
+   fprintf (stdout, "max:            %" PRIu64 "\n", osal_histogram_max (hist));
+}
+
+osal_histogram_t *osal_histogram_new (uint64_t max_value, unsigned precision)
+{
+   bool error = true;
+   osal_histogram_t *ret = NULL;
+
+   if (precision < OSAL_HISTOGRAM_PRECISION_MIN
+         || precision > OSAL_HISTOGRAM_PRECISION_MAX) {
+      goto cleanup;
+   }
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      goto cleanup;
+   }
+
+   ret->max_value = max_value ? max_value : 1;
+   ret->precision = precision;
+   ret->nbuckets = hist_index (precision, ret->max_value) + 1;
+
+   size_t len = sizeof (struct hist_shard_t) + ret->nbuckets * sizeof (uint64_t);
+   ret->stride = (len + CACHELINE_SIZE - 1) / CACHELINE_SIZE * CACHELINE_SIZE;
+   if (!(ret->raw = calloc (1, HIST_SHARDS * ret->stride + CACHELINE_SIZE))) {
+      goto cleanup;
+   }
+   ret->shards = ret->raw + (CACHELINE_SIZE - ((uintptr_t)ret->raw % CACHELINE_SIZE));
+
+   if (!(ret->slots = osal_thread_slots_new (HIST_OWNED))) {
+      goto cleanup;
+   }
+
+   osal_histogram_reset (ret);
+
+   error = false;
+
+cleanup:
+   if (error) {
+      osal_histogram_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void osal_histogram_del (osal_histogram_t *hist)
+{
+   if (!hist)
+      return;
+
+   osal_thread_slots_del (hist->slots);
+   free (hist->raw);
+   free (hist);
+}
+
+void osal_histogram_record (osal_histogram_t *hist, uint64_t value)
+{
+   osal_histogram_record_n (hist, value, 1);
+}
+
+void osal_histogram_record_n (osal_histogram_t *hist, uint64_t value, uint64_t count)
+{
+   if (!count) {
+      return;
+   }
+
+   size_t b = hist_index (hist->precision,
+                          value < hist->max_value ? value : hist->max_value);
+
+   hist_add (hist, b, count, value * count, value, value);
+}
+
+uint64_t osal_histogram_record_since (osal_histogram_t *hist, uint64_t start_ns)
+{
+   uint64_t now = osal_timer_since_start_ns ();
+   osal_histogram_record (hist, now > start_ns ? now - start_ns : 0);
+   return now;
+}
+
+void osal_histogram_reset (osal_histogram_t *hist)
+{
+   for (size_t i=0; i<HIST_SHARDS; i++) {
+      hist_shard_reset (hist, hist_shard (hist, i));
+   }
+}
+
+bool osal_histogram_merge (osal_histogram_t *dst, osal_histogram_t *src)
+{
+   if (dst->max_value != src->max_value || dst->precision != src->precision) {
+      return false;
+   }
+
+   uint64_t sum = 0;
+   for (size_t i=0; i<HIST_SHARDS; i++) {
+      sum += osal_atomic_load_u64 (&hist_shard (src, i)->sum, OSAL_ATOMIC_RELAXED);
+   }
+   uint64_t min = osal_histogram_min (src);
+   uint64_t max = osal_histogram_max (src);
+
+   // The sum, min and max go in with the first non-empty bucket.
+   for (size_t b=0; b<src->nbuckets; b++) {
+      uint64_t count = hist_bucket (src, b);
+      if (count) {
+         hist_add (dst, b, count, sum, min, max);
+         sum = 0;
+         min = UINT64_MAX;
+         max = 0;
+      }
+   }
+   return true;
+}
+
+uint64_t osal_histogram_count (osal_histogram_t *hist)
+{
+   uint64_t ret = 0;
+   for (size_t b=0; b<hist->nbuckets; b++) {
+      ret += hist_bucket (hist, b);
+   }
+   return ret;
+}
+
+uint64_t osal_histogram_min (osal_histogram_t *hist)
+{
+   uint64_t ret = UINT64_MAX;
+   for (size_t i=0; i<HIST_SHARDS; i++) {
+      uint64_t min = osal_atomic_load_u64 (&hist_shard (hist, i)->min, OSAL_ATOMIC_RELAXED);
+      if (min < ret) {
+         ret = min;
+      }
+   }
+   return ret == UINT64_MAX ? 0 : ret;
+}
+
+uint64_t osal_histogram_max (osal_histogram_t *hist)
+{
+   uint64_t ret = 0;
+   for (size_t i=0; i<HIST_SHARDS; i++) {
+      uint64_t max = osal_atomic_load_u64 (&hist_shard (hist, i)->max, OSAL_ATOMIC_RELAXED);
+      if (max > ret) {
+         ret = max;
+      }
+   }
+   return ret;
+}
+
+double osal_histogram_mean (osal_histogram_t *hist)
+{
+   uint64_t count = osal_histogram_count (hist);
+   uint64_t sum = 0;
+   for (size_t i=0; i<HIST_SHARDS; i++) {
+      sum += osal_atomic_load_u64 (&hist_shard (hist, i)->sum, OSAL_ATOMIC_RELAXED);
+   }
+   return count ? (double)sum / (double)count : 0.0;
+}
+
+uint64_t osal_histogram_percentile (osal_histogram_t *hist, double percentile)
+{
+   uint64_t ret;
+   osal_histogram_percentiles (hist, &percentile, &ret, 1);
+   return ret;
+}
+
+void osal_histogram_percentiles (osal_histogram_t *hist, const double *percentiles,
+                                 uint64_t *dst, size_t n)
+{
+   uint64_t total = osal_histogram_count (hist);
+   uint64_t min = osal_histogram_min (hist);
+   uint64_t max = osal_histogram_max (hist);
+   uint64_t seen = 0;
+   size_t b = 0;
+
+   for (size_t i=0; i<n; i++) {
+      if (!total || percentiles[i] >= 100.0) {
+         dst[i] = total ? max : 0;
+         continue;
+      }
+      if (percentiles[i] <= 0.0) {
+         dst[i] = min;
+         continue;
+      }
+
+      // The rank of the value wanted, rounded up, from 1 to total.
+      double exact = percentiles[i] / 100.0 * (double)total;
+      uint64_t rank = (uint64_t)exact;
+      if ((double)rank < exact) {
+         rank++;
+      }
+      if (rank < 1) {
+         rank = 1;
+      }
+
+      while (b < hist->nbuckets) {
+         uint64_t count = hist_bucket (hist, b);
+         if (seen + count >= rank) {
+            break;
+         }
+         seen += count;
+         b++;
+      }
+
+      uint64_t value = b < hist->nbuckets ? hist_highest (hist->precision, b) : max;
+      dst[i] = value < min ? min : value > max ? max : value;
+   }
+}
+
+/* ***************************************************** */
+
+// Writes are counted whether or not they fit, so that the size needed
+// can be found with a NULL dst.
+struct hist_writer_t {
+   uint8_t *dst;
+   size_t len;
+   size_t pos;
+};
+
+static void hist_put (struct hist_writer_t *w, uint64_t value)
+{
+   do {
+      uint8_t byte = (uint8_t)(value & 0x7f);
+      value >>= 7;
+      if (value) {
+         byte |= 0x80;
+      }
+      if (w->dst && w->pos < w->len) {
+         w->dst[w->pos] = byte;
+      }
+      w->pos++;
+   } while (value);
+}
+
+static bool hist_get (const uint8_t *src, size_t len, size_t *pos, uint64_t *value)
+{
+   *value = 0;
+   for (unsigned shift=0; shift<64; shift+=7) {
+      if (*pos >= len) {
+         return false;
+      }
+      uint8_t byte = src[(*pos)++];
+      *value |= (uint64_t)(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+static size_t hist_write (osal_histogram_t *hist, const uint64_t *counts,
+                          uint64_t sum, uint8_t *dst, size_t len)
+{
+   struct hist_writer_t w = { dst, len, 0 };
+
+   for (size_t i=0; i<sizeof hist_magic; i++) {
+      if (w.dst && w.pos < w.len) {
+         w.dst[w.pos] = hist_magic[i];
+      }
+      w.pos++;
+   }
+   hist_put (&w, hist->precision);
+   hist_put (&w, hist->max_value);
+   hist_put (&w, osal_histogram_min (hist));
+   hist_put (&w, osal_histogram_max (hist));
+   hist_put (&w, sum);
+
+   size_t gap = 0;
+   for (size_t b=0; b<hist->nbuckets; b++) {
+      if (!counts[b]) {
+         gap++;
+         continue;
+      }
+      hist_put (&w, gap);
+      hist_put (&w, counts[b]);
+      gap = 0;
+   }
+
+   return w.pos;
+}
+
+size_t osal_histogram_serialize (osal_histogram_t *hist, void *dst, size_t len)
+{
+   // Work from one snapshot, so the size found is the size written.
+   uint64_t *counts = malloc (hist->nbuckets * sizeof *counts);
+   if (!counts) {
+      return 0;
+   }
+   for (size_t b=0; b<hist->nbuckets; b++) {
+      counts[b] = hist_bucket (hist, b);
+   }
+   uint64_t sum = 0;
+   for (size_t i=0; i<HIST_SHARDS; i++) {
+      sum += osal_atomic_load_u64 (&hist_shard (hist, i)->sum, OSAL_ATOMIC_RELAXED);
+   }
+
+   size_t ret = hist_write (hist, counts, sum, NULL, 0);
+   if (dst && ret <= len) {
+      hist_write (hist, counts, sum, dst, len);
+   }
+
+   free (counts);
+   return ret;
+}
+
+osal_histogram_t *osal_histogram_deserialize (const void *src, size_t len)
+{
+   bool error = true;
+   osal_histogram_t *ret = NULL;
+   const uint8_t *bytes = src;
+   size_t pos = sizeof hist_magic;
+   uint64_t precision, max_value, min, max, sum;
+
+   if (!src || len < sizeof hist_magic
+         || memcmp (bytes, hist_magic, sizeof hist_magic) != 0) {
+      goto cleanup;
+   }
+   if (!hist_get (bytes, len, &pos, &precision)
+         || !hist_get (bytes, len, &pos, &max_value)
+         || !hist_get (bytes, len, &pos, &min)
+         || !hist_get (bytes, len, &pos, &max)
+         || !hist_get (bytes, len, &pos, &sum)
+         || precision > OSAL_HISTOGRAM_PRECISION_MAX) {
+      goto cleanup;
+   }
+
+   if (!(ret = osal_histogram_new (max_value, (unsigned)precision))) {
+      goto cleanup;
+   }
+
+   struct hist_shard_t *shard = hist_shard (ret, 0);
+   uint64_t total = 0;
+   size_t b = 0;
+   while (pos < len) {
+      uint64_t gap, count;
+      if (!hist_get (bytes, len, &pos, &gap)
+            || !hist_get (bytes, len, &pos, &count)
+            || gap >= ret->nbuckets - b) {
+         goto cleanup;
+      }
+      b += (size_t)gap;
+      shard->counts[b++] = count;
+      total += count;
+   }
+
+   shard->sum = sum;
+   if (total) {
+      shard->min = min;
+      shard->max = max;
+   }
+
+   error = false;
+
+cleanup:
+   if (error) {
+      osal_histogram_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
@@ -0,0 +1,117 @@
+
+#ifndef H_OSAL_HISTOGRAM
+#define H_OSAL_HISTOGRAM
+
+/* A latency histogram with log-linear buckets, after HdrHistogram.
+ *
+ * Values (normally nanoseconds) are kept to a given number of
+ * significant bits: values below 2^precision are counted exactly, and
+ * larger ones in buckets whose width is under 1 part in
+ * 2^(precision-1) of the value, so precision 8 keeps every value to
+ * within 0.8%. The buckets are allocated once, for values up to the
+ * maximum given to osal_histogram_new(); larger values are counted in
+ * the last bucket (though the exact maximum is still kept).
+ *
+ * Recording is lock-free and may be done from any number of threads.
+ * Each histogram has eight shards of the counts, on their own cache
+ * lines, that threads claim on their first record and give up when they
+ * exit (see osal_thread_slot()). Only its owner writes a shard, so that
+ * recording is a few plain loads and stores. While all eight are held,
+ * any further threads share one more shard with relaxed atomic adds.
+ * Queries sum the shards, so they are individually accurate but, while
+ * recording goes on, not necessarily consistent with each other.
+ */
+typedef struct osal_histogram_t osal_histogram_t;
+
+// Limits of the precision given to osal_histogram_new().
+#define OSAL_HISTOGRAM_PRECISION_MIN      1
+#define OSAL_HISTOGRAM_PRECISION_MAX      16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   /* Print the count, min, mean, max and the usual percentiles.
+    */
+   void osal_histogram_dump (osal_histogram_t *hist);
+
+   /* Create a histogram for values up to max_value, kept to precision
+    * significant bits. Returns NULL on error, including a precision
+    * outside OSAL_HISTOGRAM_PRECISION_MIN..OSAL_HISTOGRAM_PRECISION_MAX.
+    */
+   osal_histogram_t *osal_histogram_new (uint64_t max_value, unsigned precision);
+
+   /* Delete an object of type osal_histogram_t, which is returned from
+    * a successful call to osal_histogram_new() or
+    * osal_histogram_deserialize().
+    */
+   void osal_histogram_del (osal_histogram_t *hist);
+
+   /* Count one value, or count values of the same value.
+    */
+   void osal_histogram_record (osal_histogram_t *hist, uint64_t value);
+   void osal_histogram_record_n (osal_histogram_t *hist, uint64_t value,
+                                 uint64_t count);
+
+   /* Record the time since start_ns, a time from
+    * osal_timer_since_start_ns(), and return the current time, so that
+    * consecutive intervals can be recorded with one clock read each:
+    *
+    *    uint64_t t = osal_timer_since_start_ns ();
+    *    while (...) {
+    *       ...
+    *       t = osal_histogram_record_since (hist, t);
+    *    }
+    */
+   uint64_t osal_histogram_record_since (osal_histogram_t *hist, uint64_t start_ns);
+
+   /* Set every count back to zero. Must not be called while other
+    * threads are recording.
+    */
+   void osal_histogram_reset (osal_histogram_t *hist);
+
+   /* Add the counts of src to dst. Both must have been created with
+    * the same maximum and precision; returns false if not.
+    */
+   bool osal_histogram_merge (osal_histogram_t *dst, osal_histogram_t *src);
+
+   /* The number of values recorded, their smallest, largest and mean.
+    * The min and max are exact; the mean is from the exact sum. All are
+    * zero when nothing has been recorded.
+    */
+   uint64_t osal_histogram_count (osal_histogram_t *hist);
+   uint64_t osal_histogram_min (osal_histogram_t *hist);
+   uint64_t osal_histogram_max (osal_histogram_t *hist);
+   double osal_histogram_mean (osal_histogram_t *hist);
+
+   /* The value below which percentile percent of the values fall (e.g.
+    * 99.9 for p99.9), to within the precision of the histogram; 0
+    * gives the min and 100 the max. percentiles() finds n of them
+    * (given in ascending order) in one pass over the buckets.
+    */
+   uint64_t osal_histogram_percentile (osal_histogram_t *hist, double percentile);
+   void osal_histogram_percentiles (osal_histogram_t *hist, const double *percentiles,
+                                    uint64_t *dst, size_t n);
+
+   /* Write the histogram into dst in a compact form: a short header
+    * and then, for each non-empty bucket, the number of empty buckets
+    * before it and its count, all as variable-length integers. Returns
+    * the number of bytes needed; if that is more than len, nothing is
+    * written. Call with a NULL dst to find the size.
+    */
+   size_t osal_histogram_serialize (osal_histogram_t *hist, void *dst, size_t len);
+
+   /* Create a new histogram from the output of
+    * osal_histogram_serialize(). Returns NULL on error, including if
+    * src is not a valid serialized histogram.
+    */
+   osal_histogram_t *osal_histogram_deserialize (const void *src, size_t len);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
+
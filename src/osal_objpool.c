@@ -0,0 +1,386 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_objpool.h"
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_atomic.h"
+
+#define CACHELINE_SIZE     64
+
+// Number of per-thread magazines, and the number of objects each holds.
+// Threads that find every magazine taken go straight to the shared
+// stack.
+#define OBJPOOL_MAGS       64
+#define OBJPOOL_MAG_SIZE   32
+#define OBJPOOL_MAG_MASK   (OBJPOOL_MAG_SIZE - 1)
+
+/* The free stack links objects by index, in a separate array so that
+ * the objects themselves are never written by the pool. The head packs
+ * a tag (upper 32 bits), incremented on every change, with the index
+ * plus one of the top object (lower 32 bits, zero when empty).
+ *
+ * A magazine belongs to whichever thread holds the matching slot in
+ * the pool's osal_thread_slots_t, and is a bounded Chase-Lev deque (as
+ * in osal_pool): the owner pushes and pops at bottom with plain stores
+ * and a fence, and only needs a CAS to take the last object; any other
+ * thread steals at top with a CAS. A magazine whose owner has exited
+ * keeps its objects, which can be stolen or used by its next owner.
+ */
+struct objpool_mag_t {
+   int64_t top;
+   uint8_t pad_top[CACHELINE_SIZE - sizeof (int64_t)];
+   int64_t bottom;
+   uint8_t pad_bottom[CACHELINE_SIZE - sizeof (int64_t)];
+   void *objs[OBJPOOL_MAG_SIZE];
+};
+
+struct osal_objpool_t {
+   uint64_t head;
+   uint8_t pad_head[CACHELINE_SIZE - sizeof (uint64_t)];
+
+   uint32_t event;
+   uint32_t waiters;
+   uint8_t pad_waiters[CACHELINE_SIZE - 2 * sizeof (uint32_t)];
+
+   uint8_t *raw;
+   uint8_t *objects;
+   uint32_t *next;
+   size_t nobjects;
+   size_t obj_size;
+   size_t stride;
+   osal_objpool_fini_t *fini;
+   void *param;
+
+   osal_thread_slots_t *slots;
+   struct objpool_mag_t *mags;
+};
+
+static uint32_t objpool_index (osal_objpool_t *pool, void *object)
+{
+   return (uint32_t)(((uint8_t *)object - pool->objects) / pool->stride);
+}
+
+static void *objpool_object (osal_objpool_t *pool, uint32_t index)
+{
+   return pool->objects + (size_t)index * pool->stride;
+}
+
+static struct objpool_mag_t *objpool_mag (osal_objpool_t *pool)
+{
+   size_t slot = osal_thread_slot (pool->slots);
+   return slot < OBJPOOL_MAGS ? &pool->mags[slot] : NULL;
+}
+
+// Push the n objects in objs, linked together, with a single CAS.
+static void stack_push (osal_objpool_t *pool, void **objs, size_t n)
+{
+   uint32_t first = objpool_index (pool, objs[0]);
+   uint32_t last = objpool_index (pool, objs[n - 1]);
+
+   for (size_t i=0; i<n - 1; i++) {
+      uint32_t next = objpool_index (pool, objs[i + 1]) + 1;
+      osal_atomic_store_u32 (&pool->next[objpool_index (pool, objs[i])], next,
+                             OSAL_ATOMIC_RELAXED);
+   }
+
+   uint64_t head = osal_atomic_load_u64 (&pool->head, OSAL_ATOMIC_RELAXED);
+   uint64_t desired;
+   do {
+      osal_atomic_store_u32 (&pool->next[last], (uint32_t)head, OSAL_ATOMIC_RELAXED);
+      desired = (((head >> 32) + 1) << 32) | (first + 1);
+   } while (!(osal_atomic_cas_weak_u64 (&pool->head, &head, desired,
+                                        OSAL_ATOMIC_RELEASE, OSAL_ATOMIC_RELAXED)));
+}
+
+static void *stack_pop (osal_objpool_t *pool)
+{
+   uint64_t head = osal_atomic_load_u64 (&pool->head, OSAL_ATOMIC_ACQUIRE);
+   uint64_t desired;
+   uint32_t top;
+   do {
+      top = (uint32_t)head;
+      if (!top) {
+         return NULL;
+      }
+      uint32_t next = osal_atomic_load_u32 (&pool->next[top - 1], OSAL_ATOMIC_RELAXED);
+      desired = (((head >> 32) + 1) << 32) | next;
+   } while (!(osal_atomic_cas_weak_u64 (&pool->head, &head, desired,
+                                        OSAL_ATOMIC_ACQUIRE, OSAL_ATOMIC_ACQUIRE)));
+
+   return objpool_object (pool, top - 1);
+}
+
+// Only called by the magazine's owner.
+static bool mag_push (struct objpool_mag_t *mag, void *object)
+{
+   int64_t b = osal_atomic_load_i64 (&mag->bottom, OSAL_ATOMIC_RELAXED);
+   int64_t t = osal_atomic_load_i64 (&mag->top, OSAL_ATOMIC_ACQUIRE);
+   if (b - t >= OBJPOOL_MAG_SIZE) {
+      return false;
+   }
+
+   osal_atomic_store_ptr (&mag->objs[b & OBJPOOL_MAG_MASK], object, OSAL_ATOMIC_RELAXED);
+   osal_atomic_store_i64 (&mag->bottom, b + 1, OSAL_ATOMIC_RELEASE);
+   return true;
+}
+
+// Only called by the magazine's owner.
+static void *mag_pop (struct objpool_mag_t *mag)
+{
+   int64_t b = osal_atomic_load_i64 (&mag->bottom, OSAL_ATOMIC_RELAXED) - 1;
+   osal_atomic_store_i64 (&mag->bottom, b, OSAL_ATOMIC_RELAXED);
+   osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+   int64_t t = osal_atomic_load_i64 (&mag->top, OSAL_ATOMIC_RELAXED);
+
+   if (t > b) {
+      osal_atomic_store_i64 (&mag->bottom, b + 1, OSAL_ATOMIC_RELAXED);
+      return NULL;
+   }
+
+   void *ret = osal_atomic_load_ptr (&mag->objs[b & OBJPOOL_MAG_MASK], OSAL_ATOMIC_RELAXED);
+   if (t < b) {
+      return ret;
+   }
+
+   // Last object: race any thieves for it.
+   bool won = osal_atomic_cas_i64 (&mag->top, &t, t + 1,
+                                   OSAL_ATOMIC_SEQ_CST, OSAL_ATOMIC_RELAXED);
+   osal_atomic_store_i64 (&mag->bottom, b + 1, OSAL_ATOMIC_RELAXED);
+   return won ? ret : NULL;
+}
+
+static void *mag_steal (struct objpool_mag_t *mag)
+{
+   int64_t t = osal_atomic_load_i64 (&mag->top, OSAL_ATOMIC_ACQUIRE);
+   osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+   int64_t b = osal_atomic_load_i64 (&mag->bottom, OSAL_ATOMIC_ACQUIRE);
+
+   if (t >= b) {
+      return NULL;
+   }
+
+   void *ret = osal_atomic_load_ptr (&mag->objs[t & OBJPOOL_MAG_MASK], OSAL_ATOMIC_RELAXED);
+   return osal_atomic_cas_i64 (&mag->top, &t, t + 1,
+                               OSAL_ATOMIC_SEQ_CST, OSAL_ATOMIC_RELAXED) ? ret : NULL;
+}
+
+static size_t mag_count (struct objpool_mag_t *mag)
+{
+   int64_t t = osal_atomic_load_i64 (&mag->top, OSAL_ATOMIC_RELAXED);
+   int64_t b = osal_atomic_load_i64 (&mag->bottom, OSAL_ATOMIC_RELAXED);
+   return b > t ? (size_t)(b - t) : 0;
+}
+
+// Take one object from some other thread's magazine.
+static void *objpool_steal (osal_objpool_t *pool, struct objpool_mag_t *self)
+{
+   for (size_t i=0; i<OBJPOOL_MAGS; i++) {
+      struct objpool_mag_t *mag = &pool->mags[i];
+      if (mag == self) {
+         continue;
+      }
+
+      // A lost race means somebody else got an object; try the next.
+      void *ret = mag_steal (mag);
+      if (ret) {
+         return ret;
+      }
+   }
+   return NULL;
+}
+
+void osal_objpool_dump (osal_objpool_t *pool)
+{
+   if (!pool) {
+      fprintf (stdout, "NULL objpool_t object\n");
+      return;
+   }
+
+   uint64_t head = osal_atomic_load_u64 (&pool->head, OSAL_ATOMIC_RELAXED);
+   fprintf (stdout, "objects:        %zu\n", pool->nobjects);
+   fprintf (stdout, "obj_size:       %zu\n", pool->obj_size);
+   fprintf (stdout, "stride:         %zu\n", pool->stride);
+   fprintf (stdout, "head:           %" PRIu32 " (tag %" PRIu32 ")\n",
+            (uint32_t)head, (uint32_t)(head >> 32));
+   fprintf (stdout, "waiters:        %" PRIu32 "\n",
+            osal_atomic_load_u32 (&pool->waiters, OSAL_ATOMIC_RELAXED));
+   for (size_t i=0; i<OBJPOOL_MAGS; i++) {
+      size_t count = mag_count (&pool->mags[i]);
+      if (count) {
+         fprintf (stdout, "magazine %zu: %zu\n", i, count);
+      }
+   }
+}
+
+osal_objpool_t *osal_objpool_new (size_t nobjects, size_t obj_size,
+                                  osal_objpool_init_t *init,
+                                  osal_objpool_fini_t *fini,
+                                  void *param)
+{
+   bool error = true;
+   osal_objpool_t *ret = NULL;
+
+   if (!nobjects || nobjects >= UINT32_MAX || !obj_size) {
+      return NULL;
+   }
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      goto cleanup;
+   }
+
+   ret->nobjects = nobjects;
+   ret->obj_size = obj_size;
+   ret->stride = (obj_size + CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1);
+   ret->param = param;
+
+   if (!(ret->raw = calloc (1, nobjects * ret->stride + CACHELINE_SIZE))) {
+      goto cleanup;
+   }
+   ret->objects = ret->raw + (CACHELINE_SIZE - ((uintptr_t)ret->raw % CACHELINE_SIZE));
+
+   if (!(ret->next = calloc (nobjects, sizeof *ret->next))) {
+      goto cleanup;
+   }
+
+   if (!(ret->mags = calloc (OBJPOOL_MAGS, sizeof *ret->mags))) {
+      goto cleanup;
+   }
+
+   if (!(ret->slots = osal_thread_slots_new (OBJPOOL_MAGS))) {
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<nobjects; i++) {
+      if (init && !(init (objpool_object (ret, (uint32_t)i), param))) {
+         // Only the objects before this one get fini().
+         ret->nobjects = i;
+         goto cleanup;
+      }
+      ret->next[i] = i + 1 < nobjects ? (uint32_t)(i + 2) : 0;
+   }
+   ret->head = 1;
+   ret->fini = fini;
+
+   error = false;
+cleanup:
+   if (error) {
+      if (ret) {
+         ret->fini = fini;
+      }
+      osal_objpool_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void osal_objpool_del (osal_objpool_t *pool)
+{
+   if (!pool)
+      return;
+
+   if (pool->fini && pool->objects) {
+      for (size_t i=0; i<pool->nobjects; i++) {
+         pool->fini (objpool_object (pool, (uint32_t)i), pool->param);
+      }
+   }
+
+   osal_thread_slots_del (pool->slots);
+   free (pool->mags);
+   free (pool->next);
+   free (pool->raw);
+
+   free (pool);
+}
+
+void *osal_objpool_acquire (osal_objpool_t *pool)
+{
+   struct objpool_mag_t *mag = objpool_mag (pool);
+   void *ret;
+
+   if (mag && (ret = mag_pop (mag))) {
+      return ret;
+   }
+
+   if ((ret = stack_pop (pool))) {
+      // Refill half the magazine, on top of the object we return.
+      void *obj;
+      for (size_t i=1; mag && i<OBJPOOL_MAG_SIZE / 2 && (obj = stack_pop (pool)); i++) {
+         if (!(mag_push (mag, obj))) {
+            stack_push (pool, &obj, 1);
+            break;
+         }
+      }
+      return ret;
+   }
+
+   return objpool_steal (pool, mag);
+}
+
+void *osal_objpool_acquire_wait (osal_objpool_t *pool, uint64_t timeout_us)
+{
+   void *ret = osal_objpool_acquire (pool);
+   if (ret) {
+      return ret;
+   }
+
+   uint64_t deadline = (uint64_t)-1;
+   if (timeout_us != (uint64_t)-1) {
+      deadline = osal_timer_since_start () + timeout_us;
+   }
+
+   while (true) {
+      uint64_t remaining = (uint64_t)-1;
+      if (deadline != (uint64_t)-1) {
+         uint64_t now = osal_timer_since_start ();
+         if (now >= deadline) {
+            return NULL;
+         }
+         remaining = deadline - now;
+      }
+
+      uint32_t ev = osal_atomic_load_u32 (&pool->event, OSAL_ATOMIC_ACQUIRE);
+      osal_atomic_fetch_add_u32 (&pool->waiters, 1, OSAL_ATOMIC_RELAXED);
+      osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+
+      ret = osal_objpool_acquire (pool);
+      if (!ret) {
+         osal_futex_wait (&pool->event, ev, remaining);
+      }
+
+      osal_atomic_fetch_sub_u32 (&pool->waiters, 1, OSAL_ATOMIC_RELAXED);
+      if (ret) {
+         return ret;
+      }
+   }
+}
+
+void osal_objpool_release (osal_objpool_t *pool, void *object)
+{
+   struct objpool_mag_t *mag = objpool_mag (pool);
+
+   if (!mag) {
+      stack_push (pool, &object, 1);
+   } else if (!(mag_push (mag, object))) {
+      // Full: hand half of it back to the shared stack, with this one.
+      void *objs[OBJPOOL_MAG_SIZE / 2 + 1];
+      size_t n = 0;
+      objs[n++] = object;
+      while (n < OBJPOOL_MAG_SIZE / 2 + 1 && (objs[n] = mag_pop (mag))) {
+         n++;
+      }
+      stack_push (pool, objs, n);
+   }
+
+   osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+   if (osal_atomic_load_u32 (&pool->waiters, OSAL_ATOMIC_RELAXED)) {
+      osal_atomic_fetch_add_u32 (&pool->event, 1, OSAL_ATOMIC_RELEASE);
+      osal_futex_wake (&pool->event, 1);
+   }
+}
+
@@ -0,0 +1,442 @@
+
+#if 1
+#ifdef PLATFORM_POSIX
+#define _GNU_SOURCE 200809L
+#endif
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#ifdef PLATFORM_Windows
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "osal_pool.h"
+#include "osal_ccq.h"
+#include "osal_thread.h"
+#include "osal_atomic.h"
+
+#define CACHELINE_SIZE     64
+
+struct pool_task_t {
+   osal_pool_task_t *fptr;
+   void *param;
+   void *join;             // size_t *
+};
+
+/* A bounded Chase-Lev deque. The owning worker pushes and pops at
+ * bottom; any other thread steals at top. Both indices only ever
+ * increase, except for the owner's transient decrement of bottom in
+ * deque_pop(). The slot index is the index modulo the array length.
+ *
+ * A thief reads the slot before claiming it with a CAS on top, so the
+ * slot words are read and written atomically; a thief that loses the
+ * CAS discards whatever it read.
+ */
+struct pool_worker_t {
+   int64_t top;
+   uint8_t pad_top[CACHELINE_SIZE - sizeof (int64_t)];
+   int64_t bottom;
+   uint8_t pad_bottom[CACHELINE_SIZE - sizeof (int64_t)];
+
+   struct pool_task_t *tasks;
+   int64_t mask;
+   osal_pool_t *pool;
+   osal_thread_t thread;
+   bool started;
+
+   // Written only by this worker; read by osal_pool_dump().
+   uint64_t executed;
+   uint64_t stolen;
+   uint8_t pad_end[CACHELINE_SIZE];
+};
+
+struct osal_pool_t {
+   struct pool_worker_t *workers;
+   size_t nworkers;
+   osal_ccq_t *injector;
+   uint32_t stop;
+
+   // Tasks submitted but not yet completed.
+   size_t pending;
+   uint8_t pad_pending[CACHELINE_SIZE];
+
+   // Idle workers sleep on work_event; osal_pool_wait_all() sleeps on
+   // done_event. The *_waiters counts let the wake side skip the
+   // system call when nobody is asleep.
+   uint32_t work_event;
+   uint32_t work_waiters;
+   uint32_t done_event;
+   uint32_t done_waiters;
+};
+
+static OSAL_THREAD_LOCAL struct pool_worker_t *pool_self;
+static OSAL_THREAD_LOCAL uint64_t pool_rng;
+
+static size_t pool_ncpus (void)
+{
+#ifdef PLATFORM_Windows
+   SYSTEM_INFO si;
+   GetSystemInfo (&si);
+   return si.dwNumberOfProcessors;
+#else
+   long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+   return ncpus > 0 ? (size_t)ncpus : 1;
+#endif
+}
+
+static uint64_t pool_random (void)
+{
+   if (!pool_rng) {
+      pool_rng = (osal_thread_index () + 1) * 0x9e3779b97f4a7c15ULL;
+   }
+   pool_rng ^= pool_rng << 13;
+   pool_rng ^= pool_rng >> 7;
+   pool_rng ^= pool_rng << 17;
+   return pool_rng;
+}
+
+static struct pool_worker_t *pool_worker (osal_pool_t *pool)
+{
+   return pool_self && pool_self->pool == pool ? pool_self : NULL;
+}
+
+// osal_atomic.h has no function pointer operations (ISO C does not
+// allow them to pass through a void *), so fptr uses the builtin.
+static void slot_store (struct pool_task_t *slot, const struct pool_task_t *task)
+{
+   __atomic_store_n (&slot->fptr, task->fptr, OSAL_ATOMIC_RELAXED);
+   osal_atomic_store_ptr (&slot->param, task->param, OSAL_ATOMIC_RELAXED);
+   osal_atomic_store_ptr (&slot->join, task->join, OSAL_ATOMIC_RELAXED);
+}
+
+static void slot_load (struct pool_task_t *slot, struct pool_task_t *task)
+{
+   task->fptr = __atomic_load_n (&slot->fptr, OSAL_ATOMIC_RELAXED);
+   task->param = osal_atomic_load_ptr (&slot->param, OSAL_ATOMIC_RELAXED);
+   task->join = osal_atomic_load_ptr (&slot->join, OSAL_ATOMIC_RELAXED);
+}
+
+static bool deque_push (struct pool_worker_t *w, const struct pool_task_t *task)
+{
+   int64_t b = osal_atomic_load_i64 (&w->bottom, OSAL_ATOMIC_RELAXED);
+   int64_t t = osal_atomic_load_i64 (&w->top, OSAL_ATOMIC_ACQUIRE);
+   if (b - t > w->mask) {
+      return false;
+   }
+
+   slot_store (&w->tasks[b & w->mask], task);
+   osal_atomic_store_i64 (&w->bottom, b + 1, OSAL_ATOMIC_RELEASE);
+   return true;
+}
+
+static bool deque_pop (struct pool_worker_t *w, struct pool_task_t *task)
+{
+   int64_t b = osal_atomic_load_i64 (&w->bottom, OSAL_ATOMIC_RELAXED) - 1;
+   osal_atomic_store_i64 (&w->bottom, b, OSAL_ATOMIC_RELAXED);
+   osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+   int64_t t = osal_atomic_load_i64 (&w->top, OSAL_ATOMIC_RELAXED);
+
+   if (t > b) {
+      osal_atomic_store_i64 (&w->bottom, b + 1, OSAL_ATOMIC_RELAXED);
+      return false;
+   }
+
+   slot_load (&w->tasks[b & w->mask], task);
+   if (t < b) {
+      return true;
+   }
+
+   // Last task: race any thieves for it.
+   bool won = osal_atomic_cas_i64 (&w->top, &t, t + 1,
+                                   OSAL_ATOMIC_SEQ_CST, OSAL_ATOMIC_RELAXED);
+   osal_atomic_store_i64 (&w->bottom, b + 1, OSAL_ATOMIC_RELAXED);
+   return won;
+}
+
+static bool deque_steal (struct pool_worker_t *w, struct pool_task_t *task)
+{
+   int64_t t = osal_atomic_load_i64 (&w->top, OSAL_ATOMIC_ACQUIRE);
+   osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+   int64_t b = osal_atomic_load_i64 (&w->bottom, OSAL_ATOMIC_ACQUIRE);
+
+   if (t >= b) {
+      return false;
+   }
+
+   slot_load (&w->tasks[t & w->mask], task);
+   return osal_atomic_cas_i64 (&w->top, &t, t + 1,
+                               OSAL_ATOMIC_SEQ_CST, OSAL_ATOMIC_RELAXED);
+}
+
+// Own deque first, then the injector, then every other worker once,
+// starting from a random victim.
+static bool pool_find (osal_pool_t *pool, struct pool_worker_t *self,
+                       struct pool_task_t *task)
+{
+   if (self && deque_pop (self, task)) {
+      return true;
+   }
+
+   if (osal_ccq_dq_data (pool->injector, task, NULL)) {
+      return true;
+   }
+
+   size_t start = (size_t)(pool_random () % pool->nworkers);
+   for (size_t i=0; i<pool->nworkers; i++) {
+      struct pool_worker_t *victim = &pool->workers[(start + i) % pool->nworkers];
+      if (victim != self && deque_steal (victim, task)) {
+         if (self) {
+            osal_atomic_store_u64 (&self->stolen, self->stolen + 1, OSAL_ATOMIC_RELAXED);
+         }
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static void pool_run (osal_pool_t *pool, struct pool_worker_t *self,
+                      const struct pool_task_t *task)
+{
+   task->fptr (task->param);
+
+   if (self) {
+      osal_atomic_store_u64 (&self->executed, self->executed + 1, OSAL_ATOMIC_RELAXED);
+   }
+
+   if (task->join) {
+      osal_atomic_fetch_sub_size (task->join, 1, OSAL_ATOMIC_RELEASE);
+   }
+
+   if (osal_atomic_fetch_sub_size (&pool->pending, 1, OSAL_ATOMIC_SEQ_CST) == 1) {
+      osal_atomic_fetch_add_u32 (&pool->done_event, 1, OSAL_ATOMIC_SEQ_CST);
+      if (osal_atomic_load_u32 (&pool->done_waiters, OSAL_ATOMIC_SEQ_CST)) {
+         osal_futex_wake (&pool->done_event, UINT32_MAX);
+      }
+   }
+}
+
+static void pool_worker_func (void *param)
+{
+   struct pool_worker_t *self = param;
+   osal_pool_t *pool = self->pool;
+   struct pool_task_t task;
+
+   pool_self = self;
+
+   for (;;) {
+      if (pool_find (pool, self, &task)) {
+         pool_run (pool, self, &task);
+         continue;
+      }
+
+      // Register as a sleeper before the last look, so that a submit
+      // that this look misses is guaranteed to see the registration
+      // and bump work_event.
+      uint32_t event = osal_atomic_load_u32 (&pool->work_event, OSAL_ATOMIC_ACQUIRE);
+      osal_atomic_fetch_add_u32 (&pool->work_waiters, 1, OSAL_ATOMIC_SEQ_CST);
+      osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+
+      if (pool_find (pool, self, &task)) {
+         osal_atomic_fetch_sub_u32 (&pool->work_waiters, 1, OSAL_ATOMIC_RELAXED);
+         pool_run (pool, self, &task);
+         continue;
+      }
+
+      if (osal_atomic_load_u32 (&pool->stop, OSAL_ATOMIC_ACQUIRE)) {
+         osal_atomic_fetch_sub_u32 (&pool->work_waiters, 1, OSAL_ATOMIC_RELAXED);
+         break;
+      }
+
+      osal_futex_wait (&pool->work_event, event, OSAL_CCQ_WAIT_FOREVER);
+      osal_atomic_fetch_sub_u32 (&pool->work_waiters, 1, OSAL_ATOMIC_RELAXED);
+   }
+
+   pool_self = NULL;
+}
+
+static void pool_wake_workers (osal_pool_t *pool, uint32_t n)
+{
+   osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+   if (osal_atomic_load_u32 (&pool->work_waiters, OSAL_ATOMIC_RELAXED)) {
+      osal_atomic_fetch_add_u32 (&pool->work_event, 1, OSAL_ATOMIC_RELEASE);
+      osal_futex_wake (&pool->work_event, n);
+   }
+}
+
+void osal_pool_dump (osal_pool_t *pool)
+{
+   if (!pool) {
+      fprintf (stdout, "NULL pool_t object\n");
+      return;
+   }
+
+   fprintf (stdout, "workers:        %zu\n", pool->nworkers);
+   fprintf (stdout, "pending:        %zu\n",
+            osal_atomic_load_size (&pool->pending, OSAL_ATOMIC_RELAXED));
+   fprintf (stdout, "sleeping:       %" PRIu32 "\n",
+            osal_atomic_load_u32 (&pool->work_waiters, OSAL_ATOMIC_RELAXED));
+   for (size_t i=0; i<pool->nworkers; i++) {
+      struct pool_worker_t *w = &pool->workers[i];
+      fprintf (stdout, "worker %zu: top=%" PRIi64 " bottom=%" PRIi64
+                       " executed=%" PRIu64 " stolen=%" PRIu64 "\n",
+               i,
+               osal_atomic_load_i64 (&w->top, OSAL_ATOMIC_RELAXED),
+               osal_atomic_load_i64 (&w->bottom, OSAL_ATOMIC_RELAXED),
+               osal_atomic_load_u64 (&w->executed, OSAL_ATOMIC_RELAXED),
+               osal_atomic_load_u64 (&w->stolen, OSAL_ATOMIC_RELAXED));
+   }
+   fprintf (stdout, "injector: ");
+   osal_ccq_dump (pool->injector);
+}
+
+osal_pool_t *osal_pool_new (size_t nworkers, size_t nelements)
+{
+   bool error = true;
+   osal_pool_t *ret = NULL;
+   size_t len = 2;
+
+   if (!nworkers) {
+      nworkers = pool_ncpus ();
+   }
+
+   // Above the largest power of two, len would wrap to zero.
+   if (nelements > SIZE_MAX / 2 + 1) {
+      goto cleanup;
+   }
+   while (len < nelements) {
+      len <<= 1;
+   }
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      goto cleanup;
+   }
+
+   if (!(ret->workers = calloc (nworkers, sizeof *ret->workers))) {
+      goto cleanup;
+   }
+
+   ret->nworkers = nworkers;
+
+   if (!(ret->injector = osal_ccq_new_sized (len, sizeof (struct pool_task_t)))) {
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<nworkers; i++) {
+      struct pool_worker_t *w = &ret->workers[i];
+      if (!(w->tasks = calloc (len, sizeof *w->tasks))) {
+         goto cleanup;
+      }
+      w->mask = (int64_t)len - 1;
+      w->pool = ret;
+   }
+
+   for (size_t i=0; i<nworkers; i++) {
+      struct pool_worker_t *w = &ret->workers[i];
+      if (!(osal_thread_new (&w->thread, pool_worker_func, w))) {
+         goto cleanup;
+      }
+      w->started = true;
+   }
+
+   error = false;
+cleanup:
+   if (error) {
+      osal_pool_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void osal_pool_del (osal_pool_t *pool)
+{
+   if (!pool)
+      return;
+
+   if (pool->workers) {
+      osal_pool_wait_all (pool);
+
+      osal_atomic_store_u32 (&pool->stop, 1, OSAL_ATOMIC_RELEASE);
+      osal_atomic_fetch_add_u32 (&pool->work_event, 1, OSAL_ATOMIC_SEQ_CST);
+      osal_futex_wake (&pool->work_event, UINT32_MAX);
+
+      for (size_t i=0; i<pool->nworkers; i++) {
+         struct pool_worker_t *w = &pool->workers[i];
+         if (w->started) {
+            osal_thread_wait (&w->thread, 1);
+            osal_thread_del (&w->thread);
+         }
+         free (w->tasks);
+      }
+   }
+
+   free (pool->workers);
+   osal_ccq_del (pool->injector);
+
+   free (pool);
+}
+
+void osal_pool_submit_join (osal_pool_t *pool, osal_pool_task_t *fptr,
+                            void *param, size_t *join)
+{
+   struct pool_worker_t *self = pool_worker (pool);
+   struct pool_task_t task = { fptr, param, join };
+
+   if (join) {
+      osal_atomic_fetch_add_size (join, 1, OSAL_ATOMIC_RELAXED);
+   }
+   osal_atomic_fetch_add_size (&pool->pending, 1, OSAL_ATOMIC_SEQ_CST);
+
+   if ((self && deque_push (self, &task))
+         || osal_ccq_nq_data (pool->injector, &task)) {
+      pool_wake_workers (pool, 1);
+      return;
+   }
+
+   // Nowhere to put it, so do it now.
+   pool_run (pool, self, &task);
+}
+
+void osal_pool_submit (osal_pool_t *pool, osal_pool_task_t *fptr, void *param)
+{
+   osal_pool_submit_join (pool, fptr, param, NULL);
+}
+
+void osal_pool_wait_all (osal_pool_t *pool)
+{
+   for (;;) {
+      uint32_t event = osal_atomic_load_u32 (&pool->done_event, OSAL_ATOMIC_ACQUIRE);
+      if (!osal_atomic_load_size (&pool->pending, OSAL_ATOMIC_ACQUIRE)) {
+         return;
+      }
+
+      osal_atomic_fetch_add_u32 (&pool->done_waiters, 1, OSAL_ATOMIC_SEQ_CST);
+      if (osal_atomic_load_size (&pool->pending, OSAL_ATOMIC_SEQ_CST)) {
+         osal_futex_wait (&pool->done_event, event, OSAL_CCQ_WAIT_FOREVER);
+      }
+      osal_atomic_fetch_sub_u32 (&pool->done_waiters, 1, OSAL_ATOMIC_RELAXED);
+   }
+}
+
+void osal_pool_join (osal_pool_t *pool, size_t *join)
+{
+   struct pool_worker_t *self = pool_worker (pool);
+   struct pool_task_t task;
+
+   while (osal_atomic_load_size (join, OSAL_ATOMIC_ACQUIRE)) {
+      if (pool_find (pool, self, &task)) {
+         pool_run (pool, self, &task);
+      } else {
+         osal_thread_sleep (0);
+      }
+   }
+}
+
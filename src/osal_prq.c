@@ -0,0 +1,149 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_prq.h"
+#include "osal_ccq.h"
+#include "osal_atomic.h"
+
+/* Bit n of 'nonempty' is set whenever level n may hold a message. It is
+ * allowed to be set for an empty level (the next dequeue clears it) but
+ * must never be clear for a level that holds a message that no
+ * dequeue is about to find:
+ *
+ *    producer:  nq onto the level, then set the bit if it is clear
+ *    consumer:  on finding the level empty, clear the bit and then try
+ *               the level once more, setting the bit again if that
+ *               finds a message
+ *
+ * The producer has a full fence between its enqueue and its load of
+ * the bit, matching the consumer's, so it either sees the bit before
+ * the consumer clears it (and the consumer's second attempt sees the
+ * message), or sees it cleared and sets it again. The fence is our
+ * own, not left to osal_ccq_nq(), whose ordering is not part of its
+ * contract.
+ */
+#define CACHELINE_SIZE     64
+
+struct osal_prq_t {
+   osal_ccq_t *levels[OSAL_PRQ_MAX_LEVELS];
+   size_t nlevels;
+   char pad0[CACHELINE_SIZE];
+
+   uint32_t nonempty;
+   char pad1[CACHELINE_SIZE - sizeof (uint32_t)];
+};
+
+void osal_prq_dump (osal_prq_t *prq)
+{
+   if (!prq) {
+      fprintf (stdout, "NULL prq_t object\n");
+      return;
+   }
+
+   fprintf (stdout, "non-empty levels 0x%08" PRIx32 "\n",
+            osal_atomic_load_u32 (&prq->nonempty, OSAL_ATOMIC_RELAXED));
+   for (size_t i=0; i<prq->nlevels; i++) {
+      fprintf (stdout, "priority %zu: ", i);
+      osal_ccq_dump (prq->levels[i]);
+   }
+}
+
+osal_prq_t *osal_prq_new (size_t nlevels, size_t nelements)
+{
+   bool error = true;
+   osal_prq_t *ret = NULL;
+
+   if (!nlevels || nlevels > OSAL_PRQ_MAX_LEVELS) {
+      goto cleanup;
+   }
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      goto cleanup;
+   }
+
+   ret->nlevels = nlevels;
+   for (size_t i=0; i<nlevels; i++) {
+      if (!(ret->levels[i] = osal_ccq_new (nelements))) {
+         goto cleanup;
+      }
+   }
+
+   error = false;
+cleanup:
+   if (error) {
+      osal_prq_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void osal_prq_del (osal_prq_t *prq)
+{
+   if (!prq)
+      return;
+
+   for (size_t i=0; i<prq->nlevels; i++) {
+      osal_ccq_del (prq->levels[i]);
+   }
+
+   free (prq);
+}
+
+bool osal_prq_nq (osal_prq_t *prq, void *message, size_t priority)
+{
+   if (priority >= prq->nlevels) {
+      return false;
+   }
+
+   if (!(osal_ccq_nq (prq->levels[priority], message))) {
+      return false;
+   }
+
+   osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+
+   // Avoid the read-modify-write when the bit is already set, which
+   // is the common case for a busy level.
+   uint32_t bit = (uint32_t)1 << priority;
+   if (!(osal_atomic_load_u32 (&prq->nonempty, OSAL_ATOMIC_RELAXED) & bit)) {
+      osal_atomic_fetch_or_u32 (&prq->nonempty, bit, OSAL_ATOMIC_RELEASE);
+   }
+
+   return true;
+}
+
+bool osal_prq_dq (osal_prq_t *prq, void **dst, uint64_t *nq_time,
+                  size_t *priority)
+{
+   uint32_t map;
+
+   while ((map = osal_atomic_load_u32 (&prq->nonempty, OSAL_ATOMIC_ACQUIRE))) {
+      size_t level = (size_t)__builtin_ctz (map);
+      uint32_t bit = (uint32_t)1 << level;
+      bool found = osal_ccq_dq (prq->levels[level], dst, nq_time);
+
+      if (!found) {
+         osal_atomic_fetch_and_u32 (&prq->nonempty, ~bit, OSAL_ATOMIC_SEQ_CST);
+         osal_atomic_fence (OSAL_ATOMIC_SEQ_CST);
+         found = osal_ccq_dq (prq->levels[level], dst, nq_time);
+         if (found) {
+            // There may be more behind it, so put the bit back.
+            osal_atomic_fetch_or_u32 (&prq->nonempty, bit, OSAL_ATOMIC_RELEASE);
+         }
+      }
+
+      if (found) {
+         if (priority) {
+            *priority = level;
+         }
+         return true;
+      }
+   }
+
+   return false;
+}
+
@@ -0,0 +1,239 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "osal_rwlock.h"
+#include "osal_thread.h"
+#include "osal_atomic.h"
+
+#define CACHELINE_SIZE     64
+
+// Number of reader counts, each on its own cache line.
+#define RWLOCK_SLOTS       64
+
+// Iterations a writer spins on a reader count before sleeping on it.
+#define RWLOCK_SPINS       128
+
+#define WRITER_NONE        0
+#define WRITER_ACTIVE      1
+#define WRITER_READERS     2     // Active, and readers are asleep on it.
+
+/* A reader increments its slot and then checks for a writer; a writer
+ * sets the writer word and then checks every slot. Both sides use
+ * SEQ_CST, so at least one of them sees the other: either the reader
+ * sees the writer and backs out, or the writer sees the reader and
+ * waits for its slot to drain.
+ */
+struct rwlock_slot_t {
+   uint32_t readers;
+   uint8_t pad[CACHELINE_SIZE - sizeof (uint32_t)];
+};
+
+struct osal_rwlock_t {
+   uint32_t writer;
+   uint32_t wlock;
+   uint8_t pad_writer[CACHELINE_SIZE - 2 * sizeof (uint32_t)];
+
+   uint8_t *raw;
+   struct rwlock_slot_t *slots;
+};
+
+static struct rwlock_slot_t *rwlock_slot (osal_rwlock_t *rwlock)
+{
+   return &rwlock->slots[osal_thread_index () % RWLOCK_SLOTS];
+}
+
+static void rwlock_read_leave (osal_rwlock_t *rwlock, struct rwlock_slot_t *slot)
+{
+   if (osal_atomic_fetch_sub_u32 (&slot->readers, 1, OSAL_ATOMIC_SEQ_CST) == 1
+         && osal_atomic_load_u32 (&rwlock->writer, OSAL_ATOMIC_SEQ_CST) != WRITER_NONE) {
+      osal_futex_wake (&slot->readers, 1);
+   }
+}
+
+static void rwlock_wait_writer (osal_rwlock_t *rwlock)
+{
+   uint32_t writer = osal_atomic_load_u32 (&rwlock->writer, OSAL_ATOMIC_ACQUIRE);
+   while (writer != WRITER_NONE) {
+      if (writer == WRITER_ACTIVE
+            && !(osal_atomic_cas_u32 (&rwlock->writer, &writer, WRITER_READERS,
+                                      OSAL_ATOMIC_ACQUIRE, OSAL_ATOMIC_ACQUIRE))) {
+         continue;
+      }
+      osal_futex_wait (&rwlock->writer, WRITER_READERS, (uint64_t)-1);
+      writer = osal_atomic_load_u32 (&rwlock->writer, OSAL_ATOMIC_ACQUIRE);
+   }
+}
+
+void osal_rwlock_dump (osal_rwlock_t *rwlock)
+{
+   if (!rwlock) {
+      fprintf (stdout, "NULL rwlock_t object\n");
+      return;
+   }
+
+   fprintf (stdout, "writer:         %" PRIu32 "\n",
+            osal_atomic_load_u32 (&rwlock->writer, OSAL_ATOMIC_RELAXED));
+   for (size_t i=0; i<RWLOCK_SLOTS; i++) {
+      uint32_t readers = osal_atomic_load_u32 (&rwlock->slots[i].readers, OSAL_ATOMIC_RELAXED);
+      if (readers) {
+         fprintf (stdout, "slot %zu: %" PRIu32 " readers\n", i, readers);
+      }
+   }
+}
+
+osal_rwlock_t *osal_rwlock_new (void)
+{
+   osal_rwlock_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      return NULL;
+   }
+
+   size_t len = RWLOCK_SLOTS * sizeof *ret->slots;
+   if (!(ret->raw = calloc (1, len + CACHELINE_SIZE))) {
+      free (ret);
+      return NULL;
+   }
+   ret->slots = (struct rwlock_slot_t *)
+      (ret->raw + (CACHELINE_SIZE - ((uintptr_t)ret->raw % CACHELINE_SIZE)));
+
+   return ret;
+}
+
+void osal_rwlock_del (osal_rwlock_t *rwlock)
+{
+   if (!rwlock)
+      return;
+
+   free (rwlock->raw);
+   free (rwlock);
+}
+
+void osal_rwlock_read_lock (osal_rwlock_t *rwlock)
+{
+   struct rwlock_slot_t *slot = rwlock_slot (rwlock);
+
+   while (true) {
+      osal_atomic_fetch_add_u32 (&slot->readers, 1, OSAL_ATOMIC_SEQ_CST);
+      if (osal_atomic_load_u32 (&rwlock->writer, OSAL_ATOMIC_SEQ_CST) == WRITER_NONE) {
+         return;
+      }
+
+      rwlock_read_leave (rwlock, slot);
+      rwlock_wait_writer (rwlock);
+   }
+}
+
+void osal_rwlock_read_unlock (osal_rwlock_t *rwlock)
+{
+   rwlock_read_leave (rwlock, rwlock_slot (rwlock));
+}
+
+void osal_rwlock_write_lock (osal_rwlock_t *rwlock)
+{
+   osal_ftex_lock (&rwlock->wlock, "rwlock");
+   osal_atomic_store_u32 (&rwlock->writer, WRITER_ACTIVE, OSAL_ATOMIC_SEQ_CST);
+
+   for (size_t i=0; i<RWLOCK_SLOTS; i++) {
+      uint32_t *readers = &rwlock->slots[i].readers;
+      uint32_t r;
+      for (size_t spin=0; spin<RWLOCK_SPINS
+                  && osal_atomic_load_u32 (readers, OSAL_ATOMIC_SEQ_CST); spin++) {
+         osal_cpu_relax ();
+      }
+      while ((r = osal_atomic_load_u32 (readers, OSAL_ATOMIC_SEQ_CST))) {
+         osal_futex_wait (readers, r, (uint64_t)-1);
+      }
+   }
+}
+
+void osal_rwlock_write_unlock (osal_rwlock_t *rwlock)
+{
+   uint32_t prev = osal_atomic_xchg_u32 (&rwlock->writer, WRITER_NONE, OSAL_ATOMIC_RELEASE);
+   if (prev == WRITER_READERS) {
+      osal_futex_wake (&rwlock->writer, UINT32_MAX);
+   }
+   osal_ftex_unlock (&rwlock->wlock, "rwlock");
+}
+
+/* ***************************************************** */
+
+// The data is copied with relaxed atomic loads and stores so that a
+// torn read by a racing reader is merely wrong (and retried), not
+// undefined behaviour.
+static void seqlock_copy (void *dst, const void *src, size_t len)
+{
+   uint8_t *d = dst;
+   const uint8_t *s = src;
+
+   if ((((uintptr_t)d | (uintptr_t)s) % sizeof (uint64_t)) == 0) {
+      for (; len >= sizeof (uint64_t); len -= sizeof (uint64_t)) {
+         osal_atomic_store_u64 ((uint64_t *)d,
+                                osal_atomic_load_u64 ((const uint64_t *)s,
+                                                      OSAL_ATOMIC_RELAXED),
+                                OSAL_ATOMIC_RELAXED);
+         d += sizeof (uint64_t);
+         s += sizeof (uint64_t);
+      }
+   }
+   for (; len; len--) {
+      __atomic_store_n (d++, __atomic_load_n (s++, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+   }
+}
+
+void osal_seqlock_init (osal_seqlock_t *seqlock)
+{
+   seqlock->seq = 0;
+   seqlock->lock = 0;
+}
+
+uint32_t osal_seqlock_read_begin (osal_seqlock_t *seqlock)
+{
+   uint32_t seq;
+   while ((seq = osal_atomic_load_u32 (&seqlock->seq, OSAL_ATOMIC_ACQUIRE)) & 1) {
+      osal_cpu_relax ();
+   }
+   return seq;
+}
+
+bool osal_seqlock_read_retry (osal_seqlock_t *seqlock, uint32_t seq)
+{
+   osal_atomic_fence (OSAL_ATOMIC_ACQUIRE);
+   return osal_atomic_load_u32 (&seqlock->seq, OSAL_ATOMIC_RELAXED) != seq;
+}
+
+void osal_seqlock_write_begin (osal_seqlock_t *seqlock)
+{
+   osal_ftex_lock (&seqlock->lock, "seqlock");
+   osal_atomic_store_u32 (&seqlock->seq, seqlock->seq + 1, OSAL_ATOMIC_RELAXED);
+   osal_atomic_fence (OSAL_ATOMIC_RELEASE);
+}
+
+void osal_seqlock_write_end (osal_seqlock_t *seqlock)
+{
+   osal_atomic_store_u32 (&seqlock->seq, seqlock->seq + 1, OSAL_ATOMIC_RELEASE);
+   osal_ftex_unlock (&seqlock->lock, "seqlock");
+}
+
+void osal_seqlock_read (osal_seqlock_t *seqlock, void *dst,
+                        const void *src, size_t len)
+{
+   uint32_t seq;
+   do {
+      seq = osal_seqlock_read_begin (seqlock);
+      seqlock_copy (dst, src, len);
+   } while (osal_seqlock_read_retry (seqlock, seq));
+}
+
+void osal_seqlock_write (osal_seqlock_t *seqlock, void *dst,
+                         const void *src, size_t len)
+{
+   osal_seqlock_write_begin (seqlock);
+   seqlock_copy (dst, src, len);
+   osal_seqlock_write_end (seqlock);
+}
+
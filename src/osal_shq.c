@@ -0,0 +1,181 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_shq.h"
+#include "osal_ccq.h"
+#include "osal_thread.h"
+
+struct osal_shq_t {
+   osal_ccq_t **lanes;
+   size_t nlanes;
+   unsigned flags;
+
+   // The number of producers and consumers registered on each lane,
+   // only touched while registering under the lock.
+   uint32_t lock;
+   size_t *nproducers;
+   size_t *nconsumers;
+};
+
+static size_t shq_claim (osal_shq_t *shq, size_t *counts)
+{
+   size_t ret = 0;
+
+   osal_ftex_lock (&shq->lock, "shq");
+   for (size_t i=1; i<shq->nlanes; i++) {
+      if (counts[i] < counts[ret]) {
+         ret = i;
+      }
+   }
+   counts[ret]++;
+   osal_ftex_unlock (&shq->lock, "shq");
+
+   return ret;
+}
+
+static void shq_unclaim (osal_shq_t *shq, size_t *counts, size_t lane)
+{
+   osal_ftex_lock (&shq->lock, "shq");
+   if (lane < shq->nlanes && counts[lane]) {
+      counts[lane]--;
+   }
+   osal_ftex_unlock (&shq->lock, "shq");
+}
+
+void osal_shq_dump (osal_shq_t *shq)
+{
+   if (!shq) {
+      fprintf (stdout, "NULL shq_t object\n");
+      return;
+   }
+
+   for (size_t i=0; i<shq->nlanes; i++) {
+      fprintf (stdout, "lane %zu (%zu producers, %zu consumers): ",
+               i, shq->nproducers[i], shq->nconsumers[i]);
+      osal_ccq_dump (shq->lanes[i]);
+   }
+}
+
+osal_shq_t *osal_shq_new (size_t nlanes, size_t lane_elements, unsigned flags)
+{
+   bool error = true;
+   osal_shq_t *ret = NULL;
+
+   if (!nlanes) {
+      goto cleanup;
+   }
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      goto cleanup;
+   }
+
+   if (!(ret->lanes = calloc (nlanes, sizeof *ret->lanes))
+         || !(ret->nproducers = calloc (nlanes, sizeof *ret->nproducers))
+         || !(ret->nconsumers = calloc (nlanes, sizeof *ret->nconsumers))) {
+      goto cleanup;
+   }
+
+   ret->nlanes = nlanes;
+   ret->flags = flags;
+
+   for (size_t i=0; i<nlanes; i++) {
+      if (!(ret->lanes[i] = osal_ccq_new (lane_elements))) {
+         goto cleanup;
+      }
+   }
+
+   error = false;
+cleanup:
+   if (error) {
+      osal_shq_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void osal_shq_del (osal_shq_t *shq)
+{
+   if (!shq)
+      return;
+
+   if (shq->lanes) {
+      for (size_t i=0; i<shq->nlanes; i++) {
+         osal_ccq_del (shq->lanes[i]);
+      }
+   }
+
+   free (shq->lanes);
+   free (shq->nproducers);
+   free (shq->nconsumers);
+
+   free (shq);
+}
+
+size_t osal_shq_producer_add (osal_shq_t *shq)
+{
+   return shq_claim (shq, shq->nproducers);
+}
+
+size_t osal_shq_consumer_add (osal_shq_t *shq)
+{
+   return shq_claim (shq, shq->nconsumers);
+}
+
+void osal_shq_producer_remove (osal_shq_t *shq, size_t producer)
+{
+   shq_unclaim (shq, shq->nproducers, producer);
+}
+
+void osal_shq_consumer_remove (osal_shq_t *shq, size_t consumer)
+{
+   shq_unclaim (shq, shq->nconsumers, consumer);
+}
+
+bool osal_shq_nq (osal_shq_t *shq, size_t producer, void *message)
+{
+   size_t home = producer % shq->nlanes;
+
+   if (osal_ccq_nq (shq->lanes[home], message)) {
+      return true;
+   }
+
+   if (shq->flags & OSAL_SHQ_FIFO_PER_LANE) {
+      return false;
+   }
+
+   for (size_t i=1; i<shq->nlanes; i++) {
+      size_t lane = (home + i) % shq->nlanes;
+      if (osal_ccq_nq (shq->lanes[lane], message)) {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+bool osal_shq_dq (osal_shq_t *shq, size_t consumer,
+                  void **dst, uint64_t *nq_time)
+{
+   size_t home = consumer % shq->nlanes;
+
+   if (osal_ccq_dq (shq->lanes[home], dst, nq_time)) {
+      return true;
+   }
+
+   // Steal, starting with the lane after our own so that consumers
+   // with different home lanes start on different victims.
+   for (size_t i=1; i<shq->nlanes; i++) {
+      size_t lane = (home + i) % shq->nlanes;
+      if (osal_ccq_dq (shq->lanes[lane], dst, nq_time)) {
+         return true;
+      }
+   }
+
+   return false;
+}
+
@@ -0,0 +1,138 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_spsc.h"
+#include "osal_atomic.h"
+
+/* The indices only ever increase; the slot index is the index modulo
+ * array_len. The queue is empty when head == tail and full when
+ * head - tail == array_len.
+ *
+ * Each cache line below is written by one side only:
+ *    line 1: written by the producer (head, cached_tail)
+ *    line 2: written by the consumer (tail, cached_head)
+ */
+#define CACHELINE_SIZE     64
+
+struct osal_spsc_t {
+   void **array;
+   size_t array_len;
+   bool pow2;
+   char pad0[CACHELINE_SIZE];
+
+   size_t head;
+   size_t cached_tail;
+   char pad1[CACHELINE_SIZE - 2 * sizeof (size_t)];
+
+   size_t tail;
+   size_t cached_head;
+   char pad2[CACHELINE_SIZE - 2 * sizeof (size_t)];
+};
+
+static inline size_t spsc_index (osal_spsc_t *spsc, size_t pos)
+{
+   if (spsc->pow2) {
+      return pos & (spsc->array_len - 1);
+   }
+   return pos % spsc->array_len;
+}
+
+
+void osal_spsc_dump (osal_spsc_t *spsc)
+{
+   if (!spsc) {
+      fprintf (stdout, "NULL spsc_t object\n");
+      return;
+   }
+
+   size_t head = osal_atomic_load_size (&spsc->head, OSAL_ATOMIC_RELAXED);
+   size_t tail = osal_atomic_load_size (&spsc->tail, OSAL_ATOMIC_RELAXED);
+
+   fprintf (stdout, "head %zu, tail %zu, depth %zu/%zu\n",
+            head, tail, head - tail, spsc->array_len);
+}
+
+osal_spsc_t *osal_spsc_new (size_t nelements)
+{
+   bool error = true;
+   osal_spsc_t *ret = NULL;
+
+   if (!nelements) {
+      goto cleanup;
+   }
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      goto cleanup;
+   }
+
+   if (!(ret->array = malloc (sizeof *ret->array * nelements))) {
+      goto cleanup;
+   }
+
+   ret->array_len = nelements;
+   ret->pow2 = (nelements & (nelements - 1)) == 0;
+
+   error = false;
+cleanup:
+   if (error) {
+      osal_spsc_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void osal_spsc_del (osal_spsc_t *spsc)
+{
+   if (!spsc)
+      return;
+
+   free (spsc->array);
+
+   free (spsc);
+}
+
+bool osal_spsc_nq (osal_spsc_t *spsc, void *message)
+{
+   // Only this thread writes head, so a relaxed read is enough.
+   size_t head = osal_atomic_load_size (&spsc->head, OSAL_ATOMIC_RELAXED);
+
+   // Only look at the consumer's line when our cached copy of its
+   // index says that the queue is full.
+   if (head - spsc->cached_tail == spsc->array_len) {
+      spsc->cached_tail = osal_atomic_load_size (&spsc->tail, OSAL_ATOMIC_ACQUIRE);
+      if (head - spsc->cached_tail == spsc->array_len) {
+         return false;
+      }
+   }
+
+   spsc->array[spsc_index (spsc, head)] = message;
+   osal_atomic_store_size (&spsc->head, head + 1, OSAL_ATOMIC_RELEASE);
+
+   return true;
+}
+
+bool osal_spsc_dq (osal_spsc_t *spsc, void **dst)
+{
+   // Only this thread writes tail, so a relaxed read is enough.
+   size_t tail = osal_atomic_load_size (&spsc->tail, OSAL_ATOMIC_RELAXED);
+
+   // Only look at the producer's line when our cached copy of its
+   // index says that the queue is empty.
+   if (tail == spsc->cached_head) {
+      spsc->cached_head = osal_atomic_load_size (&spsc->head, OSAL_ATOMIC_ACQUIRE);
+      if (tail == spsc->cached_head) {
+         return false;
+      }
+   }
+
+   *dst = spsc->array[spsc_index (spsc, tail)];
+   osal_atomic_store_size (&spsc->tail, tail + 1, OSAL_ATOMIC_RELEASE);
+
+   return true;
+}
+
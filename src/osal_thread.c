@@ -1,8 +1,15 @@
 
+#if 1
+#ifdef PLATFORM_POSIX
+#define _GNU_SOURCE 200809L
+#endif
+#endif
+
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 #include <inttypes.h>
 
@@ -10,8 +17,24 @@
 #include <process.h>
 #endif
 
+#ifdef PLATFORM_POSIX
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 
 #include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_atomic.h"
+#include "osal_arena.h"
 
 #ifdef PLATFORM_Windows
 typedef unsigned int thread_return_t;
@@ -22,13 +45,22 @@ typedef void *thread_return_t;
 struct trunner_param_t {
    osal_thread_func_t *fptr;
    void *param;
+   char name[OSAL_THREAD_NAME_MAX];
+   bool cancelled;            // Set if the thread must exit at once.
 };
 
+static void thread_set_name (const char *name);
+
 static thread_return_t trunner (void *param)
 {
    struct trunner_param_t *tr = param;
-   tr->fptr (tr->param);
-   free (tr);
+   if (!tr->cancelled) {
+      if (tr->name[0]) {
+         thread_set_name (tr->name);
+      }
+      tr->fptr (tr->param);
+   }
+   osal_arena_free (tr);
 #ifdef PLATFORM_Windows
    return 0;
 #else
@@ -36,23 +68,117 @@ static thread_return_t trunner (void *param)
 #endif
 }
 
+static struct trunner_param_t *trunner_new (osal_thread_func_t *fptr, void *param,
+                                            const osal_thread_attr_t *attr)
+{
+   struct trunner_param_t *tr = osal_arena_alloc (sizeof *tr);
+   if (!tr) {
+      return NULL;
+   }
+
+   tr->fptr = fptr;
+   tr->param = param;
+   tr->name[0] = 0;
+   tr->cancelled = false;
+   if (attr && attr->name) {
+      size_t i;
+      for (i=0; i<sizeof tr->name - 1 && attr->name[i]; i++) {
+         tr->name[i] = attr->name[i];
+      }
+      tr->name[i] = 0;
+   }
+   return tr;
+}
+
+bool osal_thread_new (osal_thread_t *thandle, osal_thread_func_t *fptr, void *param)
+{
+   return osal_thread_new_ex (thandle, fptr, param, NULL);
+}
+
 /* ***************************************************** */
 
 #ifdef PLATFORM_Windows
 
-bool osal_thread_new (osal_thread_t *thandle, osal_thread_func_t *fptr, void *param)
+static bool thread_affinity_mask (const size_t *cpus, size_t ncpus, DWORD_PTR *mask)
+{
+   *mask = 0;
+   for (size_t i=0; i<ncpus; i++) {
+      if (cpus[i] >= sizeof *mask * 8) {
+         return false;
+      }
+      *mask |= (DWORD_PTR)1 << cpus[i];
+   }
+   return *mask != 0;
+}
+
+static void thread_set_name (const char *name)
+{
+   // SetThreadDescription() only exists from Windows 10 1607, and
+   // wants a wide string; names are only a debugging aid, so skip it.
+   (void)name;
+}
+
+bool osal_thread_new_ex (osal_thread_t *thandle, osal_thread_func_t *fptr,
+                         void *param, const osal_thread_attr_t *attr)
 {
-   struct trunner_param_t *tr = malloc (sizeof *tr);
+   DWORD_PTR mask = 0;
+   unsigned stack_size = 0;
+
+   if (attr) {
+      if (attr->ncpus && !(thread_affinity_mask (attr->cpus, attr->ncpus, &mask))) {
+         return false;
+      }
+      // There are no levels above time-critical to choose between.
+      if (attr->priority) {
+         return false;
+      }
+      stack_size = (unsigned)attr->stack_size;
+   }
+
+   struct trunner_param_t *tr = trunner_new (fptr, param, attr);
    if (!tr) {
       return false;
    }
 
-   tr->fptr = fptr;
-   tr->param = param;
+   *thandle = (HANDLE)_beginthreadex (NULL, stack_size, trunner, tr,
+                                      CREATE_SUSPENDED, NULL);
+   if (*thandle == 0) {
+      osal_arena_free (tr);
+      return false;
+   }
 
-   *thandle = (HANDLE)_beginthreadex (NULL, 0, trunner, tr, 0, NULL);
+   bool applied = true;
+   if (mask && SetThreadAffinityMask (*thandle, mask) == 0) {
+      applied = false;
+   }
+
+   if (applied && attr && attr->policy != OSAL_THREAD_POLICY_DEFAULT
+         && !(SetThreadPriority (*thandle, THREAD_PRIORITY_TIME_CRITICAL))) {
+      applied = false;
+   }
 
-   return *thandle != 0;
+   // The thread owns tr, so even a thread that must not run is resumed,
+   // to free it and exit, before it is waited for.
+   if (!applied) {
+      tr->cancelled = true;
+   }
+   ResumeThread (*thandle);
+   if (!applied) {
+      WaitForSingleObject (*thandle, INFINITE);
+      CloseHandle (*thandle);
+      *thandle = 0;
+      return false;
+   }
+   return true;
+}
+
+bool osal_thread_pin_self (const size_t *cpus, size_t ncpus)
+{
+   DWORD_PTR mask;
+   if (!(thread_affinity_mask (cpus, ncpus, &mask))) {
+      return false;
+   }
+   return SetThreadAffinityMask (GetCurrentThread (), mask) != 0;
 }
 
 bool osal_thread_wait (osal_thread_t *threads, size_t nthreads)
@@ -99,23 +225,136 @@ void osal_mutex_release (osal_mutex_t *mutex)
    ReleaseMutex (*mutex);
 }
 
+// Needs Synchronization.lib, Windows 8 or later.
+bool osal_futex_wait (uint32_t *target, uint32_t expected, uint64_t timeout_us)
+{
+   DWORD ms = INFINITE;
+   if (timeout_us != (uint64_t)-1) {
+      ms = (DWORD)((timeout_us + 999) / 1000);
+   }
+   return WaitOnAddress (target, &expected, sizeof expected, ms) ? true : false;
+}
+
+void osal_futex_wake (uint32_t *target, uint32_t nwaiters)
+{
+   if (nwaiters == 1) {
+      WakeByAddressSingle (target);
+   } else {
+      WakeByAddressAll (target);
+   }
+}
+
 #endif
 
 /* ***************************************************** */
 #ifdef PLATFORM_POSIX
 
 
-bool osal_thread_new (osal_thread_t *thandle, osal_thread_func_t *fptr, void *param)
+static void thread_set_name (const char *name)
+{
+#ifdef __linux__
+   pthread_setname_np (pthread_self (), name);
+#elif defined (__APPLE__)
+   pthread_setname_np (name);
+#else
+   (void)name;
+#endif
+}
+
+#ifdef __linux__
+static bool thread_cpuset (const size_t *cpus, size_t ncpus, cpu_set_t *set)
+{
+   CPU_ZERO (set);
+   for (size_t i=0; i<ncpus; i++) {
+      if (cpus[i] >= CPU_SETSIZE) {
+         return false;
+      }
+      CPU_SET (cpus[i], set);
+   }
+   return ncpus > 0;
+}
+#endif
+
+static bool thread_attr_init (pthread_attr_t *pattr, const osal_thread_attr_t *attr)
+{
+   if (attr->stack_size) {
+      size_t stack_size = attr->stack_size;
+      if (stack_size < (size_t)PTHREAD_STACK_MIN) {
+         stack_size = (size_t)PTHREAD_STACK_MIN;
+      }
+      if (pthread_attr_setstacksize (pattr, stack_size) != 0) {
+         return false;
+      }
+   }
+
+   if (attr->ncpus) {
+#ifdef __linux__
+      cpu_set_t set;
+      if (!(thread_cpuset (attr->cpus, attr->ncpus, &set))
+            || pthread_attr_setaffinity_np (pattr, sizeof set, &set) != 0) {
+         return false;
+      }
+#else
+      return false;
+#endif
+   }
+
+   // The default policy has no priority to set.
+   if (attr->policy == OSAL_THREAD_POLICY_DEFAULT && attr->priority) {
+      return false;
+   }
+
+   if (attr->policy != OSAL_THREAD_POLICY_DEFAULT) {
+      int policy = attr->policy == OSAL_THREAD_POLICY_FIFO ? SCHED_FIFO : SCHED_RR;
+      struct sched_param sp;
+      memset (&sp, 0, sizeof sp);
+      sp.sched_priority = attr->priority;
+      if (pthread_attr_setinheritsched (pattr, PTHREAD_EXPLICIT_SCHED) != 0
+            || pthread_attr_setschedpolicy (pattr, policy) != 0
+            || pthread_attr_setschedparam (pattr, &sp) != 0) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+bool osal_thread_new_ex (osal_thread_t *thandle, osal_thread_func_t *fptr,
+                         void *param, const osal_thread_attr_t *attr)
 {
-   struct trunner_param_t *tr = malloc (sizeof *tr);
+   pthread_attr_t pattr;
+   bool ret = false;
+
+   struct trunner_param_t *tr = trunner_new (fptr, param, attr);
    if (!tr) {
       return false;
    }
 
-   tr->fptr = fptr;
-   tr->param = param;
+   if (!attr) {
+      ret = pthread_create (thandle, NULL, trunner, tr) == 0;
+   } else if (pthread_attr_init (&pattr) == 0) {
+      ret = thread_attr_init (&pattr, attr)
+         && pthread_create (thandle, &pattr, trunner, tr) == 0;
+      pthread_attr_destroy (&pattr);
+   }
+
+   if (!ret) {
+      osal_arena_free (tr);
+   }
+   return ret;
+}
 
-   return pthread_create(thandle, NULL, trunner, tr) == 0;
+bool osal_thread_pin_self (const size_t *cpus, size_t ncpus)
+{
+#ifdef __linux__
+   cpu_set_t set;
+   return thread_cpuset (cpus, ncpus, &set)
+      && pthread_setaffinity_np (pthread_self (), sizeof set, &set) == 0;
+#else
+   (void)cpus;
+   (void)ncpus;
+   return false;
+#endif
 }
 
 bool osal_thread_wait (osal_thread_t *threads, size_t nthreads)
@@ -171,36 +410,701 @@ void osal_mutex_release (osal_mutex_t *mutex)
    pthread_mutex_unlock (mutex);
 }
 
+#ifdef __linux__
+
+/* The futex calls deliberately do not use the FUTEX_PRIVATE_FLAG so
+ * that the same word can be waited on from different processes when it
+ * lives in shared memory.
+ */
+bool osal_futex_wait (uint32_t *target, uint32_t expected, uint64_t timeout_us)
+{
+   struct timespec ts, *tsp = NULL;
+
+   if (timeout_us != (uint64_t)-1) {
+      ts.tv_sec = (time_t)(timeout_us / 1000000);
+      ts.tv_nsec = (long)((timeout_us % 1000000) * 1000);
+      tsp = &ts;
+   }
+
+   long rc = syscall (SYS_futex, target, FUTEX_WAIT, expected, tsp, NULL, 0);
+   if (rc == 0) {
+      return true;
+   }
+
+   // EAGAIN (value already changed) and EINTR are both reasons for the
+   // caller to look at the target again; only a timeout is a timeout.
+   return errno != ETIMEDOUT;
+}
+
+void osal_futex_wake (uint32_t *target, uint32_t nwaiters)
+{
+   if (nwaiters > INT32_MAX) {
+      nwaiters = INT32_MAX;
+   }
+   syscall (SYS_futex, target, FUTEX_WAKE, (int)nwaiters, NULL, NULL, 0);
+}
+
+#else
+
+/* No futex on this platform, so waiters poll at a millisecond
+ * granularity. Spurious returns are allowed by the interface.
+ */
+bool osal_futex_wait (uint32_t *target, uint32_t expected, uint64_t timeout_us)
+{
+   if (osal_atomic_load_u32 (target, OSAL_ATOMIC_ACQUIRE) != expected) {
+      return true;
+   }
+   if (timeout_us == 0) {
+      return false;
+   }
+   osal_thread_sleep (1);
+   return timeout_us > 1000;
+}
+
+void osal_futex_wake (uint32_t *target, uint32_t nwaiters)
+{
+   (void)target;
+   (void)nwaiters;
+}
+
+#endif
+
 bool osal_cmpxchange (uint32_t *target, uint32_t newval, uint32_t comparand)
 {
-   return __atomic_compare_exchange_n (target,
-                                       &comparand,
-                                       newval,
-                                       false,
-                                       __ATOMIC_ACQ_REL,
-                                       __ATOMIC_ACQUIRE);
+   return osal_atomic_cas_u32 (target, &comparand, newval,
+                               OSAL_ATOMIC_ACQ_REL, OSAL_ATOMIC_ACQUIRE);
 }
 
 #endif
 
 
-bool osal_ftex_acquire (uint32_t *target, const char *id)
+static size_t next_thread_index = 0;
+static OSAL_THREAD_LOCAL size_t thread_index = 0;   // Index + 1, 0 if unset
+
+size_t osal_thread_index (void)
 {
-   for (size_t i=0; i<5; i++) {
-      if (osal_cmpxchange (target, 1, 0)) {
-         return true;
+   if (!thread_index) {
+      thread_index = __atomic_add_fetch (&next_thread_index, 1, __ATOMIC_RELAXED);
+   }
+   return thread_index - 1;
+}
+
+/* Every set of slots is on the live list, with a serial number that is
+ * never reused, so that a thread can tell whether a set it once claimed
+ * a slot in still exists (or whether another set has since been
+ * allocated at the same address). Each thread keeps its claims in a
+ * small table; the fast path of osal_thread_slot() is a scan of that
+ * table, and everything else happens under slots_lock.
+ *
+ * A claim of (size_t)-1 records that every slot was taken, along with
+ * the number of slots given up so far, so that the thread only tries
+ * again once that number has changed.
+ */
+#define SLOTS_CLAIMS          16
+
+struct osal_thread_slots_t {
+   osal_thread_slots_t *next;
+   uint64_t serial;
+   uint64_t ngiven_up;
+   size_t nslots;
+   bool *taken;
+};
+
+struct slots_claim_t {
+   osal_thread_slots_t *slots;
+   uint64_t serial;
+   uint64_t ngiven_up;
+   size_t slot;
+};
+
+static uint32_t slots_lock;
+static osal_thread_slots_t *slots_live;
+static uint64_t slots_next_serial;
+
+static OSAL_THREAD_LOCAL struct slots_claim_t slots_claims[SLOTS_CLAIMS];
+
+static bool slots_is_live (const struct slots_claim_t *claim)
+{
+   for (osal_thread_slots_t *s = slots_live; s; s = s->next) {
+      if (s == claim->slots) {
+         return s->serial == claim->serial;
       }
    }
    return false;
 }
 
+static void slots_give_up (struct slots_claim_t *claim)
+{
+   if (claim->slot != (size_t)-1) {
+      claim->slots->taken[claim->slot] = false;
+      __atomic_store_n (&claim->slots->ngiven_up, claim->slots->ngiven_up + 1,
+                        __ATOMIC_RELAXED);
+   }
+}
+
+// Drop the claims on sets that have been deleted, keeping the rest at
+// the start of the table. Returns the number kept.
+static size_t slots_purge (void)
+{
+   size_t n = 0;
+   for (size_t i=0; i<SLOTS_CLAIMS && slots_claims[i].slots; i++) {
+      if (slots_is_live (&slots_claims[i])) {
+         slots_claims[n++] = slots_claims[i];
+      }
+   }
+   for (size_t i=n; i<SLOTS_CLAIMS; i++) {
+      slots_claims[i].slots = NULL;
+   }
+   return n;
+}
+
+/* On POSIX a thread-specific key destructor gives up the slots of an
+ * exiting thread. As for the arena, Windows has no equivalent for
+ * plain TLS, so there they stay taken.
+ */
+#ifdef PLATFORM_POSIX
+static pthread_key_t slots_key;
+static pthread_once_t slots_key_once = PTHREAD_ONCE_INIT;
+
+static void slots_exit (void *param)
+{
+   (void)param;
+
+   osal_ftex_lock (&slots_lock, "slots");
+   size_t n = slots_purge ();
+   for (size_t i=0; i<n; i++) {
+      slots_give_up (&slots_claims[i]);
+      slots_claims[i].slots = NULL;
+   }
+   osal_ftex_unlock (&slots_lock, "slots");
+}
+
+static void slots_key_create (void)
+{
+   pthread_key_create (&slots_key, slots_exit);
+}
+#endif
+
+osal_thread_slots_t *osal_thread_slots_new (size_t nslots)
+{
+   bool error = true;
+   osal_thread_slots_t *ret = NULL;
+
+   if (!nslots || nslots == (size_t)-1) {
+      goto cleanup;
+   }
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      goto cleanup;
+   }
+
+   if (!(ret->taken = calloc (nslots, sizeof *ret->taken))) {
+      goto cleanup;
+   }
+   ret->nslots = nslots;
+
+   osal_ftex_lock (&slots_lock, "slots");
+   ret->serial = ++slots_next_serial;
+   ret->next = slots_live;
+   slots_live = ret;
+   osal_ftex_unlock (&slots_lock, "slots");
+
+   error = false;
+cleanup:
+   if (error) {
+      osal_thread_slots_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void osal_thread_slots_del (osal_thread_slots_t *slots)
+{
+   if (!slots)
+      return;
+
+   osal_ftex_lock (&slots_lock, "slots");
+   for (osal_thread_slots_t **s = &slots_live; *s; s = &(*s)->next) {
+      if (*s == slots) {
+         *s = slots->next;
+         break;
+      }
+   }
+   osal_ftex_unlock (&slots_lock, "slots");
+
+   free (slots->taken);
+   free (slots);
+}
+
+static size_t slots_claim (osal_thread_slots_t *slots)
+{
+   osal_ftex_lock (&slots_lock, "slots");
+
+   size_t n = slots_purge ();
+   struct slots_claim_t *claim = NULL;
+   for (size_t i=0; i<n; i++) {
+      if (slots_claims[i].slots == slots) {
+         claim = &slots_claims[i];
+         break;
+      }
+   }
+   if (!claim) {
+      // With the table full, give up the oldest claim to make room.
+      if (n == SLOTS_CLAIMS) {
+         slots_give_up (&slots_claims[0]);
+         for (size_t i=1; i<SLOTS_CLAIMS; i++) {
+            slots_claims[i - 1] = slots_claims[i];
+         }
+         n--;
+      }
+      claim = &slots_claims[n];
+      claim->slots = slots;
+      claim->serial = slots->serial;
+   }
+
+   claim->slot = (size_t)-1;
+   claim->ngiven_up = slots->ngiven_up;
+   for (size_t i=0; i<slots->nslots; i++) {
+      if (!slots->taken[i]) {
+         slots->taken[i] = true;
+         claim->slot = i;
+         break;
+      }
+   }
+   size_t ret = claim->slot;
+
+   osal_ftex_unlock (&slots_lock, "slots");
+
+#ifdef PLATFORM_POSIX
+   // Any non-NULL value, so that the destructor runs.
+   pthread_once (&slots_key_once, slots_key_create);
+   pthread_setspecific (slots_key, slots_claims);
+#endif
+
+   return ret;
+}
+
+size_t osal_thread_slot (osal_thread_slots_t *slots)
+{
+   for (size_t i=0; i<SLOTS_CLAIMS && slots_claims[i].slots; i++) {
+      struct slots_claim_t *claim = &slots_claims[i];
+      if (claim->slots != slots || claim->serial != slots->serial) {
+         continue;
+      }
+      if (claim->slot != (size_t)-1
+            || claim->ngiven_up == __atomic_load_n (&slots->ngiven_up, __ATOMIC_RELAXED)) {
+         return claim->slot;
+      }
+      break;
+   }
+   return slots_claim (slots);
+}
+
+/* Fast mutex states:
+ *    0     unlocked
+ *    1     locked, nobody is (or might be) parked in the kernel
+ *    2     locked, somebody might be parked on the futex
+ *
+ * Only a release that sees state 2 makes the wake system call. A
+ * thread that parks always sets state 2 first, and a thread that is
+ * woken re-acquires with state 2 because it cannot know whether it was
+ * the last waiter (after Drepper, "Futexes Are Tricky").
+ *
+ * Before parking, osal_ftex_lock() spins for a while on a plain load
+ * with a CPU pause hint. The spin limit adapts per thread: it moves
+ * towards twice the number of spins that the last successful spin
+ * needed, and shrinks when spinning fails. So threads that usually
+ * find the holder about to release keep spinning, and threads that
+ * would be waiting for a descheduled holder park almost at once.
+ */
+#define FTEX_UNLOCKED         0
+#define FTEX_LOCKED           1
+#define FTEX_CONTENDED        2
+
+#define FTEX_SPIN_MIN         16
+#define FTEX_SPIN_MAX         4096
+#define FTEX_TRY_SPINS        5
+
+static OSAL_THREAD_LOCAL uint32_t ftex_spin_limit = 128;
+
+// Move the spin limit an eighth of the way towards 'goal'.
+static inline void ftex_spin_adapt (uint32_t limit, uint32_t goal)
+{
+   if (goal > limit) {
+      limit += (goal - limit) / 8 + 1;
+   } else {
+      limit -= (limit - goal) / 8;
+   }
+   if (limit < FTEX_SPIN_MIN) {
+      limit = FTEX_SPIN_MIN;
+   }
+   if (limit > FTEX_SPIN_MAX) {
+      limit = FTEX_SPIN_MAX;
+   }
+   ftex_spin_limit = limit;
+}
+
+static inline bool ftex_try (uint32_t *target)
+{
+   uint32_t expected = FTEX_UNLOCKED;
+   return osal_atomic_cas_u32 (target, &expected, FTEX_LOCKED,
+                               OSAL_ATOMIC_ACQUIRE, OSAL_ATOMIC_RELAXED);
+}
+
+/* Lock profiling. While enabled, every lock operation is charged to a
+ * site, which is the id argument: one site per distinct id pointer, in
+ * a small fixed table claimed with a CAS on first use. Ids beyond the
+ * size of the table are not profiled.
+ *
+ * The hold time needs the time at which the lock was taken; that is
+ * kept per thread, keyed by lock address, because one id may cover
+ * many locks and one thread may hold several at once.
+ */
+#define FTEX_PROFILE_SITES    64
+#define FTEX_PROFILE_HELD     8
+
+struct ftex_counts_t {
+   bool contended;
+   uint32_t failed_cas;
+   uint32_t spins;
+   uint32_t sleeps;
+};
+
+struct ftex_site_t {
+   const char *id;
+   uint64_t acquisitions;
+   uint64_t contended;
+   uint64_t failed_cas;
+   uint64_t spins;
+   uint64_t sleeps;
+   uint64_t acquire_ns[OSAL_FTEX_PROFILE_BUCKETS];
+   uint64_t hold_ns[OSAL_FTEX_PROFILE_BUCKETS];
+};
+
+struct ftex_held_t {
+   uint32_t *target;
+   struct ftex_site_t *site;
+   uint64_t since;
+};
+
+static bool ftex_profiling;
+static struct ftex_site_t ftex_sites[FTEX_PROFILE_SITES];
+static OSAL_THREAD_LOCAL struct ftex_held_t ftex_held[FTEX_PROFILE_HELD];
+
+static struct ftex_site_t *ftex_site (const char *id)
+{
+   static const char *unnamed = "(null)";
+   if (!id) {
+      id = unnamed;
+   }
+
+   size_t hash = (size_t)(((uintptr_t)id >> 3) * 0x9e3779b97f4a7c15ULL >> 32);
+   for (size_t i=0; i<FTEX_PROFILE_SITES; i++) {
+      struct ftex_site_t *site = &ftex_sites[(hash + i) % FTEX_PROFILE_SITES];
+      const char *current = __atomic_load_n (&site->id, __ATOMIC_ACQUIRE);
+      if (!current
+            && __atomic_compare_exchange_n (&site->id, &current, id, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+         return site;
+      }
+      if (current == id) {
+         return site;
+      }
+   }
+   return NULL;
+}
+
+static size_t ftex_bucket (uint64_t ns)
+{
+   size_t bucket = ns ? (size_t)(64 - __builtin_clzll (ns)) : 0;
+   return bucket < OSAL_FTEX_PROFILE_BUCKETS ? bucket : OSAL_FTEX_PROFILE_BUCKETS - 1;
+}
+
+static void ftex_profile_acquired (uint32_t *target, const char *id,
+                                   const struct ftex_counts_t *counts,
+                                   uint64_t start, bool acquired)
+{
+   struct ftex_site_t *site = ftex_site (id);
+   if (!site) {
+      return;
+   }
+
+   uint64_t now = osal_timer_since_start_ns ();
+   osal_atomic_fetch_add_u64 (&site->failed_cas, counts->failed_cas, OSAL_ATOMIC_RELAXED);
+   osal_atomic_fetch_add_u64 (&site->spins, counts->spins, OSAL_ATOMIC_RELAXED);
+   osal_atomic_fetch_add_u64 (&site->sleeps, counts->sleeps, OSAL_ATOMIC_RELAXED);
+   if (counts->contended) {
+      osal_atomic_fetch_add_u64 (&site->contended, 1, OSAL_ATOMIC_RELAXED);
+   }
+   if (!acquired) {
+      return;
+   }
+
+   osal_atomic_fetch_add_u64 (&site->acquisitions, 1, OSAL_ATOMIC_RELAXED);
+   osal_atomic_fetch_add_u64 (&site->acquire_ns[ftex_bucket (now - start)], 1, OSAL_ATOMIC_RELAXED);
+
+   for (size_t i=0; i<FTEX_PROFILE_HELD; i++) {
+      if (!ftex_held[i].target) {
+         ftex_held[i].target = target;
+         ftex_held[i].site = site;
+         ftex_held[i].since = now;
+         break;
+      }
+   }
+}
+
+static void ftex_profile_released (uint32_t *target)
+{
+   for (size_t i=0; i<FTEX_PROFILE_HELD; i++) {
+      if (ftex_held[i].target == target) {
+         uint64_t held = osal_timer_since_start_ns () - ftex_held[i].since;
+         osal_atomic_fetch_add_u64 (&ftex_held[i].site->hold_ns[ftex_bucket (held)], 1,
+                                    OSAL_ATOMIC_RELAXED);
+         ftex_held[i].target = NULL;
+         break;
+      }
+   }
+}
+
+static bool ftex_trylock (uint32_t *target, struct ftex_counts_t *counts)
+{
+   for (size_t i=0; i<FTEX_TRY_SPINS; i++) {
+      if (osal_atomic_load_u32 (target, OSAL_ATOMIC_RELAXED) == FTEX_UNLOCKED) {
+         if (ftex_try (target)) {
+            return true;
+         }
+         counts->failed_cas++;
+      }
+      counts->contended = true;
+      counts->spins++;
+      osal_cpu_relax ();
+   }
+   return false;
+}
+
+bool osal_ftex_acquire (uint32_t *target, const char *id)
+{
+   struct ftex_counts_t counts = { false, 0, 0, 0 };
+   if (!__atomic_load_n (&ftex_profiling, __ATOMIC_RELAXED)) {
+      return ftex_trylock (target, &counts);
+   }
+
+   uint64_t start = osal_timer_since_start_ns ();
+   bool ret = ftex_trylock (target, &counts);
+   ftex_profile_acquired (target, id, &counts, start, ret);
+   return ret;
+}
+
 bool osal_ftex_release (uint32_t *target, const char *id)
 {
-   for (size_t i=0; i<5; i++) {
-      if (osal_cmpxchange (target, 0, 1)) {
+   (void)id;
+   if (__atomic_load_n (&ftex_profiling, __ATOMIC_RELAXED)) {
+      ftex_profile_released (target);
+   }
+
+   uint32_t prev = osal_atomic_xchg_u32 (target, FTEX_UNLOCKED, OSAL_ATOMIC_RELEASE);
+   if (prev == FTEX_CONTENDED) {
+      osal_futex_wake (target, 1);
+   }
+   return prev != FTEX_UNLOCKED;
+}
+
+static void ftex_lock (uint32_t *target, struct ftex_counts_t *counts)
+{
+   if (ftex_try (target)) {
+      return;
+   }
+
+   counts->contended = true;
+   counts->failed_cas++;
+
+   uint32_t limit = ftex_spin_limit;
+   for (uint32_t i=0; i<limit; i++) {
+      osal_cpu_relax ();
+      counts->spins++;
+      uint32_t state = osal_atomic_load_u32 (target, OSAL_ATOMIC_RELAXED);
+      if (state == FTEX_CONTENDED) {
+         // Others are already parked; no point spinning behind them.
+         break;
+      }
+      if (state == FTEX_UNLOCKED) {
+         if (ftex_try (target)) {
+            ftex_spin_adapt (limit, 2 * i);
+            return;
+         }
+         counts->failed_cas++;
+      }
+   }
+
+   ftex_spin_adapt (limit, 0);
+
+   while (osal_atomic_xchg_u32 (target, FTEX_CONTENDED, OSAL_ATOMIC_ACQUIRE)
+            != FTEX_UNLOCKED) {
+      counts->sleeps++;
+      osal_futex_wait (target, FTEX_CONTENDED, (uint64_t)-1);
+   }
+}
+
+void osal_ftex_lock (uint32_t *target, const char *id)
+{
+   struct ftex_counts_t counts = { false, 0, 0, 0 };
+   if (!__atomic_load_n (&ftex_profiling, __ATOMIC_RELAXED)) {
+      ftex_lock (target, &counts);
+      return;
+   }
+
+   uint64_t start = osal_timer_since_start_ns ();
+   ftex_lock (target, &counts);
+   ftex_profile_acquired (target, id, &counts, start, true);
+}
+
+void osal_ftex_unlock (uint32_t *target, const char *id)
+{
+   osal_ftex_release (target, id);
+}
+
+void osal_ftex_profile_enable (bool enable)
+{
+   __atomic_store_n (&ftex_profiling, enable, __ATOMIC_RELAXED);
+}
+
+size_t osal_ftex_profile (osal_ftex_profile_t *dst, size_t ndst)
+{
+   size_t ret = 0;
+   for (size_t i=0; i<FTEX_PROFILE_SITES; i++) {
+      struct ftex_site_t *site = &ftex_sites[i];
+      const char *id = __atomic_load_n (&site->id, __ATOMIC_ACQUIRE);
+      if (!id) {
+         continue;
+      }
+      if (ret < ndst) {
+         osal_ftex_profile_t *p = &dst[ret];
+         p->id = id;
+         p->acquisitions = osal_atomic_load_u64 (&site->acquisitions, OSAL_ATOMIC_RELAXED);
+         p->contended = osal_atomic_load_u64 (&site->contended, OSAL_ATOMIC_RELAXED);
+         p->failed_cas = osal_atomic_load_u64 (&site->failed_cas, OSAL_ATOMIC_RELAXED);
+         p->spins = osal_atomic_load_u64 (&site->spins, OSAL_ATOMIC_RELAXED);
+         p->sleeps = osal_atomic_load_u64 (&site->sleeps, OSAL_ATOMIC_RELAXED);
+         for (size_t b=0; b<OSAL_FTEX_PROFILE_BUCKETS; b++) {
+            p->acquire_ns[b] = osal_atomic_load_u64 (&site->acquire_ns[b], OSAL_ATOMIC_RELAXED);
+            p->hold_ns[b] = osal_atomic_load_u64 (&site->hold_ns[b], OSAL_ATOMIC_RELAXED);
+         }
+      }
+      ret++;
+   }
+   return ret;
+}
+
+static void ftex_profile_dump_buckets (const char *name, const uint64_t *buckets)
+{
+   fprintf (stdout, "   %s:", name);
+   for (size_t b=0; b<OSAL_FTEX_PROFILE_BUCKETS; b++) {
+      if (buckets[b]) {
+         fprintf (stdout, " <%" PRIu64 "ns:%" PRIu64, (uint64_t)1 << b, buckets[b]);
+      }
+   }
+   fprintf (stdout, "\n");
+}
+
+void osal_ftex_profile_dump (void)
+{
+   osal_ftex_profile_t sites[FTEX_PROFILE_SITES];
+   size_t nsites = osal_ftex_profile (sites, FTEX_PROFILE_SITES);
+
+   for (size_t i=0; i<nsites; i++) {
+      osal_ftex_profile_t *p = &sites[i];
+      fprintf (stdout, "ftex [%s]: acquisitions=%" PRIu64 " contended=%" PRIu64
+                       " failed_cas=%" PRIu64 " spins=%" PRIu64 " sleeps=%" PRIu64 "\n",
+               p->id, p->acquisitions, p->contended, p->failed_cas, p->spins,
+               p->sleeps);
+      ftex_profile_dump_buckets ("acquire", p->acquire_ns);
+      ftex_profile_dump_buckets ("hold", p->hold_ns);
+   }
+}
+
+/* ***************************************************** */
+
+/* The count is also the futex word: waiters sleep while it is zero.
+ * Waiters register in sem->waiters before their final check of the
+ * count, and posters read sem->waiters after changing the count, so
+ * either the waiter sees the post or the poster sees the waiter.
+ */
+bool osal_sem_new (osal_sem_t *sem, uint32_t initial)
+{
+   sem->count = initial;
+   sem->waiters = 0;
+   return true;
+}
+
+void osal_sem_del (osal_sem_t *sem)
+{
+   (void)sem;
+}
+
+void osal_sem_post (osal_sem_t *sem)
+{
+   osal_sem_post_n (sem, 1);
+}
+
+void osal_sem_post_n (osal_sem_t *sem, uint32_t n)
+{
+   if (!n) {
+      return;
+   }
+   osal_atomic_fetch_add_u32 (&sem->count, n, OSAL_ATOMIC_SEQ_CST);
+   if (osal_atomic_load_u32 (&sem->waiters, OSAL_ATOMIC_SEQ_CST)) {
+      osal_futex_wake (&sem->count, n);
+   }
+}
+
+bool osal_sem_trywait (osal_sem_t *sem)
+{
+   uint32_t count = osal_atomic_load_u32 (&sem->count, OSAL_ATOMIC_RELAXED);
+   while (count) {
+      if (osal_atomic_cas_weak_u32 (&sem->count, &count, count - 1,
+                                    OSAL_ATOMIC_ACQUIRE, OSAL_ATOMIC_RELAXED)) {
          return true;
       }
    }
    return false;
 }
 
+void osal_sem_wait (osal_sem_t *sem)
+{
+   osal_sem_timedwait (sem, (uint64_t)-1);
+}
+
+bool osal_sem_timedwait (osal_sem_t *sem, uint64_t timeout_us)
+{
+   if (osal_sem_trywait (sem)) {
+      return true;
+   }
+
+   uint64_t deadline = (uint64_t)-1;
+   if (timeout_us != (uint64_t)-1) {
+      deadline = osal_timer_since_start () + timeout_us;
+   }
+
+   bool ret = false;
+   osal_atomic_fetch_add_u32 (&sem->waiters, 1, OSAL_ATOMIC_SEQ_CST);
+   while (true) {
+      if (osal_sem_trywait (sem)) {
+         ret = true;
+         break;
+      }
+
+      uint64_t remaining = (uint64_t)-1;
+      if (deadline != (uint64_t)-1) {
+         uint64_t now = osal_timer_since_start ();
+         if (now >= deadline) {
+            break;
+         }
+         remaining = deadline - now;
+      }
+
+      osal_futex_wait (&sem->count, 0, remaining);
+   }
+   osal_atomic_fetch_sub_u32 (&sem->waiters, 1, OSAL_ATOMIC_RELAXED);
+   return ret;
+}
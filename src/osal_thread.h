@@ -22,9 +22,8 @@
  * be created once at program startup, stored in a pool and handed out
  * to any caller who needs a new object of that instance.
  *
- * This requires semaphore support, so I expect to implement the
- * wrappers for semaphores once I get to the point where I need the pool
- * for some project or another.
+ * This requires semaphore support, which is provided by osal_sem_t
+ * below.
  *
  */
 #ifndef H_OSAL_THREAD
@@ -42,6 +41,63 @@ typedef pthread_mutex_t osal_mutex_t;
 
 typedef void (osal_thread_func_t) (void *);
 
+// A set of slots that threads claim, one each; see osal_thread_slot().
+typedef struct osal_thread_slots_t osal_thread_slots_t;
+
+// Number of log2 buckets in the ftex profiling histograms; bucket b
+// counts times below 2^b nanoseconds.
+#define OSAL_FTEX_PROFILE_BUCKETS      32
+
+// Lock profiling counters for one id; see osal_ftex_profile().
+typedef struct osal_ftex_profile_t {
+   const char *id;
+   uint64_t acquisitions;     // Successful acquisitions.
+   uint64_t contended;        // Acquisitions that found the lock held.
+   uint64_t failed_cas;       // Attempts to take a free lock that lost a race.
+   uint64_t spins;            // Spin iterations while waiting.
+   uint64_t sleeps;           // Times a waiter parked on the futex.
+   uint64_t acquire_ns[OSAL_FTEX_PROFILE_BUCKETS];
+   uint64_t hold_ns[OSAL_FTEX_PROFILE_BUCKETS];
+} osal_ftex_profile_t;
+
+// A counting semaphore. Treat the fields as private; they are only
+// here so that a semaphore can be declared without an allocation.
+typedef struct osal_sem_t {
+   uint32_t count;
+   uint32_t waiters;
+} osal_sem_t;
+
+// Scheduling policies for osal_thread_attr_t. FIFO and RR are the
+// POSIX real-time policies and normally need privileges; on Windows
+// either one just raises the thread to time-critical priority, and a
+// nonzero priority cannot be applied.
+#define OSAL_THREAD_POLICY_DEFAULT     0
+#define OSAL_THREAD_POLICY_FIFO        1
+#define OSAL_THREAD_POLICY_RR          2
+
+// Longest thread name kept, including the terminator (the Linux limit).
+#define OSAL_THREAD_NAME_MAX           16
+
+// Optional attributes for osal_thread_new_ex(). Zero every field that
+// is not needed; a zeroed struct gives the same thread as
+// osal_thread_new().
+typedef struct osal_thread_attr_t {
+   const size_t *cpus;        // CPUs the thread may run on, or NULL for any.
+   size_t ncpus;              // Number of entries in cpus.
+   size_t stack_size;         // Stack size in bytes, or 0 for the default.
+   const char *name;          // Shows up in top/perf; NULL for none.
+   int policy;                // One of the OSAL_THREAD_POLICY_* values.
+   int priority;              // Priority within a real-time policy; must
+                              // be 0 with OSAL_THREAD_POLICY_DEFAULT.
+} osal_thread_attr_t;
+
+// Storage class for thread-local variables.
+#ifdef _MSC_VER
+#define OSAL_THREAD_LOCAL     __declspec(thread)
+#else
+#define OSAL_THREAD_LOCAL     __thread
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -50,6 +106,18 @@ extern "C" {
    bool osal_thread_new (osal_thread_t *thandle, osal_thread_func_t *fptr,
                          void *param);
 
+   // Start a new thread with the given attributes (NULL for none).
+   // Fails, without starting the thread, if any attribute cannot be
+   // applied: e.g. a real-time policy without the privilege for it, or
+   // CPU affinity on a platform that does not support it. Names longer
+   // than OSAL_THREAD_NAME_MAX - 1 are truncated.
+   bool osal_thread_new_ex (osal_thread_t *thandle, osal_thread_func_t *fptr,
+                            void *param, const osal_thread_attr_t *attr);
+
+   // Restrict the calling thread to the ncpus CPUs listed in cpus.
+   // Returns false if that is not possible or not supported.
+   bool osal_thread_pin_self (const size_t *cpus, size_t ncpus);
+
    // Wait for the specified threads to complete execution. Thread handles are
    // specified as an array and nthreads specifies the length of the array
    bool osal_thread_wait (osal_thread_t *threads, size_t nthreads);
@@ -62,6 +130,28 @@ extern "C" {
    // function to clean up all resources held by the thread.
    void osal_thread_del (osal_thread_t *thandle);
 
+   // Returns a small number unique to the calling thread: the first
+   // thread to call this gets 0, the next gets 1, and so on. Numbers
+   // are not reused when threads exit. Useful for spreading threads
+   // over shards without any shared state.
+   size_t osal_thread_index (void);
+
+   // Create a set of nslots slots, for an object that keeps per-thread
+   // state in a fixed number of shards. Returns NULL on error.
+   osal_thread_slots_t *osal_thread_slots_new (size_t nslots);
+
+   // Delete a set of slots. No thread may be using it.
+   void osal_thread_slots_del (osal_thread_slots_t *slots);
+
+   // Returns the calling thread's slot in slots, claiming a free one
+   // the first time, or (size_t)-1 if every slot is taken (in which
+   // case the next call after some thread has given up its slot tries
+   // again). A slot is only ever held by one thread at a time, and is
+   // given up when its thread exits, so unlike osal_thread_index()
+   // this stays below nslots however many threads come and go. On
+   // Windows slots are never given up.
+   size_t osal_thread_slot (osal_thread_slots_t *slots);
+
 
    // Create a new mutex. Named mutexes are not supported.
    bool osal_mutex_new (osal_mutex_t *mutex);
@@ -90,21 +180,91 @@ extern "C" {
    // Might be a problem if this is used to create an in-process semaphore.
    bool osal_cmpxchange (uint32_t *target, uint32_t newval, uint32_t compare);
 
-   // Acquire a fast mutex. A fast mutex is an in-process mutex that will
-   // never cause a kernel context-switch. The target must be initialised
-   // to zero before any acquisitions and releases are performed.
+   // Try to acquire a fast mutex. A fast mutex is a single 32-bit word
+   // that only involves the kernel when a thread has to wait for it.
+   // The target must be initialised to zero before any acquisitions and
+   // releases are performed.
+   //
+   // This never blocks: it makes a few attempts and gives up. Use
+   // osal_ftex_lock() rather than calling this in a loop.
    //
    // Returns true if the fast mutex is acquired, false if it was not.
    bool osal_ftex_acquire (uint32_t *target, const char *id);
 
-   // Release a fast mutex. A fast mutex is an in-process mutex that will
-   // never cause a kernel context-switch. The target must be initialised
-   // to zero before any acquisitions and releases are performed.
+   // Release a fast mutex acquired with osal_ftex_acquire() or
+   // osal_ftex_lock(), waking one waiter if any are parked. Only makes
+   // a system call when there are waiters.
    //
-   // Returns true if the fast mutex was released, false if it is still
+   // Returns true if the fast mutex was released, false if it was not
    // held.
    bool osal_ftex_release (uint32_t *target, const char *id);
 
+   // Acquire a fast mutex, blocking until it is available. The caller
+   // first spins for a short, adaptive number of iterations with a CPU
+   // pause hint, then parks on the futex, so a thread waiting for a
+   // descheduled holder does not burn its timeslice.
+   void osal_ftex_lock (uint32_t *target, const char *id);
+
+   // Release a fast mutex; the same as osal_ftex_release().
+   void osal_ftex_unlock (uint32_t *target, const char *id);
+
+   // Turn lock profiling on or off (it starts off). While on, every
+   // fast mutex operation is counted against its id argument, so each
+   // distinct id (e.g. one per lock site) gets its own counters and
+   // time-to-acquire and hold-time histograms. Up to 64 distinct ids
+   // are profiled; ids are compared by pointer, not by contents.
+   // While off, the only cost is one relaxed load per operation.
+   void osal_ftex_profile_enable (bool enable);
+
+   // Copy the counters of up to ndst ids into dst. Returns the number
+   // of ids profiled so far, which may be more than ndst.
+   size_t osal_ftex_profile (osal_ftex_profile_t *dst, size_t ndst);
+
+   // Print the counters of every profiled id to stdout.
+   void osal_ftex_profile_dump (void);
+
+
+   // Create a semaphore with an initial count. Cannot fail; returns
+   // true for symmetry with osal_mutex_new().
+   bool osal_sem_new (osal_sem_t *sem, uint32_t initial);
+
+   // Delete a semaphore. No thread may be waiting on it.
+   void osal_sem_del (osal_sem_t *sem);
+
+   // Increment the count, waking one waiter if there is one. A single
+   // atomic operation when nobody is waiting.
+   void osal_sem_post (osal_sem_t *sem);
+
+   // Increment the count by n, waking up to n waiters with a single
+   // system call.
+   void osal_sem_post_n (osal_sem_t *sem, uint32_t n);
+
+   // Decrement the count if it is not zero. Never blocks; returns
+   // false if the count was zero.
+   bool osal_sem_trywait (osal_sem_t *sem);
+
+   // Decrement the count, blocking on the futex while it is zero.
+   void osal_sem_wait (osal_sem_t *sem);
+
+   // As osal_sem_wait(), but gives up after timeout_us microseconds
+   // ((uint64_t)-1 waits with no timeout). Returns false on timeout.
+   bool osal_sem_timedwait (osal_sem_t *sem, uint64_t timeout_us);
+
+
+   // Block the calling thread for as long as *target still contains
+   // expected, for at most timeout_us microseconds ((uint64_t)-1 waits
+   // with no timeout). This is a Linux futex (WaitOnAddress on
+   // Windows), so the caller must re-check its condition after every
+   // return: wakeups may be spurious.
+   //
+   // Returns false only if the timeout expired.
+   bool osal_futex_wait (uint32_t *target, uint32_t expected, uint64_t timeout_us);
+
+   // Wake up to nwaiters threads blocked in osal_futex_wait() on target.
+   // The caller must change *target before waking, or the woken threads
+   // will simply wait again.
+   void osal_futex_wake (uint32_t *target, uint32_t nwaiters);
+
 #ifdef __cplusplus
 };
 #endif
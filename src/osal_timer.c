@@ -18,7 +18,14 @@
 
 #include <time.h>
 
+#if defined (__x86_64__) && defined (__GNUC__)
+#define TIMER_HAVE_TSC
+#include <cpuid.h>
+#endif
+
 #include "osal_timer.h"
+#include "osal_thread.h"
+#include "osal_arena.h"
 
 #ifdef OSTYPE_Darwin // Provide our own implementation
 #define CLOCK_REALTIME    0x2d4e1588
@@ -30,7 +37,7 @@
 #endif
 
 struct osal_timer_t {
-   uint64_t tte_usecs;     // Time to expiry in microseconds
+   uint64_t tte_nsecs;     // Time to expiry in nanoseconds
 };
 
 
@@ -70,17 +77,19 @@ typedef union _LARGE_INTEGER {
 } LARGE_INTEGER, *PLARGE_INTEGER;
  */
 
-static const uint64_t num_ms_in_sec = 1000000ULL;
-static uint64_t start_counter = 0;
+static const uint64_t num_ns_in_sec = 1000000000ULL;
+static uint64_t start_counter = 0;   // In nanoseconds.
 
-/* get_time_now() must be rewritten for each target platform. It must
- * return a timestamp in microseconds. This function must return -1
+/* os_time_ns() must be rewritten for each target platform. It must
+ * return a timestamp in nanoseconds. This function must return -1
  * on error, so ensure that the return value is never -1 on success.
  */
 #ifdef PLATFORM_POSIX
 
-#ifdef OSTYPE_Linux
-#define CLOCK_ID           CLOCK_MONOTONIC_RAW
+// CLOCK_MONOTONIC is read in the vDSO, without a system call;
+// CLOCK_MONOTONIC_RAW is not on many kernels.
+#if defined (OSTYPE_Linux) || defined (__linux__)
+#define CLOCK_ID           CLOCK_MONOTONIC
 #endif
 
 #ifdef OSTYPE_FreeBSD
@@ -126,7 +135,7 @@ int clock_gettime(int clock_id, struct timespec *ts)
 
 
 
-static uint64_t get_time_now (void)
+static uint64_t os_time_ns (void)
 {
    struct timespec rt;
    uint64_t now;
@@ -134,8 +143,8 @@ static uint64_t get_time_now (void)
    if (clock_gettime (CLOCK_ID, &rt)!=0)
       return (uint64_t)-1;
 
-   now = rt.tv_sec * num_ms_in_sec;
-   now += rt.tv_nsec / (uint64_t)1000;
+   now = (uint64_t)rt.tv_sec * num_ns_in_sec;
+   now += (uint64_t)rt.tv_nsec;
 
    if (now==(uint64_t)-1) {
       now++;
@@ -148,7 +157,7 @@ static uint64_t get_time_now (void)
 
 #ifdef PLATFORM_Windows
 static uint64_t ticks_per_sec = 0;   // For windows, see function #1 above.
-static uint64_t get_time_now (void)
+static uint64_t os_time_ns (void)
 {
    LARGE_INTEGER large_int_type;
    uint64_t retval;
@@ -162,7 +171,9 @@ static uint64_t get_time_now (void)
       return (uint64_t)-1;
    }
 
-   retval = large_int_type.QuadPart / (ticks_per_sec / num_ms_in_sec);
+   uint64_t ticks = large_int_type.QuadPart;
+   retval = (ticks / ticks_per_sec) * num_ns_in_sec
+          + (ticks % ticks_per_sec) * num_ns_in_sec / ticks_per_sec;
 
    if (retval==(uint64_t)-1) {
       retval++;
@@ -172,28 +183,208 @@ static uint64_t get_time_now (void)
 #endif
 
 
+/* The TSC clock. With an invariant TSC (constant rate, running in all
+ * power states) a timestamp is one RDTSC and a multiply, instead of a
+ * clock_gettime() call. The TSC rate is measured against the OS clock
+ * when the TSC is selected, and TSC readings are converted to OS clock
+ * nanoseconds as
+ *
+ *    tsc_base_ns + ((tsc - tsc_base) * tsc_mult) >> 32
+ *
+ * so the two clocks agree at the moment of calibration. They drift
+ * apart afterwards (by the error in the measured rate, and by any NTP
+ * slewing of the OS clock), and a later switch does not re-base the TSC,
+ * so any switch after the first can make time jump either way.
+ *
+ * Calibration happens once, under tsc_lock, the first time the TSC is
+ * selected; the tsc_* globals are then never written again. They are
+ * published by the release store of clock_source, so every read of
+ * clock_source that may lead to a TSC read is an acquire.
+ */
+#define TSC_CALIBRATE_NS      (20 * 1000 * 1000)
+
+static int clock_source = OSAL_TIMER_CLOCK_OS;
+
+#ifdef TIMER_HAVE_TSC
+static uint64_t tsc_base;
+static uint64_t tsc_base_ns;
+static uint64_t tsc_mult;
+
+// 0 until calibrated, then 1 if the TSC can be used and -1 if not.
+static int tsc_calibrated;
+static uint32_t tsc_lock;
+
+static bool tsc_invariant (void)
+{
+   unsigned int eax, ebx, ecx, edx;
+   if (!__get_cpuid (0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+      return false;
+   }
+   if (!__get_cpuid (0x80000007, &eax, &ebx, &ecx, &edx)) {
+      return false;
+   }
+   return (edx & (1 << 8)) != 0;
+}
+
+static inline uint64_t tsc_time_ns (void)
+{
+   uint64_t delta = __builtin_ia32_rdtsc () - tsc_base;
+   return tsc_base_ns + (uint64_t)(((unsigned __int128)delta * tsc_mult) >> 32);
+}
+
+// Read the TSC on both sides of an OS clock read, and pair the OS time
+// with the midpoint.
+static bool tsc_sample (uint64_t *tsc, uint64_t *ns)
+{
+   uint64_t before = __builtin_ia32_rdtsc ();
+   *ns = os_time_ns ();
+   uint64_t after = __builtin_ia32_rdtsc ();
+   *tsc = before + (after - before) / 2;
+   return *ns != (uint64_t)-1;
+}
+
+static bool tsc_calibrate (void)
+{
+   uint64_t tsc0, ns0, tsc1, ns1;
+
+   if (!tsc_invariant () || !tsc_sample (&tsc0, &ns0)) {
+      return false;
+   }
+   do {
+      if (!tsc_sample (&tsc1, &ns1)) {
+         return false;
+      }
+   } while (ns1 - ns0 < TSC_CALIBRATE_NS);
+
+   if (tsc1 <= tsc0) {
+      return false;
+   }
+
+   tsc_mult = (uint64_t)((((unsigned __int128)(ns1 - ns0)) << 32) / (tsc1 - tsc0));
+   tsc_base = tsc1;
+   tsc_base_ns = ns1;
+   return tsc_mult != 0;
+}
+
+static bool tsc_calibrate_once (void)
+{
+   int state = __atomic_load_n (&tsc_calibrated, __ATOMIC_ACQUIRE);
+   if (!state) {
+      osal_ftex_lock (&tsc_lock, "tsc");
+      if (!(state = tsc_calibrated)) {
+         state = tsc_calibrate () ? 1 : -1;
+         __atomic_store_n (&tsc_calibrated, state, __ATOMIC_RELEASE);
+      }
+      osal_ftex_unlock (&tsc_lock, "tsc");
+   }
+   return state > 0;
+}
+#endif
+
+static inline uint64_t get_time_ns (void)
+{
+#ifdef TIMER_HAVE_TSC
+   if (__atomic_load_n (&clock_source, __ATOMIC_ACQUIRE) == OSAL_TIMER_CLOCK_TSC) {
+      return tsc_time_ns ();
+   }
+#endif
+   return os_time_ns ();
+}
+
+/* Returns a timestamp in microseconds from the selected clock, or -1
+ * on error.
+ */
+static uint64_t get_time_now (void)
+{
+   uint64_t now = get_time_ns ();
+   if (now == (uint64_t)-1)
+      return (uint64_t)-1;
+
+   now /= 1000;
+   if (now == (uint64_t)-1) {
+      now++;
+   }
+   return now;
+}
+
+bool osal_timer_clock_select (int clock)
+{
+   if (clock == OSAL_TIMER_CLOCK_OS) {
+      __atomic_store_n (&clock_source, OSAL_TIMER_CLOCK_OS, __ATOMIC_RELAXED);
+      return true;
+   }
+
+#ifdef TIMER_HAVE_TSC
+   if (clock == OSAL_TIMER_CLOCK_TSC || clock == OSAL_TIMER_CLOCK_AUTO) {
+      if (__atomic_load_n (&clock_source, __ATOMIC_ACQUIRE) == OSAL_TIMER_CLOCK_TSC) {
+         return true;
+      }
+      if (tsc_calibrate_once ()) {
+         __atomic_store_n (&clock_source, OSAL_TIMER_CLOCK_TSC, __ATOMIC_RELEASE);
+         return true;
+      }
+   }
+#endif
+
+   // AUTO always succeeds, with the OS clock if nothing better.
+   return clock == OSAL_TIMER_CLOCK_AUTO;
+}
+
+int osal_timer_clock (void)
+{
+   return __atomic_load_n (&clock_source, __ATOMIC_ACQUIRE);
+}
+
+const char *osal_timer_clock_name (int clock)
+{
+   switch (clock) {
+      case OSAL_TIMER_CLOCK_OS:     return "os";
+      case OSAL_TIMER_CLOCK_TSC:    return "tsc";
+      case OSAL_TIMER_CLOCK_AUTO:   return "auto";
+   }
+   return "unknown";
+}
 
 void osal_timer_init (void)
 {
+   osal_timer_clock_select (OSAL_TIMER_CLOCK_AUTO);
    osal_timer_mark_us ();
-   start_counter = get_time_now ();
+   osal_timer_mark_ns ();
+   start_counter = get_time_ns ();
+}
+
+// Microsecond timeouts that do not fit in nanoseconds (such as -1 for
+// "never") become the furthest possible expiry.
+static uint64_t us_to_ns (uint64_t micros)
+{
+   return micros > (uint64_t)-1 / 1000 ? (uint64_t)-1 : micros * 1000;
 }
 
 osal_timer_t *osal_timer_set (uint64_t micros)
 {
-   osal_timer_t *ret = malloc (sizeof *ret);
+   return osal_timer_set_ns (us_to_ns (micros));
+}
+
+bool osal_timer_reset (osal_timer_t *xt, uint64_t micros)
+{
+   return osal_timer_reset_ns (xt, us_to_ns (micros));
+}
+
+osal_timer_t *osal_timer_set_ns (uint64_t nanos)
+{
+   osal_timer_t *ret = osal_arena_alloc (sizeof *ret);
    if (!ret)
       return NULL;
-   if (!(osal_timer_reset (ret, micros))) {
-      free (ret);
+   if (!(osal_timer_reset_ns (ret, nanos))) {
+      osal_arena_free (ret);
       return NULL;
    }
    return ret;
 }
 
-bool osal_timer_reset (osal_timer_t *xt, uint64_t micros)
+bool osal_timer_reset_ns (osal_timer_t *xt, uint64_t nanos)
 {
-   uint64_t now = get_time_now ();
+   uint64_t now = get_time_ns ();
    if (now == (uint64_t)-1)
       return false;
 
@@ -202,14 +393,14 @@ bool osal_timer_reset (osal_timer_t *xt, uint64_t micros)
 
    memset (xt, 0, sizeof *xt);
 
-   xt->tte_usecs = now + micros;
+   xt->tte_nsecs = nanos > (uint64_t)-1 - now ? (uint64_t)-1 : now + nanos;
 
    return true;
 }
 
 bool osal_timer_expired (osal_timer_t *xt)
 {
-   uint64_t now = get_time_now ();
+   uint64_t now = get_time_ns ();
 
    if (now==(uint64_t)-1)
       return true;
@@ -217,7 +408,7 @@ bool osal_timer_expired (osal_timer_t *xt)
    if (!xt)
       return true;
 
-   if (now >= xt->tte_usecs)
+   if (now >= xt->tte_nsecs)
       return true;
    else
       return false;
@@ -225,16 +416,27 @@ bool osal_timer_expired (osal_timer_t *xt)
 
 uint64_t osal_timer_since_start (void)
 {
-   uint64_t now = get_time_now ();
+   uint64_t now = osal_timer_since_start_ns ();
+   if (now==(uint64_t)-1)
+      return (uint64_t)-1;
+
+   return now / 1000;
+}
+
+uint64_t osal_timer_since_start_ns (void)
+{
+   uint64_t now = get_time_ns ();
    if (now==(uint64_t)-1)
       return (uint64_t)-1;
 
    return now - start_counter;
 }
 
+static OSAL_THREAD_LOCAL uint64_t time_us_prev;
+static OSAL_THREAD_LOCAL uint64_t time_ns_prev;
+
 uint64_t osal_timer_mark_us (void)
 {
-   static uint64_t time_us_prev;
    uint64_t time_us_now;
    uint64_t retval;
 
@@ -254,11 +456,104 @@ uint64_t osal_timer_mark_us (void)
    return retval;
 }
 
+uint64_t osal_timer_mark_ns (void)
+{
+   uint64_t time_ns_now;
+   uint64_t retval;
+
+   time_ns_now = get_time_ns ();
+   if (time_ns_now == (uint64_t)-1)
+      return -1;
+
+   if (!time_ns_prev) {
+      time_ns_prev = time_ns_now;
+      return 0;
+   }
+
+   retval = time_ns_now - time_ns_prev;
+
+   time_ns_prev = time_ns_now;
+
+   return retval;
+}
+
+void osal_stopwatch_start (osal_stopwatch_t *sw)
+{
+   sw->start_ns = sw->lap_ns = get_time_ns ();
+}
+
+uint64_t osal_stopwatch_lap_ns (osal_stopwatch_t *sw)
+{
+   uint64_t now = get_time_ns ();
+   if (now == (uint64_t)-1)
+      return 0;
+
+   uint64_t retval = now - sw->lap_ns;
+   sw->lap_ns = now;
+   return retval;
+}
+
+uint64_t osal_stopwatch_elapsed_ns (const osal_stopwatch_t *sw)
+{
+   uint64_t now = get_time_ns ();
+   if (now == (uint64_t)-1)
+      return 0;
+
+   return now - sw->start_ns;
+}
+
+void osal_stopwatch_acc_init (osal_stopwatch_acc_t *acc)
+{
+   acc->count = 0;
+   acc->total_ns = 0;
+   acc->min_ns = (uint64_t)-1;
+   acc->max_ns = 0;
+}
+
+/* Only the owning thread writes an accumulator, so there is no need
+ * for read-modify-write atomics; the stores are atomic only so that a
+ * concurrent merge never reads a torn value.
+ */
+void osal_stopwatch_acc_add (osal_stopwatch_acc_t *acc, uint64_t ns)
+{
+   __atomic_store_n (&acc->count, acc->count + 1, __ATOMIC_RELAXED);
+   __atomic_store_n (&acc->total_ns, acc->total_ns + ns, __ATOMIC_RELAXED);
+   if (ns < acc->min_ns) {
+      __atomic_store_n (&acc->min_ns, ns, __ATOMIC_RELAXED);
+   }
+   if (ns > acc->max_ns) {
+      __atomic_store_n (&acc->max_ns, ns, __ATOMIC_RELAXED);
+   }
+}
+
+uint64_t osal_stopwatch_lap_acc (osal_stopwatch_t *sw, osal_stopwatch_acc_t *acc)
+{
+   uint64_t retval = osal_stopwatch_lap_ns (sw);
+   osal_stopwatch_acc_add (acc, retval);
+   return retval;
+}
+
+void osal_stopwatch_acc_merge (osal_stopwatch_acc_t *dst,
+                               const osal_stopwatch_acc_t *src)
+{
+   uint64_t min_ns = __atomic_load_n (&src->min_ns, __ATOMIC_RELAXED);
+   uint64_t max_ns = __atomic_load_n (&src->max_ns, __ATOMIC_RELAXED);
+
+   dst->count += __atomic_load_n (&src->count, __ATOMIC_RELAXED);
+   dst->total_ns += __atomic_load_n (&src->total_ns, __ATOMIC_RELAXED);
+   if (min_ns < dst->min_ns) {
+      dst->min_ns = min_ns;
+   }
+   if (max_ns > dst->max_ns) {
+      dst->max_ns = max_ns;
+   }
+}
+
 void osal_timer_del (osal_timer_t *xt)
 {
    if (!xt)
       return;
 
-   free (xt);
+   osal_arena_free (xt);
 }
 
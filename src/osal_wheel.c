@@ -0,0 +1,399 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_wheel.h"
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_atomic.h"
+
+/* WHEEL_LEVELS wheels of WHEEL_SLOTS slots each; level l holds the
+ * timers due within 64^(l+1) ticks, in slots of 64^l ticks, which
+ * covers 2^36 ticks (about two years at 1ms). Timers further out than
+ * that wait on an overflow list, which is placed again every time the
+ * top level wraps.
+ *
+ * A timer is placed on the lowest level at which its expiry tick and
+ * the current tick agree in every higher digit (in base 64); its slot
+ * is then the digit of its expiry at that level. Each tick, any level
+ * whose lower digits have all just wrapped to zero has its current slot
+ * emptied and its timers placed again, which puts them on a lower
+ * level, and the current level 0 slot is moved to the expired list.
+ *
+ * A timer is in one of the slots exactly when its expiry is after the
+ * current tick, and on the expired list (waiting for its callback) when
+ * it is not. Each level keeps a bitmap of its non-empty slots, so that
+ * an advance can jump straight to the next tick at which a non-empty
+ * slot is reached instead of stepping through the empty ones.
+ */
+#define WHEEL_BITS         6
+#define WHEEL_SLOTS        (1 << WHEEL_BITS)
+#define WHEEL_MASK         (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS       6
+#define WHEEL_RANGE_BITS   (WHEEL_BITS * WHEEL_LEVELS)
+
+struct osal_wheel_t {
+   uint32_t lock;
+   uint32_t stop;
+   uint64_t tick_us;
+   uint64_t now;
+   size_t nslotted;
+   uint64_t occupied[WHEEL_LEVELS];
+   osal_wheel_node_t *expired;
+   osal_wheel_node_t *overflow;
+   osal_wheel_node_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+
+   osal_thread_t thread;
+   bool running;
+};
+
+static void node_link (osal_wheel_node_t **head, osal_wheel_node_t *node)
+{
+   node->next = *head;
+   if (*head) {
+      (*head)->pprev = &node->next;
+   }
+   *head = node;
+   node->pprev = head;
+}
+
+static void node_unlink (osal_wheel_node_t *node)
+{
+   *node->pprev = node->next;
+   if (node->next) {
+      node->next->pprev = node->pprev;
+   }
+   node->next = NULL;
+   node->pprev = NULL;
+}
+
+static void wheel_place (osal_wheel_t *wheel, osal_wheel_node_t *node)
+{
+   uint64_t expiry = node->expiry;
+   uint64_t now = wheel->now;
+
+   if (expiry <= now) {
+      node_link (&wheel->expired, node);
+      return;
+   }
+
+   wheel->nslotted++;
+   for (size_t l=0; l<WHEEL_LEVELS; l++) {
+      size_t shift = WHEEL_BITS * (l + 1);
+      if ((expiry >> shift) == (now >> shift)) {
+         size_t slot = (size_t)(expiry >> (WHEEL_BITS * l)) & WHEEL_MASK;
+         node_link (&wheel->slots[l][slot], node);
+         wheel->occupied[l] |= (uint64_t)1 << slot;
+         return;
+      }
+   }
+
+   node_link (&wheel->overflow, node);
+}
+
+static void wheel_unplace (osal_wheel_t *wheel, osal_wheel_node_t *node)
+{
+   if (node->expiry <= wheel->now) {
+      node_unlink (node);
+      return;
+   }
+
+   // If the node was alone in its slot then pprev is the slot itself.
+   uintptr_t head = (uintptr_t)node->pprev;
+   uintptr_t first = (uintptr_t)&wheel->slots[0][0];
+   bool alone = !node->next;
+
+   wheel->nslotted--;
+   node_unlink (node);
+
+   if (alone && head >= first
+         && head < first + sizeof wheel->slots
+         && (head - first) % sizeof wheel->slots[0][0] == 0) {
+      size_t i = (head - first) / sizeof wheel->slots[0][0];
+      wheel->occupied[i / WHEEL_SLOTS] &= ~((uint64_t)1 << (i % WHEEL_SLOTS));
+   }
+}
+
+/* The tick before the next one at which a non-empty slot is reached:
+ * the next occupied slot of the lowest occupied level, or, if that
+ * level has none ahead of its current slot, the point where the next
+ * level up moves on. Only called while some timer is in the wheel.
+ */
+static uint64_t wheel_idle_until (osal_wheel_t *wheel)
+{
+   uint64_t now = wheel->now;
+   size_t l = 0;
+
+   while (l < WHEEL_LEVELS && !wheel->occupied[l]) {
+      l++;
+   }
+   if (l == WHEEL_LEVELS) {
+      return (((now >> WHEEL_RANGE_BITS) + 1) << WHEEL_RANGE_BITS) - 1;
+   }
+
+   size_t shift = WHEEL_BITS * l;
+   size_t digit = (size_t)(now >> shift) & WHEEL_MASK;
+   uint64_t ahead = digit == WHEEL_MASK
+                  ? 0 : wheel->occupied[l] & ~(((uint64_t)2 << digit) - 1);
+   uint64_t block = (now >> (shift + WHEEL_BITS)) << (shift + WHEEL_BITS);
+
+   if (ahead) {
+      return block + ((uint64_t)__builtin_ctzll (ahead) << shift) - 1;
+   }
+   return block + ((uint64_t)1 << (shift + WHEEL_BITS)) - 1;
+}
+
+static void wheel_tick (osal_wheel_t *wheel)
+{
+   uint64_t now = ++wheel->now;
+   osal_wheel_node_t *node;
+
+   size_t top = 0;
+   while (top + 1 < WHEEL_LEVELS
+            && (now & (((uint64_t)1 << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+      top++;
+   }
+
+   // Higher levels first: their timers may land in a lower level's
+   // current slot, which must then be emptied in this same tick.
+   // Overflow timers still out of range go straight back onto the
+   // overflow list, so it is detached first.
+   if (!(now & (((uint64_t)1 << WHEEL_RANGE_BITS) - 1)) && wheel->overflow) {
+      osal_wheel_node_t *overflow = wheel->overflow;
+      wheel->overflow = NULL;
+      overflow->pprev = &overflow;
+      while ((node = overflow)) {
+         node_unlink (node);
+         wheel->nslotted--;
+         wheel_place (wheel, node);
+      }
+   }
+
+   for (size_t l=top; l>0; l--) {
+      size_t slot = (size_t)(now >> (WHEEL_BITS * l)) & WHEEL_MASK;
+      osal_wheel_node_t **head = &wheel->slots[l][slot];
+      wheel->occupied[l] &= ~((uint64_t)1 << slot);
+      while ((node = *head)) {
+         node_unlink (node);
+         wheel->nslotted--;
+         wheel_place (wheel, node);
+      }
+   }
+
+   size_t slot = (size_t)now & WHEEL_MASK;
+   osal_wheel_node_t **head = &wheel->slots[0][slot];
+   wheel->occupied[0] &= ~((uint64_t)1 << slot);
+   while ((node = *head)) {
+      node_unlink (node);
+      wheel->nslotted--;
+      node_link (&wheel->expired, node);
+   }
+}
+
+static uint64_t wheel_ticks (osal_wheel_t *wheel, uint64_t us)
+{
+   // Round up, so that a timer never fires early.
+   if (us > UINT64_MAX - wheel->tick_us) {
+      return UINT64_MAX / wheel->tick_us;
+   }
+   return (us + wheel->tick_us - 1) / wheel->tick_us;
+}
+
+static void wheel_driver (void *param)
+{
+   osal_wheel_t *wheel = param;
+
+   while (!osal_atomic_load_u32 (&wheel->stop, OSAL_ATOMIC_ACQUIRE)) {
+      osal_wheel_advance (wheel, osal_timer_since_start ());
+      osal_futex_wait (&wheel->stop, 0, wheel->tick_us);
+   }
+}
+
+void osal_wheel_dump (osal_wheel_t *wheel)
+{
+   if (!wheel) {
+      fprintf (stdout, "NULL wheel_t object\n");
+      return;
+   }
+
+   osal_ftex_lock (&wheel->lock, "wheel");
+   fprintf (stdout, "tick_us:        %" PRIu64 "\n", wheel->tick_us);
+   fprintf (stdout, "now:            %" PRIu64 " ticks\n", wheel->now);
+   fprintf (stdout, "slotted:        %zu\n", wheel->nslotted);
+   for (size_t l=0; l<WHEEL_LEVELS; l++) {
+      size_t n = 0;
+      for (size_t s=0; s<WHEEL_SLOTS; s++) {
+         for (osal_wheel_node_t *node = wheel->slots[l][s]; node; node = node->next) {
+            n++;
+         }
+      }
+      fprintf (stdout, "level %zu:        %zu\n", l, n);
+   }
+   size_t n = 0;
+   for (osal_wheel_node_t *node = wheel->overflow; node; node = node->next) {
+      n++;
+   }
+   fprintf (stdout, "overflow:       %zu\n", n);
+   fprintf (stdout, "running:        %s\n", wheel->running ? "yes" : "no");
+   osal_ftex_unlock (&wheel->lock, "wheel");
+}
+
+osal_wheel_t *osal_wheel_new (uint64_t tick_us, uint64_t now_us)
+{
+   if (!tick_us) {
+      return NULL;
+   }
+
+   osal_wheel_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      return NULL;
+   }
+
+   ret->tick_us = tick_us;
+   ret->now = now_us / tick_us;
+   return ret;
+}
+
+void osal_wheel_del (osal_wheel_t *wheel)
+{
+   if (!wheel)
+      return;
+
+   osal_wheel_stop (wheel);
+
+   free (wheel);
+}
+
+void osal_wheel_node_init (osal_wheel_node_t *node,
+                           osal_wheel_func_t *fptr, void *param)
+{
+   node->next = NULL;
+   node->pprev = NULL;
+   node->expiry = 0;
+   node->fptr = fptr;
+   node->param = param;
+}
+
+void osal_wheel_arm (osal_wheel_t *wheel, osal_wheel_node_t *node,
+                     uint64_t expires_us)
+{
+   osal_ftex_lock (&wheel->lock, "wheel");
+   if (node->pprev) {
+      wheel_unplace (wheel, node);
+   }
+   node->expiry = wheel_ticks (wheel, expires_us);
+   wheel_place (wheel, node);
+   osal_ftex_unlock (&wheel->lock, "wheel");
+}
+
+void osal_wheel_arm_in (osal_wheel_t *wheel, osal_wheel_node_t *node,
+                        uint64_t timeout_us)
+{
+   osal_ftex_lock (&wheel->lock, "wheel");
+   if (node->pprev) {
+      wheel_unplace (wheel, node);
+   }
+   // Saturate rather than wrap into the past, which would fire at once.
+   uint64_t ticks = wheel_ticks (wheel, timeout_us);
+   node->expiry = ticks > UINT64_MAX - wheel->now ? UINT64_MAX : wheel->now + ticks;
+   wheel_place (wheel, node);
+   osal_ftex_unlock (&wheel->lock, "wheel");
+}
+
+bool osal_wheel_cancel (osal_wheel_t *wheel, osal_wheel_node_t *node)
+{
+   bool ret = false;
+
+   osal_ftex_lock (&wheel->lock, "wheel");
+   if (node->pprev) {
+      wheel_unplace (wheel, node);
+      ret = true;
+   }
+   osal_ftex_unlock (&wheel->lock, "wheel");
+
+   return ret;
+}
+
+bool osal_wheel_armed (osal_wheel_t *wheel, osal_wheel_node_t *node)
+{
+   osal_ftex_lock (&wheel->lock, "wheel");
+   bool ret = node->pprev != NULL;
+   osal_ftex_unlock (&wheel->lock, "wheel");
+   return ret;
+}
+
+size_t osal_wheel_advance (osal_wheel_t *wheel, uint64_t now_us)
+{
+   uint64_t target = now_us / wheel->tick_us;
+   size_t ret = 0;
+
+   osal_ftex_lock (&wheel->lock, "wheel");
+
+   while (wheel->now < target) {
+      uint64_t idle = wheel->nslotted ? wheel_idle_until (wheel) : target;
+      if (idle >= target) {
+         wheel->now = target;
+         break;
+      }
+      wheel->now = idle;
+      wheel_tick (wheel);
+   }
+
+   // The lock is dropped around each callback, so that callbacks can
+   // re-arm their own node, or any other.
+   osal_wheel_node_t *node;
+   while ((node = wheel->expired)) {
+      node_unlink (node);
+      osal_wheel_func_t *fptr = node->fptr;
+      void *param = node->param;
+
+      osal_ftex_unlock (&wheel->lock, "wheel");
+      fptr (node, param);
+      ret++;
+      osal_ftex_lock (&wheel->lock, "wheel");
+   }
+
+   osal_ftex_unlock (&wheel->lock, "wheel");
+   return ret;
+}
+
+uint64_t osal_wheel_now (osal_wheel_t *wheel)
+{
+   osal_ftex_lock (&wheel->lock, "wheel");
+   uint64_t ret = wheel->now * wheel->tick_us;
+   osal_ftex_unlock (&wheel->lock, "wheel");
+   return ret;
+}
+
+bool osal_wheel_start (osal_wheel_t *wheel)
+{
+   if (wheel->running) {
+      return true;
+   }
+
+   osal_thread_attr_t attr = { NULL, 0, 0, "osal-wheel", OSAL_THREAD_POLICY_DEFAULT, 0 };
+   osal_atomic_store_u32 (&wheel->stop, 0, OSAL_ATOMIC_RELEASE);
+   if (!(osal_thread_new_ex (&wheel->thread, wheel_driver, wheel, &attr))) {
+      return false;
+   }
+
+   wheel->running = true;
+   return true;
+}
+
+void osal_wheel_stop (osal_wheel_t *wheel)
+{
+   if (!wheel->running) {
+      return;
+   }
+
+   osal_atomic_store_u32 (&wheel->stop, 1, OSAL_ATOMIC_RELEASE);
+   osal_futex_wake (&wheel->stop, 1);
+   osal_thread_wait (&wheel->thread, 1);
+   osal_thread_del (&wheel->thread);
+   wheel->running = false;
+}
+
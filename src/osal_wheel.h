@@ -0,0 +1,110 @@
+
+#ifndef H_OSAL_WHEEL
+#define H_OSAL_WHEEL
+
+/* A hierarchical timer wheel, for large numbers of timeouts.
+ *
+ * Timers are osal_wheel_node_t structures embedded in the caller's own
+ * objects, so arming a timer allocates nothing. Arming, re-arming and
+ * cancelling are O(1), and osal_wheel_advance() only touches the
+ * timers that are due (plus, now and then, a slot of far-off timers
+ * that is moved closer), so the cost per tick does not grow with the
+ * number of armed timers.
+ *
+ * Time is in microseconds, counted in whole ticks of the size given to
+ * osal_wheel_new(). A timer never fires early, and fires at most one
+ * tick late relative to the times passed to osal_wheel_advance().
+ * Timers due in the same tick fire in no particular order.
+ *
+ * The wheel can be driven by the caller, with osal_wheel_advance(), or
+ * by its own thread, started with osal_wheel_start(), which advances it
+ * every tick with osal_timer_since_start() as the time. All functions
+ * may be called from any thread, including from inside a callback.
+ */
+typedef struct osal_wheel_t osal_wheel_t;
+typedef struct osal_wheel_node_t osal_wheel_node_t;
+
+typedef void (osal_wheel_func_t) (osal_wheel_node_t *node, void *param);
+
+// Treat the fields as private; they are only here so that nodes can be
+// embedded in other structures. Initialise with osal_wheel_node_init().
+struct osal_wheel_node_t {
+   osal_wheel_node_t *next;
+   osal_wheel_node_t **pprev;
+   uint64_t expiry;
+   osal_wheel_func_t *fptr;
+   void *param;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void osal_wheel_dump (osal_wheel_t *wheel);
+
+   /* Create a wheel with a resolution of tick_us microseconds, whose
+    * current time is now_us. Returns NULL on error.
+    */
+   osal_wheel_t *osal_wheel_new (uint64_t tick_us, uint64_t now_us);
+
+   /* Stop the driver thread, if any, and delete an object of type
+    * osal_wheel_t, which is returned from a successful call to
+    * osal_wheel_new(). Timers still armed are simply forgotten.
+    */
+   void osal_wheel_del (osal_wheel_t *wheel);
+
+   /* Set up a node to call fptr (node, param) when it expires. Must be
+    * called before the node is first armed, and not while it is armed.
+    */
+   void osal_wheel_node_init (osal_wheel_node_t *node,
+                              osal_wheel_func_t *fptr, void *param);
+
+   /* Arm the node to fire at the absolute time expires_us, or at the
+    * next advance if that time has passed. A node that is already armed
+    * is moved to the new time.
+    */
+   void osal_wheel_arm (osal_wheel_t *wheel, osal_wheel_node_t *node,
+                        uint64_t expires_us);
+
+   /* Arm the node to fire timeout_us microseconds after the wheel's
+    * current time (the time of the last advance). A timeout that
+    * reaches past the end of time is clamped to it, so the node
+    * effectively never fires.
+    */
+   void osal_wheel_arm_in (osal_wheel_t *wheel, osal_wheel_node_t *node,
+                           uint64_t timeout_us);
+
+   /* Disarm the node. Returns true if it was armed, false if it was
+    * not (including when its callback is running or has run).
+    */
+   bool osal_wheel_cancel (osal_wheel_t *wheel, osal_wheel_node_t *node);
+
+   /* Returns true if the node is armed.
+    */
+   bool osal_wheel_armed (osal_wheel_t *wheel, osal_wheel_node_t *node);
+
+   /* Move the wheel's time forward to now_us and call the callback of
+    * every timer that became due, on the calling thread. Returns the
+    * number of callbacks made.
+    */
+   size_t osal_wheel_advance (osal_wheel_t *wheel, uint64_t now_us);
+
+   /* Returns the wheel's current time, in microseconds.
+    */
+   uint64_t osal_wheel_now (osal_wheel_t *wheel);
+
+   /* Start and stop a thread that calls osal_wheel_advance() with
+    * osal_timer_since_start() every tick. The wheel must have been
+    * created with a time from osal_timer_since_start() for this.
+    */
+   bool osal_wheel_start (osal_wheel_t *wheel);
+   void osal_wheel_stop (osal_wheel_t *wheel);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
+
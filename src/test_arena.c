@@ -0,0 +1,147 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_ccq.h"
+#include "osal_arena.h"
+
+/* **********************************************************************
+ * Producers allocate objects of assorted sizes (including some too big
+ * for a slab), stamp them, and pass them through a queue to a consumer
+ * that checks the stamp and frees them, so every free is cross-thread.
+ * Afterwards a batch of short-lived threads is started and stopped,
+ * which exercises heap hand-over on thread exit.
+ */
+#define NPRODUCERS      4
+
+static const size_t nmessages = 1000 * 50;
+static const size_t sizes[] = { 1, 8, 24, 100, 500, 2048, 3000, 16000, 40000 };
+static osal_ccq_t *queue;
+
+static void stamp (uint8_t *obj, size_t size, uint8_t value)
+{
+   memset (obj, value, size);
+}
+
+static void producer (void *param)
+{
+   size_t self = (size_t)(uintptr_t)param;
+
+   for (size_t i=0; i<nmessages; i++) {
+      size_t size = sizes[(i + self) % (sizeof sizes / sizeof sizes[0])];
+      uint8_t *obj = osal_arena_alloc (size + sizeof size);
+      if (!obj) {
+         fprintf (stderr, "[producer %zu] Out of memory\n", self);
+         return;
+      }
+      memcpy (obj, &size, sizeof size);
+      stamp (obj + sizeof size, size, (uint8_t)size);
+      while (!(osal_ccq_nq_wait (queue, obj, OSAL_CCQ_WAIT_FOREVER)))
+         ;
+   }
+}
+
+static void consumer (void *param)
+{
+   bool *passed = param;
+   void *msg;
+
+   for (size_t i=0; i<NPRODUCERS * nmessages; i++) {
+      if (!(osal_ccq_dq_wait (queue, &msg, NULL, OSAL_CCQ_WAIT_FOREVER))) {
+         continue;
+      }
+      uint8_t *obj = msg;
+      size_t size;
+      memcpy (&size, obj, sizeof size);
+      for (size_t j=0; j<size; j++) {
+         if (obj[sizeof size + j] != (uint8_t)size) {
+            fprintf (stderr, "[consumer] Corrupt object of %zu bytes\n", size);
+            return;
+         }
+      }
+      osal_arena_free (obj);
+   }
+   *passed = true;
+}
+
+static void short_lived (void *param)
+{
+   (void)param;
+   osal_timer_t *timer = osal_timer_set (1000);
+   osal_timer_del (timer);
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+   osal_thread_t threads[NPRODUCERS + 1];
+   size_t nthreads = 0;
+   bool passed = false;
+
+   osal_timer_init();
+
+   // A freed object is the next one handed out for its size.
+   void *first = osal_arena_alloc (40);
+   osal_arena_free (first);
+   void *second = osal_arena_alloc (40);
+   osal_arena_free (second);
+   if (!first || first != second) {
+      fprintf (stderr, "Freed object was not reused\n");
+      goto cleanup;
+   }
+
+   // A size that cannot be allocated must fail rather than wrap.
+   if (osal_arena_alloc (SIZE_MAX - 8)) {
+      fprintf (stderr, "Allocated SIZE_MAX - 8 bytes\n");
+      goto cleanup;
+   }
+
+   if (!(queue = osal_ccq_new (256))) {
+      fprintf (stderr, "Failed to create a new queue\n");
+      goto cleanup;
+   }
+
+   if (!(osal_thread_new (&threads[nthreads++], consumer, &passed))) {
+      fprintf (stderr, "Failed to create consumer thread\n");
+      nthreads--;
+      goto cleanup;
+   }
+   for (size_t i=0; i<NPRODUCERS; i++) {
+      if (!(osal_thread_new (&threads[nthreads++], producer, (void *)(uintptr_t)i))) {
+         fprintf (stderr, "Failed to create producer thread %zu\n", i);
+         nthreads--;
+         goto cleanup;
+      }
+   }
+   osal_thread_wait (threads, nthreads);
+   nthreads = 0;
+
+   for (size_t i=0; passed && i<100; i++) {
+      osal_thread_t thread;
+      if (!(osal_thread_new (&thread, short_lived, NULL))) {
+         fprintf (stderr, "Failed to create short-lived thread %zu\n", i);
+         passed = false;
+         break;
+      }
+      osal_thread_wait (&thread, 1);
+      osal_thread_del (&thread);
+   }
+
+   osal_arena_dump ();
+   printf ("%s\n", passed ? "Passed" : "Failed");
+   if (passed) {
+      ret = EXIT_SUCCESS;
+   }
+
+cleanup:
+   osal_thread_wait (threads, nthreads);
+   osal_ccq_del (queue);
+   return ret;
+}
+
@@ -0,0 +1,103 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_atomic.h"
+
+/* **********************************************************************
+ * Threads bump a 64-bit counter with fetch-add, a 32-bit counter with a
+ * CAS loop, count a size_t down with fetch-sub and a signed 64-bit
+ * counter below zero with a CAS loop, and push nodes onto a pointer-CAS
+ * stack. All the totals must come out exact.
+ */
+#define NTHREADS        8
+
+struct node_t {
+   struct node_t *next;
+};
+
+static const size_t nloops = 1000 * 100;
+static uint64_t counter64;
+static uint32_t counter32;
+static size_t counter_size;
+static int64_t counter_i64;
+static void *stack;
+static struct node_t nodes[NTHREADS][64];
+
+static void worker (void *param)
+{
+   struct node_t *mine = param;
+
+   for (size_t i=0; i<nloops; i++) {
+      osal_atomic_fetch_add_u64 (&counter64, 1, OSAL_ATOMIC_RELAXED);
+
+      uint32_t expected = osal_atomic_load_u32 (&counter32, OSAL_ATOMIC_RELAXED);
+      while (!(osal_atomic_cas_weak_u32 (&counter32, &expected, expected + 1,
+                                         OSAL_ATOMIC_RELAXED, OSAL_ATOMIC_RELAXED))) {
+         osal_cpu_relax ();
+      }
+
+      osal_atomic_fetch_sub_size (&counter_size, 1, OSAL_ATOMIC_RELAXED);
+
+      int64_t old = osal_atomic_load_i64 (&counter_i64, OSAL_ATOMIC_RELAXED);
+      while (!(osal_atomic_cas_weak_i64 (&counter_i64, &old, old - 1,
+                                         OSAL_ATOMIC_RELAXED, OSAL_ATOMIC_RELAXED))) {
+         osal_cpu_relax ();
+      }
+   }
+
+   for (size_t i=0; i<64; i++) {
+      void *head = osal_atomic_load_ptr (&stack, OSAL_ATOMIC_RELAXED);
+      do {
+         mine[i].next = head;
+      } while (!(osal_atomic_cas_weak_ptr (&stack, &head, &mine[i],
+                                           OSAL_ATOMIC_RELEASE, OSAL_ATOMIC_RELAXED)));
+   }
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+   osal_thread_t threads[NTHREADS];
+   size_t nthreads = 0;
+
+   counter_size = NTHREADS * nloops;
+   for (size_t i=0; i<NTHREADS; i++) {
+      if (!(osal_thread_new (&threads[nthreads++], worker, nodes[i]))) {
+         fprintf (stderr, "Failed to create thread %zu\n", i);
+         nthreads--;
+         goto cleanup;
+      }
+   }
+   osal_thread_wait (threads, nthreads);
+   nthreads = 0;
+
+   size_t nnodes = 0;
+   for (struct node_t *n = osal_atomic_xchg_ptr (&stack, NULL, OSAL_ATOMIC_ACQUIRE);
+         n; n = n->next) {
+      nnodes++;
+   }
+
+   uint64_t expected = NTHREADS * nloops;
+   bool passed = osal_atomic_load_u64 (&counter64, OSAL_ATOMIC_RELAXED) == expected
+              && osal_atomic_load_u32 (&counter32, OSAL_ATOMIC_RELAXED) == expected
+              && osal_atomic_load_size (&counter_size, OSAL_ATOMIC_RELAXED) == 0
+              && osal_atomic_load_i64 (&counter_i64, OSAL_ATOMIC_RELAXED) == -(int64_t)expected
+              && nnodes == NTHREADS * 64;
+
+   printf ("%s: counter64=%" PRIu64 " counter32=%" PRIu32 " size=%zu i64=%" PRId64
+           " nodes=%zu\n", passed ? "Passed" : "Failed", counter64, counter32,
+           counter_size, counter_i64, nnodes);
+   if (passed) {
+      ret = EXIT_SUCCESS;
+   }
+
+cleanup:
+   osal_thread_wait (threads, nthreads);
+   return ret;
+}
+
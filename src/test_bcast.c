@@ -0,0 +1,152 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_bcast.h"
+
+/* **********************************************************************
+ * A journaler and a replicator each see every message, and the business
+ * logic consumer is gated on both of them: it must never see a message
+ * before both of them have.
+ */
+static const size_t nmessages = 1000000;
+static osal_bcast_t *ring;
+
+// Set by a consumer that fails, so that nobody waits on it forever.
+static bool aborted = false;
+
+struct consumer_t {
+   const char *name;
+   size_t id;
+   size_t ngates;
+   struct consumer_t *gates[2];
+   size_t processed;
+   bool passed;
+};
+
+static void consumer (void *param)
+{
+   struct consumer_t *self = param;
+   void *message;
+   size_t expected = 0;
+
+   printf ("[%s] Started\n", self->name);
+   while (expected < nmessages) {
+      if (__atomic_load_n (&aborted, __ATOMIC_RELAXED)) {
+         fprintf (stderr, "[%s] Aborted after %zu messages\n", self->name, expected);
+         return;
+      }
+
+      if (!(osal_bcast_dq (ring, self->id, &message, NULL))) {
+         osal_thread_sleep (0);
+         continue;
+      }
+
+      if ((size_t)(uintptr_t)message != expected) {
+         fprintf (stderr, "[%s] Expected %zu, got %zu\n",
+                  self->name, expected, (size_t)(uintptr_t)message);
+         __atomic_store_n (&aborted, true, __ATOMIC_RELAXED);
+         return;
+      }
+
+      for (size_t i=0; i<self->ngates; i++) {
+         size_t done = __atomic_load_n (&self->gates[i]->processed, __ATOMIC_ACQUIRE);
+         if (done <= expected) {
+            fprintf (stderr, "[%s] Got %zu before [%s] was done with it\n",
+                     self->name, expected, self->gates[i]->name);
+            __atomic_store_n (&aborted, true, __ATOMIC_RELAXED);
+            return;
+         }
+      }
+
+      // Finish with the message before releasing it.
+      expected++;
+      __atomic_store_n (&self->processed, expected, __ATOMIC_RELEASE);
+      osal_bcast_release (ring, self->id);
+   }
+
+   self->passed = true;
+   printf ("[%s] Completed, %zu messages\n", self->name, expected);
+}
+
+static void producer (void *param)
+{
+   (void)param;
+   printf ("[producer]: Started\n");
+   for (size_t i=0; i<nmessages; i++) {
+      while (!(osal_bcast_nq (ring, (void *)(uintptr_t)i))) {
+         if (__atomic_load_n (&aborted, __ATOMIC_RELAXED)) {
+            fprintf (stderr, "[producer]: Aborted after %zu messages\n", i);
+            return;
+         }
+         osal_thread_sleep (0);
+      }
+   }
+   printf ("[producer]: Completed\n");
+}
+
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+   osal_thread_t threads[4];
+   size_t nthreads = 0;
+
+   struct consumer_t journal = { "journal", 0, 0, { NULL, NULL }, 0, false };
+   struct consumer_t replicate = { "replicate", 0, 0, { NULL, NULL }, 0, false };
+   struct consumer_t business = { "business", 0, 2, { &journal, &replicate }, 0, false };
+   struct consumer_t *consumers[] = { &journal, &replicate, &business };
+
+   osal_timer_init();
+
+   ring = osal_bcast_new (256);
+   if (!ring) {
+      fprintf (stderr, "Failed to create a new ring\n");
+      goto cleanup;
+   }
+
+   journal.id = osal_bcast_consumer_add (ring, NULL, 0);
+   replicate.id = osal_bcast_consumer_add (ring, NULL, 0);
+   size_t deps[] = { journal.id, replicate.id };
+   business.id = osal_bcast_consumer_add (ring, deps, 2);
+   if (business.id == (size_t)-1) {
+      fprintf (stderr, "Failed to add consumers\n");
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<3; i++) {
+      if (!(osal_thread_new (&threads[nthreads++], consumer, consumers[i]))) {
+         fprintf (stderr, "Failed to create consumer thread\n");
+         nthreads--;
+         goto cleanup;
+      }
+   }
+
+   if (!(osal_thread_new (&threads[nthreads++], producer, NULL))) {
+      fprintf (stderr, "Failed to create producer thread\n");
+      nthreads--;
+      goto cleanup;
+   }
+
+   osal_thread_wait (threads, nthreads);
+   nthreads = 0;
+   osal_bcast_dump (ring);
+
+   if (journal.passed && replicate.passed && business.passed) {
+      printf ("Passed\n");
+      ret = EXIT_SUCCESS;
+   } else {
+      printf ("Failed\n");
+   }
+
+cleanup:
+   osal_thread_wait (threads, nthreads);
+   osal_bcast_del (ring);
+   return ret;
+}
+
@@ -1,4 +1,10 @@
 
+#if 1
+#ifdef PLATFORM_POSIX
+#define _GNU_SOURCE 200809L
+#endif
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -6,9 +12,16 @@
 #include <inttypes.h>
 #include <string.h>
 
+#ifdef PLATFORM_POSIX
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#endif
+
 #include "osal_thread.h"
 #include "osal_timer.h"
 #include "osal_ccq.h"
+#include "osal_histogram.h"
 
 static char *lstrdup (const char *src)
 {
@@ -26,14 +39,15 @@ static void consumer (void *param)
    printf ("[consumer] Started\n");
    char *message = NULL;
    uint64_t nq_time = (uint64_t)-1;
-   uint64_t prev_time = osal_timer_since_start();
+   uint64_t prev_time = osal_timer_since_start_ns();
    size_t expected = 0;
    size_t msg_number = (size_t)-1;
    uint64_t total_duration = 0;
+   osal_histogram_t *residency = osal_histogram_new (osal_timer_convert_s_to_ns (10), 8);
 
    while (true) {
-      if ((osal_ccq_dq (queue, (void **)&message, &nq_time)) == false) {
-         osal_thread_sleep(1);
+      if ((osal_ccq_dq_wait (queue, (void **)&message, &nq_time,
+                             OSAL_CCQ_WAIT_FOREVER)) == false) {
          continue;
       }
 
@@ -42,6 +56,9 @@ static void consumer (void *param)
          break;
       }
 
+      if (residency) {
+         osal_histogram_record (residency, osal_timer_since_start_ns () - nq_time);
+      }
       uint64_t duration = nq_time - prev_time;
       total_duration += duration;
       if ((sscanf (message, "%zu", &msg_number)) != 1) {
@@ -62,8 +79,11 @@ static void consumer (void *param)
    }
 
    printf ("[consumer] Completed\n");
-   printf ("[consumer] Total queue duration(us): %" PRIu64 "us\n", total_duration);
-   printf ("[consumer] Total queue duration(s): %.2fs\n", total_duration/1000000.0);
+   printf ("[consumer] Total queue duration(ns): %" PRIu64 "ns\n", total_duration);
+   printf ("[consumer] Total queue duration(s): %.2fs\n", total_duration/1000000000.0);
+   printf ("[consumer] Queue residency(ns):\n");
+   osal_histogram_dump (residency);
+   osal_histogram_del (residency);
    free (message);
 }
 
@@ -75,8 +95,119 @@ static void producer (void *param)
    for (size_t i=0; i<9999; i++) {
       snprintf (message, sizeof message, "%zu message", i);
       char *msg = lstrdup (message);
-      while (!(osal_ccq_nq (queue, msg))) {
+      osal_ccq_nq_wait (queue, msg, OSAL_CCQ_WAIT_FOREVER);
+   }
+
+   osal_ccq_nq_wait (queue, NULL, OSAL_CCQ_WAIT_FOREVER);
+
+   printf ("[producer]: Completed\n");
+}
+
+/* Check the statistics of the first run, in which nmessages (including
+ * the NULL that ends it) went through the queue and were all taken
+ * off again.
+ */
+static bool stats_test (osal_ccq_t *queue, uint64_t nmessages)
+{
+   osal_ccq_stats_t stats;
+   uint64_t residency_total = 0;
+
+   osal_ccq_stats (queue, &stats);
+   for (size_t i=0; i<OSAL_CCQ_STATS_BUCKETS; i++) {
+      residency_total += stats.residency_ns[i];
+   }
+
+   if (stats.nq_count != nmessages || stats.dq_count != nmessages) {
+      fprintf (stderr, "[stats] Expected %" PRIu64 " messages, counted %" PRIu64
+               " in and %" PRIu64 " out\n",
+               nmessages, stats.nq_count, stats.dq_count);
+      return false;
+   }
+   if (stats.depth != 0 || stats.max_depth < 1 || stats.max_depth > stats.capacity) {
+      fprintf (stderr, "[stats] Bad depth %" PRIu64 ", max depth %" PRIu64
+               " (capacity %" PRIu64 ")\n",
+               stats.depth, stats.max_depth, stats.capacity);
+      return false;
+   }
+   if (residency_total != stats.dq_count) {
+      fprintf (stderr, "[stats] Residency histogram holds %" PRIu64
+               " messages, expected %" PRIu64 "\n",
+               residency_total, stats.dq_count);
+      return false;
+   }
+
+   printf ("[stats] Passed\n");
+   return true;
+}
+
+// For the consumers that check what they receive; passed is only set
+// once every message was as expected.
+struct consumer_param_t {
+   osal_ccq_t *queue;
+   bool passed;
+};
+
+static void batch_consumer (void *param)
+{
+   struct consumer_param_t *cp = param;
+   osal_ccq_t *queue = cp->queue;
+   printf ("[batch consumer] Started\n");
+   char *messages[8];
+   size_t expected = 0;
+   size_t msg_number = (size_t)-1;
+   bool done = false;
+   bool failed = false;
+
+   while (!done) {
+      size_t nmessages = osal_ccq_dq_n (queue, (void **)messages, NULL, 8);
+      if (!nmessages) {
          osal_thread_sleep(1);
+         continue;
+      }
+
+      for (size_t i=0; i<nmessages; i++) {
+         // End the thread if NULL is returned.
+         if (messages[i] == NULL) {
+            done = true;
+            break;
+         }
+
+         if ((sscanf (messages[i], "%zu", &msg_number)) != 1 ||
+               msg_number != expected) {
+            fprintf (stderr, "[batch consumer] Expected %zu, got [%s]\n",
+                  expected, messages[i]);
+            failed = true;
+         }
+
+         free (messages[i]);
+         expected++;
+      }
+   }
+
+   // Keep draining after a failure, so that the producer can finish.
+   cp->passed = !failed;
+   printf ("[batch consumer] Completed, %zu messages\n", expected);
+}
+
+static void batch_producer (void *param)
+{
+   osal_ccq_t *queue = param;
+   printf ("[batch producer]: Started\n");
+   char message[50];
+   char *msgs[10];
+   size_t nmsgs = sizeof msgs / sizeof msgs[0];
+   for (size_t i=0; i<9999; i+=nmsgs) {
+      for (size_t j=0; j<nmsgs; j++) {
+         snprintf (message, sizeof message, "%zu message", i + j);
+         msgs[j] = lstrdup (message);
+      }
+      size_t sent = 0;
+      while (sent < nmsgs) {
+         size_t n = osal_ccq_nq_n (queue, (void **)&msgs[sent], nmsgs - sent);
+         if (!n) {
+            osal_thread_sleep(1);
+         }
+         sent += n;
       }
    }
 
@@ -84,16 +215,254 @@ static void producer (void *param)
       osal_thread_sleep (1);
    }
 
-   printf ("[producer]: Completed\n");
+   printf ("[batch producer]: Completed\n");
 }
 
+struct inline_message_t {
+   size_t number;
+   char text[40];
+};
+
+static void inline_consumer (void *param)
+{
+   struct consumer_param_t *cp = param;
+   osal_ccq_t *queue = cp->queue;
+   printf ("[inline consumer] Started\n");
+   struct inline_message_t message;
+   size_t expected = 0;
+   bool failed = false;
+
+   while (true) {
+      // Alternate between copying out and reading in place.
+      if (expected % 2) {
+         const struct inline_message_t *slot = osal_ccq_claim (queue, NULL);
+         if (!slot) {
+            osal_thread_sleep(1);
+            continue;
+         }
+         message = *slot;
+         osal_ccq_release (queue, slot);
+      } else {
+         if (!(osal_ccq_dq_data (queue, &message, NULL))) {
+            osal_thread_sleep(1);
+            continue;
+         }
+      }
+
+      // End the thread on the terminating message.
+      if (message.number == (size_t)-1) {
+         break;
+      }
+
+      // Keep draining after a failure, so that the producer can finish.
+      if (message.number != expected) {
+         fprintf (stderr, "[inline consumer] Expected %zu, got %zu [%s]\n",
+               expected, message.number, message.text);
+         failed = true;
+      }
+
+      expected++;
+   }
+
+   cp->passed = !failed;
+
+   printf ("[inline consumer] Completed, %zu messages\n", expected);
+}
+
+static void inline_producer (void *param)
+{
+   osal_ccq_t *queue = param;
+   printf ("[inline producer]: Started\n");
+   struct inline_message_t message;
+   for (size_t i=0; i<9999; i++) {
+      // Alternate between copying in and building in place.
+      if (i % 2) {
+         struct inline_message_t *slot;
+         while (!(slot = osal_ccq_reserve (queue))) {
+            osal_thread_sleep(1);
+         }
+         slot->number = i;
+         snprintf (slot->text, sizeof slot->text, "%zu message", i);
+         osal_ccq_commit (queue, slot);
+      } else {
+         message.number = i;
+         snprintf (message.text, sizeof message.text, "%zu message", i);
+         while (!(osal_ccq_nq_data (queue, &message))) {
+            osal_thread_sleep(1);
+         }
+      }
+   }
+
+   message.number = (size_t)-1;
+   while (!(osal_ccq_nq_data (queue, &message))) {
+      osal_thread_sleep (1);
+   }
+
+   printf ("[inline producer]: Completed\n");
+}
+
+#ifdef PLATFORM_POSIX
+/* The consumer runs in a child process that attaches to the queue
+ * through the inherited memfd, rather than through the parent's
+ * mapping.
+ */
+/* Exchange nmessages with a child process through a queue in shared
+ * memory, which the child attaches to by name or, if name is NULL, by
+ * the inherited descriptor. Both sides block in the _wait() calls (and
+ * the producer pauses now and then so that the consumer does), so
+ * every wake crosses the process boundary. The messages are plain
+ * numbers in pointer-sized slots, since the _wait() calls only take
+ * pointers.
+ */
+static bool shm_exchange (osal_ccq_t *queue, const char *name)
+{
+   const char *label = name ? "named" : "memfd";
+   const uint64_t timeout_us = osal_timer_convert_s_to_us (10);
+   size_t nmessages = 999;
+   int status = -1;
+
+   pid_t pid = fork ();
+   if (pid < 0) {
+      fprintf (stderr, "[shm %s] Failed to fork\n", label);
+      return false;
+   }
+
+   if (pid == 0) {
+      osal_ccq_t *child = name ? osal_ccq_shm_open (name)
+                               : osal_ccq_shm_open_fd (osal_ccq_shm_fd (queue));
+      void *message;
+      size_t expected = 0;
+      while (child && expected < nmessages) {
+         if (!(osal_ccq_dq_wait (child, &message, NULL, timeout_us))) {
+            fprintf (stderr, "[shm %s consumer] Timed out waiting for %zu\n",
+                     label, expected);
+            break;
+         }
+         if ((size_t)(uintptr_t)message != expected) {
+            fprintf (stderr, "[shm %s consumer] Expected %zu, got %zu\n",
+                     label, expected, (size_t)(uintptr_t)message);
+            break;
+         }
+         expected++;
+      }
+      osal_ccq_del (child);
+      _exit (expected == nmessages ? EXIT_SUCCESS : EXIT_FAILURE);
+   }
+
+   for (size_t i=0; i<nmessages; i++) {
+      if (i % 100 == 0) {
+         osal_thread_sleep (1);
+      }
+      if (!(osal_ccq_nq_wait (queue, (void *)(uintptr_t)i, timeout_us))) {
+         fprintf (stderr, "[shm %s] Timed out sending %zu\n", label, i);
+         break;
+      }
+   }
+
+   waitpid (pid, &status, 0);
+   return WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS;
+}
+
+static bool shm_test (void)
+{
+   bool ret = false;
+   char name[64];
+   osal_ccq_t *named = NULL;
+
+   printf ("[shm] Started\n");
+   osal_ccq_t *queue = osal_ccq_shm_new (NULL, 8, sizeof (void *));
+   if (!queue) {
+      fprintf (stderr, "[shm] Failed to create a shared memory queue\n");
+      return false;
+   }
+
+   if (!(shm_exchange (queue, NULL))) {
+      goto cleanup;
+   }
+
+   snprintf (name, sizeof name, "/osal_test_ccq_%ld", (long)getpid ());
+   if (!(named = osal_ccq_shm_new (name, 8, sizeof (void *)))) {
+      fprintf (stderr, "[shm] Failed to create shared memory queue [%s]\n", name);
+      goto cleanup;
+   }
+
+   ret = shm_exchange (named, name);
+
+cleanup:
+   printf ("[shm] Completed, %s\n", ret ? "passed" : "failed");
+   if (named) {
+      osal_ccq_shm_unlink (name);
+   }
+   osal_ccq_del (named);
+   osal_ccq_del (queue);
+   return ret;
+}
+
+/* The consumer runs in the calling thread and only touches the queue
+ * when poll() says that the queue's descriptor is readable.
+ */
+static bool fd_test (osal_ccq_t *queue)
+{
+   osal_thread_t thread = 0;
+   size_t expected = 0, msg_number = (size_t)-1;
+   size_t wakeups = 0;
+   bool done = false;
+   bool failed = false;
+   char *message;
+
+   printf ("[fd] Started\n");
+   struct pollfd pfd = { osal_ccq_fd (queue), POLLIN, 0 };
+   if (pfd.fd < 0) {
+      fprintf (stderr, "[fd] Failed to get a descriptor for the queue\n");
+      return false;
+   }
+
+   if (!(osal_thread_new (&thread, producer, queue))) {
+      fprintf (stderr, "[fd] Failed to create producer thread\n");
+      return false;
+   }
+
+   while (!done) {
+      osal_ccq_fd_ack (queue);
+      while (!done && osal_ccq_dq (queue, (void **)&message, NULL)) {
+         if (!message) {
+            done = true;
+            break;
+         }
+         if ((sscanf (message, "%zu", &msg_number)) != 1 ||
+               msg_number != expected) {
+            fprintf (stderr, "[fd] Expected %zu, got [%s]\n", expected, message);
+            failed = true;
+         }
+         free (message);
+         expected++;
+      }
+
+      if (!done) {
+         if (poll (&pfd, 1, 5000) != 1) {
+            fprintf (stderr, "[fd] Timed out waiting for the queue\n");
+            break;
+         }
+         wakeups++;
+      }
+   }
+
+   osal_thread_wait (&thread, 1);
+   printf ("[fd] Completed, %zu messages, %zu wakeups\n", expected, wakeups);
+   return !failed && done && expected == 9999;
+}
+#endif
 
 int main (void)
 {
    int ret = EXIT_FAILURE;
    osal_thread_t threads[2] = {0, 0};
+   size_t nthreads = 0;
 
    osal_ccq_t *queue = NULL;
+   osal_ccq_t *inline_queue = NULL;
+   struct consumer_param_t batch = { NULL, false };
+   struct consumer_param_t inline_check = { NULL, false };
 
    queue = osal_ccq_new (3);
    if (!queue) {
@@ -102,21 +471,98 @@ int main (void)
    }
 
    osal_timer_init();
-   if (!(osal_thread_new(&threads[0], producer, queue))) {
+   osal_ccq_stats_enable (queue);
+   if (!(osal_thread_new(&threads[nthreads++], producer, queue))) {
       fprintf (stderr, "Failed to create producer thread\n");
+      nthreads--;
       goto cleanup;
    }
 
-   if (!(osal_thread_new(&threads[1], consumer, queue))) {
+   if (!(osal_thread_new(&threads[nthreads++], consumer, queue))) {
       fprintf (stderr, "Failed to create consumer thread\n");
+      nthreads--;
+      goto cleanup;
+   }
+
+
+   osal_thread_wait(threads, nthreads);
+   nthreads = 0;
+   osal_ccq_dump (queue);
+
+   if (!(stats_test (queue, 9999 + 1))) {
+      goto cleanup;
+   }
+
+   if (!(osal_thread_new(&threads[nthreads++], batch_producer, queue))) {
+      fprintf (stderr, "Failed to create batch producer thread\n");
+      nthreads--;
+      goto cleanup;
+   }
+
+   batch.queue = queue;
+   if (!(osal_thread_new(&threads[nthreads++], batch_consumer, &batch))) {
+      fprintf (stderr, "Failed to create batch consumer thread\n");
+      nthreads--;
+      goto cleanup;
+   }
+
+   osal_thread_wait(threads, nthreads);
+   nthreads = 0;
+   if (!batch.passed) {
+      fprintf (stderr, "Batch round trip failed\n");
+      goto cleanup;
+   }
+
+   inline_queue = osal_ccq_new_sized (3, sizeof (struct inline_message_t));
+   if (!inline_queue) {
+      fprintf (stderr, "Failed to create a new inline queue\n");
+      goto cleanup;
+   }
+
+   if (!(osal_thread_new(&threads[nthreads++], inline_producer, inline_queue))) {
+      fprintf (stderr, "Failed to create inline producer thread\n");
+      nthreads--;
+      goto cleanup;
+   }
+
+   inline_check.queue = inline_queue;
+   if (!(osal_thread_new(&threads[nthreads++], inline_consumer, &inline_check))) {
+      fprintf (stderr, "Failed to create inline consumer thread\n");
+      nthreads--;
+      goto cleanup;
+   }
+
+   osal_thread_wait(threads, nthreads);
+   nthreads = 0;
+   if (!inline_check.passed) {
+      fprintf (stderr, "Inline round trip failed\n");
       goto cleanup;
    }
 
+   // The pointer calls fail at once on a sized queue, even when told
+   // to wait forever.
+   void *unused;
+   if (osal_ccq_nq_wait (inline_queue, NULL, OSAL_CCQ_WAIT_FOREVER)
+         || osal_ccq_dq_wait (inline_queue, &unused, NULL, OSAL_CCQ_WAIT_FOREVER)) {
+      fprintf (stderr, "Pointer wait succeeded on an inline queue\n");
+      goto cleanup;
+   }
+
+#ifdef PLATFORM_POSIX
+   if (!(shm_test ())) {
+      goto cleanup;
+   }
+
+   if (!(fd_test (queue))) {
+      goto cleanup;
+   }
+#endif
 
    ret = EXIT_SUCCESS;
 cleanup:
-   osal_thread_wait(threads, 2);
+   osal_thread_wait(threads, nthreads);
    osal_ccq_del (queue);
+   osal_ccq_del (inline_queue);
    return ret;
 }
 
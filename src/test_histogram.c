@@ -0,0 +1,248 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_histogram.h"
+
+/* **********************************************************************
+ * Pseudo-random values over several orders of magnitude are recorded
+ * and every percentile is compared against the exact one from the
+ * sorted values, which must agree to within the precision. Then more
+ * threads than there are owned shards record at once, and the merged
+ * totals are checked. Finally a histogram is serialized, deserialized
+ * and compared with the original.
+ */
+#define PRECISION       8
+#define MAX_VALUE       ((uint64_t)1 << 40)
+#define NVALUES         (1000 * 100)
+#define NRECORDERS      12
+
+static osal_histogram_t *shared;
+
+// splitmix64: every output bit is well mixed, which matters here
+// because the top bits pick the magnitude of each value.
+static uint64_t rng_counter = 0;
+
+static uint64_t rng (void)
+{
+   uint64_t z = (rng_counter += 0x9e3779b97f4a7c15);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+   return z ^ (z >> 31);
+}
+
+static int compare_u64 (const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *)a;
+   uint64_t y = *(const uint64_t *)b;
+   return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static bool accuracy_test (void)
+{
+   bool passed = false;
+   osal_histogram_t *hist = NULL;
+   uint64_t *values = NULL;
+
+   if (!(hist = osal_histogram_new (MAX_VALUE, PRECISION))) {
+      fprintf (stderr, "Failed to create a new histogram\n");
+      goto cleanup;
+   }
+   if (!(values = malloc (NVALUES * sizeof *values))) {
+      fprintf (stderr, "Failed to allocate values\n");
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<NVALUES; i++) {
+      values[i] = rng () >> (24 + rng () % 40);
+      osal_histogram_record (hist, values[i]);
+   }
+   qsort (values, NVALUES, sizeof *values, compare_u64);
+
+   if (osal_histogram_count (hist) != NVALUES
+         || osal_histogram_min (hist) != values[0]
+         || osal_histogram_max (hist) != values[NVALUES - 1]) {
+      fprintf (stderr, "Wrong count, min or max\n");
+      goto cleanup;
+   }
+
+   for (double p=0.5; p<100.0; p+=0.5) {
+      double exact_rank = p / 100.0 * NVALUES;
+      size_t rank = (size_t)exact_rank;
+      if ((double)rank < exact_rank) {
+         rank++;
+      }
+      uint64_t exact = values[rank - 1];
+      uint64_t found = osal_histogram_percentile (hist, p);
+      uint64_t error = exact >> (PRECISION - 1);
+      if (found < exact || found > exact + error) {
+         fprintf (stderr, "p%.1f: %" PRIu64 ", expected %" PRIu64 "\n", p, found, exact);
+         goto cleanup;
+      }
+   }
+   if (osal_histogram_percentile (hist, 100.0) != values[NVALUES - 1]) {
+      fprintf (stderr, "p100 is not the max\n");
+      goto cleanup;
+   }
+
+   // Values past the maximum are counted, and still the exact max.
+   osal_histogram_record (hist, MAX_VALUE * 4);
+   if (osal_histogram_count (hist) != NVALUES + 1
+         || osal_histogram_max (hist) != MAX_VALUE * 4) {
+      fprintf (stderr, "Value past the maximum was not counted\n");
+      goto cleanup;
+   }
+
+   osal_histogram_dump (hist);
+   passed = true;
+
+cleanup:
+   osal_histogram_del (hist);
+   free (values);
+   return passed;
+}
+
+static void recorder (void *param)
+{
+   uint64_t t = osal_timer_since_start_ns ();
+   (void)param;
+
+   for (size_t i=0; i<NVALUES; i++) {
+      osal_histogram_record (shared, i);
+   }
+   for (size_t i=0; i<NVALUES; i++) {
+      t = osal_histogram_record_since (shared, t);
+   }
+}
+
+static bool threads_test (void)
+{
+   bool passed = false;
+   osal_thread_t threads[NRECORDERS];
+   size_t nthreads = 0;
+
+   if (!(shared = osal_histogram_new (MAX_VALUE, PRECISION))) {
+      fprintf (stderr, "Failed to create a new histogram\n");
+      goto cleanup;
+   }
+
+   uint64_t start = osal_timer_since_start_ns ();
+   for (size_t i=0; i<NRECORDERS; i++) {
+      if (!(osal_thread_new (&threads[nthreads], recorder, NULL))) {
+         fprintf (stderr, "Failed to create recorder thread %zu\n", i);
+         goto cleanup;
+      }
+      nthreads++;
+   }
+   osal_thread_wait (threads, nthreads);
+   uint64_t elapsed = osal_timer_since_start_ns () - start;
+
+   uint64_t count = osal_histogram_count (shared);
+   if (count != (uint64_t)NRECORDERS * NVALUES * 2) {
+      fprintf (stderr, "Counted %" PRIu64 " values from %d threads\n", count, NRECORDERS);
+      goto cleanup;
+   }
+   printf ("Recorded %" PRIu64 " values in %.2fns each\n", count,
+           (double)elapsed / (double)count);
+
+   passed = true;
+
+cleanup:
+   for (size_t i=0; i<nthreads; i++) {
+      osal_thread_del (&threads[i]);
+   }
+   return passed;
+}
+
+static bool serialize_test (void)
+{
+   bool passed = false;
+   osal_histogram_t *copy = NULL;
+   osal_histogram_t *merged = NULL;
+   uint8_t *buf = NULL;
+
+   size_t len = osal_histogram_serialize (shared, NULL, 0);
+   if (!len || !(buf = malloc (len))) {
+      fprintf (stderr, "Failed to size the serialized histogram\n");
+      goto cleanup;
+   }
+   if (osal_histogram_serialize (shared, buf, len - 1) != len
+         || osal_histogram_serialize (shared, buf, len) != len) {
+      fprintf (stderr, "Serialized size changed\n");
+      goto cleanup;
+   }
+   printf ("Serialized %" PRIu64 " values in %zu bytes\n",
+           osal_histogram_count (shared), len);
+
+   if (osal_histogram_deserialize (buf, len - 1)
+         || osal_histogram_deserialize (buf + 1, len - 1)) {
+      fprintf (stderr, "Damaged histogram was accepted\n");
+      goto cleanup;
+   }
+   if (!(copy = osal_histogram_deserialize (buf, len))) {
+      fprintf (stderr, "Failed to deserialize the histogram\n");
+      goto cleanup;
+   }
+
+   static const double pct[] = { 0.0, 50.0, 99.0, 99.9, 100.0 };
+   for (size_t i=0; i<sizeof pct / sizeof pct[0]; i++) {
+      if (osal_histogram_percentile (copy, pct[i])
+            != osal_histogram_percentile (shared, pct[i])) {
+         fprintf (stderr, "Deserialized p%.1f differs\n", pct[i]);
+         goto cleanup;
+      }
+   }
+   if (osal_histogram_count (copy) != osal_histogram_count (shared)
+         || osal_histogram_mean (copy) != osal_histogram_mean (shared)) {
+      fprintf (stderr, "Deserialized count or mean differs\n");
+      goto cleanup;
+   }
+
+   if (!(merged = osal_histogram_new (MAX_VALUE, PRECISION))
+         || !osal_histogram_merge (merged, shared)
+         || !osal_histogram_merge (merged, copy)
+         || osal_histogram_count (merged) != 2 * osal_histogram_count (shared)
+         || osal_histogram_max (merged) != osal_histogram_max (shared)) {
+      fprintf (stderr, "Merge failed\n");
+      goto cleanup;
+   }
+
+   passed = true;
+
+cleanup:
+   osal_histogram_del (merged);
+   osal_histogram_del (copy);
+   free (buf);
+   return passed;
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+
+   osal_timer_init();
+
+   if (!(accuracy_test ())) {
+      goto cleanup;
+   }
+   if (!(threads_test ())) {
+      goto cleanup;
+   }
+   if (!(serialize_test ())) {
+      goto cleanup;
+   }
+
+   printf ("Passed\n");
+   ret = EXIT_SUCCESS;
+
+cleanup:
+   osal_histogram_del (shared);
+   return ret;
+}
+
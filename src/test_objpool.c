@@ -0,0 +1,152 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_objpool.h"
+
+/* **********************************************************************
+ * Each thread repeatedly acquires a few objects (waiting if the pool is
+ * exhausted), marks them as owned by itself, checks that nobody else
+ * has marked them in the meantime, and releases them. There are fewer
+ * objects than threads * held, so threads regularly block and steal
+ * from each other's magazines. The threads are run in rounds, which
+ * between them start more threads than the pool has magazines, so the
+ * later rounds only get magazines if the earlier ones gave theirs up.
+ */
+#define NTHREADS        8
+#define NROUNDS         20
+#define NHELD           4
+#define NOBJECTS        24
+
+struct object_t {
+   size_t owner;
+   size_t uses;
+};
+
+static const size_t nloops = 1000;
+static osal_objpool_t *pool;
+static size_t ninit;
+
+static bool object_init (void *object, void *param)
+{
+   struct object_t *o = object;
+   (void)param;
+   o->owner = (size_t)-1;
+   o->uses = 0;
+   ninit++;
+   return true;
+}
+
+static void object_fini (void *object, void *param)
+{
+   (void)object;
+   (void)param;
+   ninit--;
+}
+
+static void worker (void *param)
+{
+   bool *passed = param;
+   size_t self = osal_thread_index ();
+   struct object_t *held[NHELD];
+
+   for (size_t i=0; i<nloops; i++) {
+      for (size_t j=0; j<NHELD; j++) {
+         if (!(held[j] = osal_objpool_acquire_wait (pool, (uint64_t)-1))) {
+            fprintf (stderr, "[%zu] acquire_wait returned NULL\n", self);
+            return;
+         }
+         if (held[j]->owner != (size_t)-1) {
+            fprintf (stderr, "[%zu] object already owned by %zu\n",
+                     self, held[j]->owner);
+            return;
+         }
+         held[j]->owner = self;
+         held[j]->uses++;
+      }
+
+      for (size_t j=0; j<NHELD; j++) {
+         if (held[j]->owner != self) {
+            fprintf (stderr, "[%zu] object taken by %zu\n", self, held[j]->owner);
+            return;
+         }
+         held[j]->owner = (size_t)-1;
+         osal_objpool_release (pool, held[j]);
+      }
+   }
+
+   *passed = true;
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+   osal_thread_t threads[NTHREADS];
+   bool passed[NROUNDS][NTHREADS] = { { false } };
+   size_t nthreads = 0;
+
+   osal_timer_init();
+
+   pool = osal_objpool_new (NOBJECTS, sizeof (struct object_t),
+                            object_init, object_fini, NULL);
+   if (!pool || ninit != NOBJECTS) {
+      fprintf (stderr, "Failed to create a new pool\n");
+      goto cleanup;
+   }
+
+   for (size_t r=0; r<NROUNDS; r++) {
+      for (size_t i=0; i<NTHREADS; i++) {
+         if (!(osal_thread_new (&threads[nthreads++], worker, &passed[r][i]))) {
+            fprintf (stderr, "Failed to create thread %zu\n", i);
+            nthreads--;
+            goto cleanup;
+         }
+      }
+
+      osal_thread_wait (threads, nthreads);
+      for (size_t i=0; i<nthreads; i++) {
+         osal_thread_del (&threads[i]);
+      }
+      nthreads = 0;
+   }
+   osal_objpool_dump (pool);
+
+   // Every object must be available again.
+   void *all[NOBJECTS];
+   size_t navail = 0;
+   while (navail < NOBJECTS && (all[navail] = osal_objpool_acquire (pool))) {
+      navail++;
+   }
+   bool drained = navail == NOBJECTS && !osal_objpool_acquire (pool)
+               && !osal_objpool_acquire_wait (pool, 1000);
+   for (size_t i=0; i<navail; i++) {
+      osal_objpool_release (pool, all[i]);
+   }
+
+   bool ok = drained;
+   for (size_t r=0; r<NROUNDS; r++) {
+      for (size_t i=0; i<NTHREADS; i++) {
+         ok = ok && passed[r][i];
+      }
+   }
+
+   printf ("%s: %zu objects recovered\n", ok ? "Passed" : "Failed", navail);
+   if (ok) {
+      ret = EXIT_SUCCESS;
+   }
+
+cleanup:
+   osal_thread_wait (threads, nthreads);
+   osal_objpool_del (pool);
+   if (ret == EXIT_SUCCESS && ninit) {
+      fprintf (stderr, "fini called on %zu too few objects\n", ninit);
+      ret = EXIT_FAILURE;
+   }
+   return ret;
+}
+
@@ -0,0 +1,115 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_pool.h"
+
+/* **********************************************************************
+ * Two passes: a flat fan-out of many tiny tasks submitted from the main
+ * thread and waited for with osal_pool_wait_all(), then a recursive
+ * fork-join that splits a range in half until it is small, summing the
+ * leaves, with every level joining on its own children.
+ */
+static const size_t ntasks = 1000 * 100;
+static const uint64_t range = 1000 * 1000;
+static const uint64_t leaf = 1000;
+
+static osal_pool_t *pool;
+static size_t counter;
+
+static void count_task (void *param)
+{
+   (void)param;
+   __atomic_add_fetch (&counter, 1, __ATOMIC_RELAXED);
+}
+
+struct sum_t {
+   uint64_t from;
+   uint64_t to;
+   uint64_t result;
+};
+
+static void sum_task (void *param)
+{
+   struct sum_t *s = param;
+
+   if (s->to - s->from <= leaf) {
+      s->result = 0;
+      for (uint64_t i=s->from; i<s->to; i++) {
+         s->result += i;
+      }
+      return;
+   }
+
+   uint64_t mid = s->from + (s->to - s->from) / 2;
+   struct sum_t left = { s->from, mid, 0 };
+   struct sum_t right = { mid, s->to, 0 };
+   size_t join = 0;
+
+   osal_pool_submit_join (pool, sum_task, &left, &join);
+   osal_pool_submit_join (pool, sum_task, &right, &join);
+   osal_pool_join (pool, &join);
+
+   s->result = left.result + right.result;
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+
+   osal_timer_init();
+
+   // Too large to round up to a power of two.
+   if ((pool = osal_pool_new (1, SIZE_MAX))) {
+      fprintf (stderr, "Created a pool of SIZE_MAX elements\n");
+      goto cleanup;
+   }
+
+   pool = osal_pool_new (0, 1024);
+   if (!pool) {
+      fprintf (stderr, "Failed to create a new pool\n");
+      goto cleanup;
+   }
+
+   uint64_t start = osal_timer_since_start ();
+   for (size_t i=0; i<ntasks; i++) {
+      osal_pool_submit (pool, count_task, NULL);
+   }
+   osal_pool_wait_all (pool);
+   uint64_t elapsed = osal_timer_since_start () - start;
+
+   if (counter != ntasks) {
+      fprintf (stderr, "Fan-out: expected %zu, got %zu\n", ntasks, counter);
+      goto cleanup;
+   }
+   printf ("Fan-out: %zu tasks in %" PRIu64 "us\n", ntasks, elapsed);
+
+   struct sum_t total = { 0, range, 0 };
+   size_t join = 0;
+   osal_pool_submit_join (pool, sum_task, &total, &join);
+   osal_pool_join (pool, &join);
+
+   uint64_t expected = range * (range - 1) / 2;
+   if (total.result != expected) {
+      fprintf (stderr, "Fork-join: expected %" PRIu64 ", got %" PRIu64 "\n",
+               expected, total.result);
+      goto cleanup;
+   }
+   printf ("Fork-join: sum %" PRIu64 "\n", total.result);
+
+   osal_pool_wait_all (pool);
+   osal_pool_dump (pool);
+
+   ret = EXIT_SUCCESS;
+
+cleanup:
+   osal_pool_del (pool);
+   printf ("%s\n", ret == EXIT_SUCCESS ? "Passed" : "Failed");
+   return ret;
+}
+
@@ -0,0 +1,220 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_prq.h"
+
+/* **********************************************************************
+ * First fill the queue from one thread and check that the messages come
+ * out highest priority first, FIFO within a priority. Then run
+ * producers and consumers concurrently and check that nothing is lost.
+ */
+#define NLEVELS         8
+#define NTHREADS        4
+
+static const size_t nmessages = 100000;
+static osal_prq_t *queue;
+static size_t total_received;
+static bool *received;
+
+// Fail, rather than hang, if the concurrent phase loses a message.
+static const uint64_t concurrent_timeout_us = 30 * 1000 * 1000;
+
+// Set by a consumer that fails, so that nobody waits on it forever.
+static bool aborted = false;
+
+static bool ordering_test (void)
+{
+   size_t priority;
+   void *message;
+   size_t prev_priority = 0, prev_number = 0;
+
+   for (size_t i=0; i<NLEVELS * 10; i++) {
+      size_t level = (i * 5) % NLEVELS;
+      if (!(osal_prq_nq (queue, (void *)(uintptr_t)i, level))) {
+         fprintf (stderr, "[ordering] Failed to enqueue %zu\n", i);
+         return false;
+      }
+   }
+
+   for (size_t i=0; i<NLEVELS * 10; i++) {
+      if (!(osal_prq_dq (queue, &message, NULL, &priority))) {
+         fprintf (stderr, "[ordering] Queue empty after %zu messages\n", i);
+         return false;
+      }
+      size_t number = (size_t)(uintptr_t)message;
+      if (i && (priority < prev_priority ||
+               (priority == prev_priority && number < prev_number))) {
+         fprintf (stderr, "[ordering] Got %zu/%zu after %zu/%zu\n",
+                  number, priority, prev_number, prev_priority);
+         return false;
+      }
+      prev_priority = priority;
+      prev_number = number;
+   }
+
+   if (osal_prq_dq (queue, &message, NULL, NULL)) {
+      fprintf (stderr, "[ordering] Queue not empty\n");
+      return false;
+   }
+
+   printf ("[ordering] Passed\n");
+   return true;
+}
+
+struct consumer_t {
+   size_t id;
+   bool passed;
+};
+
+static bool concurrent_failed (const char *who, size_t id, const char *reason,
+                               size_t number)
+{
+   fprintf (stderr, "[%s %zu] %s: %zu\n", who, id, reason, number);
+   __atomic_store_n (&aborted, true, __ATOMIC_RELAXED);
+   return false;
+}
+
+/* Each message is producer * nmessages + seq, sent at priority
+ * (seq + producer) % NLEVELS. Every consumer must see the messages of
+ * one producer at one level in the order they were sent, and no message
+ * may be received twice; together with the count this means that none
+ * was lost either.
+ */
+static bool consume (struct consumer_t *self)
+{
+   size_t last[NTHREADS][NLEVELS];
+   void *message;
+   size_t priority;
+   uint64_t deadline = osal_timer_since_start () + concurrent_timeout_us;
+
+   for (size_t i=0; i<NTHREADS; i++) {
+      for (size_t j=0; j<NLEVELS; j++) {
+         last[i][j] = (size_t)-1;
+      }
+   }
+
+   while (__atomic_load_n (&total_received, __ATOMIC_RELAXED) < NTHREADS * nmessages) {
+      if (__atomic_load_n (&aborted, __ATOMIC_RELAXED)) {
+         return false;
+      }
+      if (!(osal_prq_dq (queue, &message, NULL, &priority))) {
+         if (osal_timer_since_start () > deadline) {
+            return concurrent_failed ("consumer", self->id, "Timed out, messages received",
+                                      __atomic_load_n (&total_received,
+                                                       __ATOMIC_RELAXED));
+         }
+         osal_thread_sleep (0);
+         continue;
+      }
+
+      size_t number = (size_t)(uintptr_t)message;
+      if (number >= NTHREADS * nmessages) {
+         return concurrent_failed ("consumer", self->id, "Bad message", number);
+      }
+      size_t producer = number / nmessages, seq = number % nmessages;
+      if (priority != (seq + producer) % NLEVELS) {
+         return concurrent_failed ("consumer", self->id, "Wrong priority for", number);
+      }
+      if (last[producer][priority] != (size_t)-1 && seq <= last[producer][priority]) {
+         return concurrent_failed ("consumer", self->id, "Out of order", number);
+      }
+      if (__atomic_exchange_n (&received[number], true, __ATOMIC_RELAXED)) {
+         return concurrent_failed ("consumer", self->id, "Received twice", number);
+      }
+      last[producer][priority] = seq;
+      __atomic_fetch_add (&total_received, 1, __ATOMIC_RELAXED);
+   }
+   return true;
+}
+
+static void consumer (void *param)
+{
+   struct consumer_t *self = param;
+   self->passed = consume (self);
+}
+
+static void producer (void *param)
+{
+   size_t self = (size_t)(uintptr_t)param;
+   for (size_t i=0; i<nmessages; i++) {
+      void *message = (void *)(uintptr_t)(self * nmessages + i);
+      while (!(osal_prq_nq (queue, message, (i + self) % NLEVELS))) {
+         if (__atomic_load_n (&aborted, __ATOMIC_RELAXED)) {
+            fprintf (stderr, "[producer %zu] Aborted after %zu messages\n", self, i);
+            return;
+         }
+         osal_thread_sleep (0);
+      }
+   }
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+   osal_thread_t threads[NTHREADS * 2];
+   size_t nthreads = 0;
+   struct consumer_t consumers[NTHREADS];
+   bool passed = true;
+
+   osal_timer_init();
+
+   queue = osal_prq_new (NLEVELS, 128);
+   if (!queue) {
+      fprintf (stderr, "Failed to create a new queue\n");
+      goto cleanup;
+   }
+
+   if (!(ordering_test ())) {
+      goto cleanup;
+   }
+
+   if (!(received = calloc (NTHREADS * nmessages, sizeof *received))) {
+      fprintf (stderr, "Failed to allocate the received flags\n");
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<NTHREADS; i++) {
+      consumers[i].id = i;
+      consumers[i].passed = false;
+      if (!(osal_thread_new (&threads[nthreads++], consumer, &consumers[i]))) {
+         fprintf (stderr, "Failed to create consumer thread\n");
+         nthreads--;
+         __atomic_store_n (&aborted, true, __ATOMIC_RELAXED);
+         goto cleanup;
+      }
+      if (!(osal_thread_new (&threads[nthreads++], producer, (void *)(uintptr_t)i))) {
+         fprintf (stderr, "Failed to create producer thread\n");
+         nthreads--;
+         __atomic_store_n (&aborted, true, __ATOMIC_RELAXED);
+         goto cleanup;
+      }
+   }
+
+   osal_thread_wait (threads, nthreads);
+   nthreads = 0;
+
+   printf ("[concurrent] Received %zu/%zu messages\n",
+           total_received, NTHREADS * nmessages);
+   for (size_t i=0; i<NTHREADS; i++) {
+      passed = passed && consumers[i].passed;
+   }
+   if (passed && total_received == NTHREADS * nmessages) {
+      printf ("Passed\n");
+      ret = EXIT_SUCCESS;
+   } else {
+      printf ("Failed\n");
+   }
+
+cleanup:
+   osal_thread_wait (threads, nthreads);
+   osal_prq_del (queue);
+   free (received);
+   return ret;
+}
+
@@ -0,0 +1,147 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_rwlock.h"
+
+/* **********************************************************************
+ * Writers keep setting every field of a record to the same new value;
+ * readers check that they never see a record with mixed values. The
+ * same is done once with the reader-writer lock and once with the
+ * seqlock.
+ */
+#define NREADERS        6
+#define NWRITERS        2
+
+struct record_t {
+   uint64_t values[8];
+};
+
+static const size_t nreads = 1000 * 100;
+static const size_t nwrites = 1000 * 10;
+
+static osal_rwlock_t *rwlock;
+static osal_seqlock_t seqlock;
+static struct record_t record;
+static uint64_t next_value;
+static bool use_seqlock;
+
+static bool record_valid (const struct record_t *r)
+{
+   for (size_t i=1; i<sizeof r->values / sizeof r->values[0]; i++) {
+      if (r->values[i] != r->values[0]) {
+         return false;
+      }
+   }
+   return true;
+}
+
+static void reader (void *param)
+{
+   bool *passed = param;
+   struct record_t copy;
+
+   for (size_t i=0; i<nreads; i++) {
+      if (use_seqlock) {
+         osal_seqlock_read (&seqlock, &copy, &record, sizeof copy);
+      } else {
+         osal_rwlock_read_lock (rwlock);
+         copy = record;
+         osal_rwlock_read_unlock (rwlock);
+      }
+
+      if (!(record_valid (&copy))) {
+         fprintf (stderr, "[reader] Torn record at %zu\n", i);
+         return;
+      }
+   }
+
+   *passed = true;
+}
+
+static void writer (void *param)
+{
+   bool *passed = param;
+   struct record_t update;
+
+   for (size_t i=0; i<nwrites; i++) {
+      uint64_t value = __atomic_add_fetch (&next_value, 1, __ATOMIC_RELAXED);
+      for (size_t j=0; j<sizeof update.values / sizeof update.values[0]; j++) {
+         update.values[j] = value;
+      }
+
+      if (use_seqlock) {
+         osal_seqlock_write (&seqlock, &record, &update, sizeof update);
+      } else {
+         osal_rwlock_write_lock (rwlock);
+         record = update;
+         osal_rwlock_write_unlock (rwlock);
+      }
+   }
+
+   *passed = true;
+}
+
+static bool run_test (const char *name)
+{
+   osal_thread_t threads[NREADERS + NWRITERS];
+   bool passed[NREADERS + NWRITERS] = { false };
+   size_t nthreads = 0;
+   bool ret = true;
+
+   uint64_t start = osal_timer_since_start ();
+   for (size_t i=0; i<NREADERS + NWRITERS; i++) {
+      osal_thread_func_t *fptr = i < NREADERS ? reader : writer;
+      if (!(osal_thread_new (&threads[nthreads++], fptr, &passed[i]))) {
+         fprintf (stderr, "Failed to create thread %zu\n", i);
+         nthreads--;
+         ret = false;
+         break;
+      }
+   }
+   osal_thread_wait (threads, nthreads);
+   uint64_t elapsed = osal_timer_since_start () - start;
+
+   for (size_t i=0; i<nthreads; i++) {
+      ret = ret && passed[i];
+   }
+
+   printf ("%s %s: %" PRIu64 "us\n", ret ? "Passed" : "Failed", name, elapsed);
+   return ret;
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+
+   osal_timer_init();
+
+   if (!(rwlock = osal_rwlock_new ())) {
+      fprintf (stderr, "Failed to create a new rwlock\n");
+      goto cleanup;
+   }
+   osal_seqlock_init (&seqlock);
+
+   use_seqlock = false;
+   if (!(run_test ("rwlock"))) {
+      goto cleanup;
+   }
+   osal_rwlock_dump (rwlock);
+
+   use_seqlock = true;
+   if (!(run_test ("seqlock"))) {
+      goto cleanup;
+   }
+
+   ret = EXIT_SUCCESS;
+
+cleanup:
+   osal_rwlock_del (rwlock);
+   return ret;
+}
+
@@ -0,0 +1,136 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_shq.h"
+
+/* **********************************************************************
+ * Each producer sends a tagged sequence of numbers. The queue is created
+ * with OSAL_SHQ_FIFO_PER_LANE so the single consumer must see each
+ * producer's numbers in order, whichever lanes they ended up in, and
+ * with one lane per producer, so each producer must get a lane of its
+ * own.
+ */
+#define NPRODUCERS      4
+
+static const size_t nmessages = 100000;
+static osal_shq_t *queue;
+static size_t lanes[NPRODUCERS];
+
+static void consumer (void *param)
+{
+   bool *passed = param;
+   size_t expected[NPRODUCERS] = { 0 };
+   size_t received = 0;
+   void *message;
+   size_t self = osal_shq_consumer_add (queue);
+
+   printf ("[consumer] Started on lane %zu\n", self);
+   while (received < NPRODUCERS * nmessages) {
+      if (!(osal_shq_dq (queue, self, &message, NULL))) {
+         osal_thread_sleep (0);
+         continue;
+      }
+
+      uintptr_t value = (uintptr_t)message;
+      size_t producer = (size_t)(value % NPRODUCERS);
+      size_t number = (size_t)(value / NPRODUCERS);
+      if (number != expected[producer]) {
+         fprintf (stderr, "[consumer] Producer %zu: expected %zu, got %zu\n",
+                  producer, expected[producer], number);
+         return;
+      }
+
+      expected[producer]++;
+      received++;
+   }
+
+   osal_shq_consumer_remove (queue, self);
+   *passed = true;
+   printf ("[consumer] Completed, %zu messages\n", received);
+}
+
+static void producer (void *param)
+{
+   size_t self = (size_t)(uintptr_t)param;
+   size_t lane = lanes[self];
+   for (size_t i=0; i<nmessages; i++) {
+      void *message = (void *)(uintptr_t)(i * NPRODUCERS + self);
+      while (!(osal_shq_nq (queue, lane, message))) {
+         osal_thread_sleep (0);
+      }
+   }
+   printf ("[producer %zu]: Completed on lane %zu\n", self, lane);
+}
+
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+   osal_thread_t threads[NPRODUCERS + 1];
+   size_t nthreads = 0;
+   bool passed = false;
+
+   osal_timer_init();
+
+   queue = osal_shq_new (NPRODUCERS, 64, OSAL_SHQ_FIFO_PER_LANE);
+   if (!queue) {
+      fprintf (stderr, "Failed to create a new queue\n");
+      goto cleanup;
+   }
+
+   // Registered up front so that the lanes can be checked.
+   bool used[NPRODUCERS] = { false };
+   for (size_t i=0; i<NPRODUCERS; i++) {
+      lanes[i] = osal_shq_producer_add (queue);
+      if (lanes[i] >= NPRODUCERS || used[lanes[i]]) {
+         fprintf (stderr, "Producer %zu was given lane %zu\n", i, lanes[i]);
+         goto cleanup;
+      }
+      used[lanes[i]] = true;
+   }
+
+   if (!(osal_thread_new (&threads[nthreads++], consumer, &passed))) {
+      fprintf (stderr, "Failed to create consumer thread\n");
+      nthreads--;
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<NPRODUCERS; i++) {
+      if (!(osal_thread_new (&threads[nthreads++], producer, (void *)(uintptr_t)i))) {
+         fprintf (stderr, "Failed to create producer thread %zu\n", i);
+         nthreads--;
+         goto cleanup;
+      }
+   }
+
+   osal_thread_wait (threads, nthreads);
+   nthreads = 0;
+   osal_shq_dump (queue);
+
+   // A lane given up is the next one handed out.
+   osal_shq_producer_remove (queue, lanes[1]);
+   if (osal_shq_producer_add (queue) != lanes[1]) {
+      fprintf (stderr, "Lane %zu was not reused\n", lanes[1]);
+      passed = false;
+   }
+   for (size_t i=0; i<NPRODUCERS; i++) {
+      osal_shq_producer_remove (queue, lanes[i]);
+   }
+
+   printf ("%s\n", passed ? "Passed" : "Failed");
+   if (passed) {
+      ret = EXIT_SUCCESS;
+   }
+
+cleanup:
+   osal_thread_wait (threads, nthreads);
+   osal_shq_del (queue);
+   return ret;
+}
+
@@ -0,0 +1,119 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_spsc.h"
+
+static const size_t nmessages = 10000000;
+
+// Set by a thread that fails, so that the other does not wait on it
+// forever.
+static bool aborted = false;
+static bool passed = false;
+
+static void consumer (void *param)
+{
+   osal_spsc_t *queue = param;
+   printf ("[consumer] Started\n");
+   void *message = NULL;
+   size_t expected = 1;
+   uint64_t start = osal_timer_since_start ();
+
+   while (expected <= nmessages) {
+      if (!(osal_spsc_dq (queue, &message))) {
+         if (__atomic_load_n (&aborted, __ATOMIC_RELAXED)) {
+            break;
+         }
+         osal_thread_sleep (0);
+         continue;
+      }
+
+      if ((size_t)(uintptr_t)message != expected) {
+         fprintf (stderr, "[consumer] Expected %zu, got %zu\n",
+                  expected, (size_t)(uintptr_t)message);
+         __atomic_store_n (&aborted, true, __ATOMIC_RELAXED);
+         break;
+      }
+
+      expected++;
+   }
+
+   uint64_t duration = osal_timer_since_start () - start;
+   passed = expected > nmessages;
+
+   printf ("[consumer] Completed\n");
+   printf ("[consumer] Received %zu/%zu messages in %.2fs\n",
+           expected - 1, nmessages, osal_timer_convert_us_to_s (duration));
+   if (duration) {
+      printf ("[consumer] %.2f million messages/s\n",
+              (double)(expected - 1) / (double)duration);
+   }
+}
+
+static void producer (void *param)
+{
+   osal_spsc_t *queue = param;
+   printf ("[producer]: Started\n");
+   for (size_t i=1; i<=nmessages; i++) {
+      while (!(osal_spsc_nq (queue, (void *)(uintptr_t)i))) {
+         if (__atomic_load_n (&aborted, __ATOMIC_RELAXED)) {
+            fprintf (stderr, "[producer]: Aborted after %zu messages\n", i - 1);
+            return;
+         }
+         osal_thread_sleep (0);
+      }
+   }
+
+   printf ("[producer]: Completed\n");
+}
+
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+   osal_thread_t threads[2] = {0, 0};
+   size_t nthreads = 0;
+
+   osal_spsc_t *queue = NULL;
+
+   queue = osal_spsc_new (1024);
+   if (!queue) {
+      fprintf (stderr, "Failed to create a new queue\n");
+      goto cleanup;
+   }
+
+   osal_timer_init();
+   if (!(osal_thread_new(&threads[nthreads++], consumer, queue))) {
+      fprintf (stderr, "Failed to create consumer thread\n");
+      nthreads--;
+      goto cleanup;
+   }
+
+   if (!(osal_thread_new(&threads[nthreads++], producer, queue))) {
+      fprintf (stderr, "Failed to create producer thread\n");
+      nthreads--;
+      __atomic_store_n (&aborted, true, __ATOMIC_RELAXED);
+      goto cleanup;
+   }
+
+   osal_thread_wait(threads, nthreads);
+   nthreads = 0;
+
+   if (passed) {
+      printf ("Passed\n");
+      ret = EXIT_SUCCESS;
+   } else {
+      printf ("Failed\n");
+   }
+
+cleanup:
+   osal_thread_wait(threads, nthreads);
+   osal_spsc_del (queue);
+   return ret;
+}
+
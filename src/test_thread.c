@@ -1,4 +1,10 @@
 
+#if 1
+#ifdef PLATFORM_POSIX
+#define _GNU_SOURCE 200809L
+#endif
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +12,11 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "osal_thread.h"
 
 /* **********************************************************************
@@ -32,6 +43,283 @@ void thread_func (void *param)
    }
 }
 
+/* **********************************************************************
+ * The same counter test, but with a fast mutex and without the printf
+ * output, so that the lock is actually contended. Profiling is on, and
+ * must have counted every acquisition.
+ */
+static uint32_t ftex;
+static size_t ftex_counter;
+static const size_t ftex_addloop = 1000 * 100;
+
+void ftex_thread_func (void *param)
+{
+   (void)param;
+   for (size_t i=0; i<ftex_addloop; i++) {
+      osal_ftex_lock (&ftex, "counter");
+      ftex_counter++;
+      osal_ftex_unlock (&ftex, "counter");
+   }
+}
+
+static bool ftex_test (void)
+{
+   osal_thread_t threads[16];
+   size_t nthreads = sizeof threads / sizeof threads[0];
+
+   osal_ftex_profile_enable (true);
+   for (size_t i=0; i<nthreads; i++) {
+      if (!(osal_thread_new (&threads[i], ftex_thread_func, NULL))) {
+         printf ("Failed to create ftex thread [%zu]\n", i);
+         osal_thread_wait (threads, i);
+         return false;
+      }
+   }
+   osal_thread_wait (threads, nthreads);
+   osal_ftex_profile_enable (false);
+
+   size_t expected = ftex_addloop * nthreads;
+   if (ftex_counter != expected) {
+      printf ("Failed ftex: expected %zu, got %zu\n", expected, ftex_counter);
+      return false;
+   }
+
+   osal_ftex_profile_t profile[8];
+   size_t nprofile = osal_ftex_profile (profile, 8);
+   uint64_t acquisitions = 0;
+   for (size_t i=0; i<nprofile && i<8; i++) {
+      if (strcmp (profile[i].id, "counter") == 0) {
+         acquisitions += profile[i].acquisitions;
+      }
+   }
+   osal_ftex_profile_dump ();
+   if (acquisitions != expected) {
+      printf ("Failed ftex profile: expected %zu, got %" PRIu64 "\n",
+              expected, acquisitions);
+      return false;
+   }
+   printf ("Passed ftex: expected %zu, got %zu\n", expected, ftex_counter);
+   return true;
+}
+
+/* **********************************************************************
+ * A thread started with a name, a small stack and pinned to CPU 0 should
+ * see all three. Only checked on Linux, where all three are supported.
+ */
+void attr_thread_func (void *param)
+{
+   bool *passed = param;
+#ifdef __linux__
+   char name[OSAL_THREAD_NAME_MAX];
+   if (pthread_getname_np (pthread_self (), name, sizeof name) != 0
+         || strcmp (name, "osal-attr-test") != 0) {
+      printf ("Failed attr: name\n");
+      return;
+   }
+   if (sched_getcpu () != 0) {
+      printf ("Failed attr: running on CPU %i\n", sched_getcpu ());
+      return;
+   }
+
+   // Move to the same CPU; only checks that the call works.
+   size_t cpu = 0;
+   if (!(osal_thread_pin_self (&cpu, 1))) {
+      printf ("Failed attr: osal_thread_pin_self()\n");
+      return;
+   }
+#endif
+   *passed = true;
+}
+
+static bool attr_test (void)
+{
+   osal_thread_t thread;
+   bool passed = false;
+   size_t cpus[] = { 0 };
+   osal_thread_attr_t attr;
+
+   memset (&attr, 0, sizeof attr);
+   attr.name = "osal-attr-test";
+   attr.stack_size = 64 * 1024;
+#ifdef __linux__
+   attr.cpus = cpus;
+   attr.ncpus = sizeof cpus / sizeof cpus[0];
+#else
+   (void)cpus;
+#endif
+
+   if (!(osal_thread_new_ex (&thread, attr_thread_func, &passed, &attr))) {
+      printf ("Failed to create attr thread\n");
+      return false;
+   }
+   osal_thread_wait (&thread, 1);
+   osal_thread_del (&thread);
+
+   // A priority without a real-time policy cannot be applied.
+   attr.priority = 1;
+   if (osal_thread_new_ex (&thread, attr_thread_func, &passed, &attr)) {
+      printf ("Failed attr: priority accepted with the default policy\n");
+      osal_thread_wait (&thread, 1);
+      osal_thread_del (&thread);
+      passed = false;
+   }
+
+   printf ("%s attr\n", passed ? "Passed" : "Failed");
+   return passed;
+}
+
+/* **********************************************************************
+ * Consumers wait on a semaphore that the main thread posts to in
+ * batches; every post must be consumed exactly once.
+ */
+#define SEM_NCONSUMERS     8
+
+static osal_sem_t sem;
+static size_t sem_consumed;
+static const size_t sem_perthread = 1000 * 10;
+
+void sem_thread_func (void *param)
+{
+   (void)param;
+   for (size_t i=0; i<sem_perthread; i++) {
+      osal_sem_wait (&sem);
+      __atomic_add_fetch (&sem_consumed, 1, __ATOMIC_RELAXED);
+   }
+}
+
+static bool sem_test (void)
+{
+   osal_thread_t threads[SEM_NCONSUMERS];
+   size_t total = sem_perthread * SEM_NCONSUMERS;
+
+   osal_sem_new (&sem, 0);
+   if (osal_sem_trywait (&sem) || osal_sem_timedwait (&sem, 1000)) {
+      printf ("Failed sem: acquired an empty semaphore\n");
+      return false;
+   }
+
+   for (size_t i=0; i<SEM_NCONSUMERS; i++) {
+      if (!(osal_thread_new (&threads[i], sem_thread_func, NULL))) {
+         printf ("Failed to create sem thread [%zu]\n", i);
+         osal_sem_post_n (&sem, (uint32_t)total);
+         osal_thread_wait (threads, i);
+         return false;
+      }
+   }
+
+   for (size_t posted=0; posted<total; posted += 7) {
+      uint32_t n = (uint32_t)(total - posted < 7 ? total - posted : 7);
+      osal_sem_post_n (&sem, n);
+   }
+   osal_thread_wait (threads, SEM_NCONSUMERS);
+
+   bool passed = sem_consumed == total && !osal_sem_trywait (&sem);
+   osal_sem_del (&sem);
+   printf ("%s sem: expected %zu, got %zu\n", passed ? "Passed" : "Failed",
+           total, sem_consumed);
+   return passed;
+}
+
+/* **********************************************************************
+ * While SLOTS_N threads hold slots, one more thread must find none; once
+ * they have exited, any number of threads, one after another, must each
+ * get a slot again.
+ */
+#define SLOTS_N            4
+#define SLOTS_LATER        40
+
+static osal_thread_slots_t *slots;
+static osal_sem_t slots_sem;
+static size_t slots_ready;
+
+void slots_holder_func (void *param)
+{
+   size_t *slot = param;
+   *slot = osal_thread_slot (slots);
+   if (osal_thread_slot (slots) != *slot) {
+      *slot = (size_t)-2;
+   }
+   __atomic_add_fetch (&slots_ready, 1, __ATOMIC_RELEASE);
+   osal_sem_wait (&slots_sem);
+}
+
+void slots_thread_func (void *param)
+{
+   size_t *slot = param;
+   *slot = osal_thread_slot (slots);
+}
+
+static bool slots_run (size_t *slot)
+{
+   osal_thread_t thread;
+   if (!(osal_thread_new (&thread, slots_thread_func, slot))) {
+      return false;
+   }
+   osal_thread_wait (&thread, 1);
+   osal_thread_del (&thread);
+   return true;
+}
+
+static bool slots_test (void)
+{
+   osal_thread_t threads[SLOTS_N];
+   size_t held[SLOTS_N];
+   size_t extra = 0;
+   size_t nthreads = 0;
+   bool passed = false;
+
+   osal_sem_new (&slots_sem, 0);
+   if (!(slots = osal_thread_slots_new (SLOTS_N))) {
+      printf ("Failed to create slots\n");
+      goto cleanup;
+   }
+
+   for (nthreads=0; nthreads<SLOTS_N; nthreads++) {
+      if (!(osal_thread_new (&threads[nthreads], slots_holder_func, &held[nthreads]))) {
+         printf ("Failed to create slots thread [%zu]\n", nthreads);
+         goto cleanup;
+      }
+   }
+   while (__atomic_load_n (&slots_ready, __ATOMIC_ACQUIRE) < SLOTS_N) {
+      osal_thread_sleep (1);
+   }
+   if (!(slots_run (&extra)) || extra != (size_t)-1) {
+      printf ("Failed slots: a thread got slot %zu with all taken\n", extra);
+      goto cleanup;
+   }
+
+   bool seen[SLOTS_N] = { false };
+   for (size_t i=0; i<SLOTS_N; i++) {
+      if (held[i] >= SLOTS_N || seen[held[i]]) {
+         printf ("Failed slots: thread %zu got slot %zu\n", i, held[i]);
+         goto cleanup;
+      }
+      seen[held[i]] = true;
+   }
+
+   osal_sem_post_n (&slots_sem, SLOTS_N);
+   osal_thread_wait (threads, nthreads);
+   nthreads = 0;
+
+   for (size_t i=0; i<SLOTS_LATER; i++) {
+      size_t slot = (size_t)-1;
+      if (!(slots_run (&slot)) || slot >= SLOTS_N) {
+         printf ("Failed slots: later thread %zu got slot %zu\n", i, slot);
+         goto cleanup;
+      }
+   }
+
+   passed = true;
+   printf ("Passed slots\n");
+
+cleanup:
+   osal_sem_post_n (&slots_sem, SLOTS_N);
+   osal_thread_wait (threads, nthreads);
+   osal_thread_slots_del (slots);
+   osal_sem_del (&slots_sem);
+   return passed;
+}
+
 int main (void)
 {
    int ret = EXIT_FAILURE;
@@ -39,6 +327,10 @@ int main (void)
 
    memset (threads, 0, sizeof threads);
 
+   if (!(attr_test ()) || !(ftex_test ()) || !(sem_test ()) || !(slots_test ())) {
+      return EXIT_FAILURE;
+   }
+
    if (!(osal_mutex_new (&mutex))) {
       printf ("Error initialising mutex\n");
    }
@@ -7,6 +7,7 @@
 #include <stdint.h>
 
 #include "osal_timer.h"
+#include "osal_thread.h"
 
 void spinwait (uint64_t us)
 {
@@ -21,6 +22,70 @@ void spinwait (uint64_t us)
    }
 }
 
+/* Each thread times laps of a loop with its own stopwatch and its own
+ * mark into its own accumulator. The laps must add up to no more than
+ * the thread's elapsed time, which fails if the threads' marks share
+ * state, and the merged accumulators must count every lap.
+ */
+#define NLAPPERS     4
+#define NLAPS        100000
+
+static osal_stopwatch_acc_t lap_accs[NLAPPERS];
+static bool lap_failed;
+
+static void lapper (void *param)
+{
+   osal_stopwatch_acc_t *acc = param;
+   osal_stopwatch_t sw;
+   uint64_t marked = 0;
+
+   osal_stopwatch_acc_init (acc);
+   osal_stopwatch_start (&sw);
+   osal_timer_mark_ns ();
+   for (size_t i=0; i<NLAPS; i++) {
+      marked += osal_timer_mark_ns ();
+      osal_stopwatch_lap_acc (&sw, acc);
+   }
+   uint64_t elapsed = osal_stopwatch_elapsed_ns (&sw);
+
+   if (acc->total_ns > elapsed || marked > elapsed) {
+      fprintf (stderr, "Laps of %" PRIu64 "ns and marks of %" PRIu64 "ns "
+                       "in %" PRIu64 "ns\n", acc->total_ns, marked, elapsed);
+      lap_failed = true;
+   }
+}
+
+static bool stopwatch_test (void)
+{
+   osal_thread_t threads[NLAPPERS];
+   size_t nthreads = 0;
+
+   for (size_t i=0; i<NLAPPERS; i++) {
+      if (!(osal_thread_new (&threads[nthreads], lapper, &lap_accs[i]))) {
+         fprintf (stderr, "Failed to create lap thread %zu\n", i);
+         break;
+      }
+      nthreads++;
+   }
+   osal_thread_wait (threads, nthreads);
+   for (size_t i=0; i<nthreads; i++) {
+      osal_thread_del (&threads[i]);
+   }
+
+   osal_stopwatch_acc_t total;
+   osal_stopwatch_acc_init (&total);
+   for (size_t i=0; i<nthreads; i++) {
+      osal_stopwatch_acc_merge (&total, &lap_accs[i]);
+   }
+   printf ("%" PRIu64 " laps: mean %.1fns, min %" PRIu64 "ns, max %" PRIu64 "ns\n",
+           total.count, (double)total.total_ns / (double)total.count,
+           total.min_ns, total.max_ns);
+
+   return nthreads == NLAPPERS && !lap_failed
+       && total.count == (uint64_t)NLAPPERS * NLAPS
+       && total.min_ns <= total.max_ns;
+}
+
 int main (void)
 {
    const char paddle[] = "-\\|/";
@@ -28,6 +93,7 @@ int main (void)
 
    printf ("Testing osal_timer functionality\n");
    osal_timer_init ();
+   printf ("Clock source: %s\n", osal_timer_clock_name (osal_timer_clock ()));
 
    printf ("starting OS timer cost test. The display will not be updated\n");
    osal_timer_since_start ();
@@ -37,7 +103,32 @@ int main (void)
    }
    mark = osal_timer_since_start () - cost;
    printf ("OS timer cost test: %.2fs\n", osal_timer_convert_us_to_s (mark));
-   printf ("Each timer call cost %.5fus\n", (double)0x0fffffff / (double)mark);
+   printf ("Each timer call cost %.2fns\n", (double)mark * 1000.0 / (double)0x0fffffff);
+
+   printf ("Starting nanosecond test\n");
+   uint64_t ns_start = osal_timer_since_start_ns ();
+   uint64_t us_start = osal_timer_since_start ();
+   if (osal_timer_convert_ns_to_us (ns_start) > us_start) {
+      fprintf (stderr, "Nanosecond clock ahead of microsecond clock\n");
+      return EXIT_FAILURE;
+   }
+   osal_timer_mark_ns ();
+   osal_timer_t *tns = osal_timer_set_ns (500);
+   while (!osal_timer_expired (tns))
+      ;
+   mark = osal_timer_mark_ns ();
+   osal_timer_del (tns);
+   if (mark < 500) {
+      fprintf (stderr, "Nanosecond timer expired after %" PRIu64 "ns\n", mark);
+      return EXIT_FAILURE;
+   }
+   printf ("500ns timer expired after %" PRIu64 "ns\n", mark);
+
+   printf ("Starting stopwatch test\n");
+   if (!(stopwatch_test ())) {
+      fprintf (stderr, "Stopwatch test failed\n");
+      return EXIT_FAILURE;
+   }
 
    printf ("starting at: %" PRIu64 "\n ", osal_timer_since_start ());
    osal_timer_mark_us ();
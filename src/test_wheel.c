@@ -0,0 +1,305 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "osal_thread.h"
+#include "osal_timer.h"
+#include "osal_wheel.h"
+#include "osal_atomic.h"
+
+/* **********************************************************************
+ * A large number of timers with pseudo-random expiries, spread over
+ * every level of the wheel (and a few beyond it), is driven by
+ * simulated time in random steps. Some timers are cancelled, some are
+ * re-armed, and some re-arm themselves from their callback. Every timer
+ * must fire exactly as often as it was left armed, never before its
+ * expiry and never in a later advance than the one that reached it.
+ *
+ * Then a few timers are run by the wheel's own driver thread in real
+ * time.
+ */
+#define NTIMERS         (1000 * 100)
+#define TICK_US         1000
+
+struct test_timer_t {
+   osal_wheel_node_t node;
+   uint64_t expires_us;
+   size_t nfired;
+   size_t nexpected;
+   size_t nrepeat;
+   uint64_t armed_at;
+   bool early;
+   bool late;
+};
+
+static osal_wheel_t *wheel;
+static uint64_t sim_now;
+static uint64_t sim_prev;
+static size_t pending;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static uint64_t rng (void)
+{
+   rng_state ^= rng_state << 13;
+   rng_state ^= rng_state >> 7;
+   rng_state ^= rng_state << 17;
+   return rng_state;
+}
+
+static void fired (osal_wheel_node_t *node, void *param)
+{
+   struct test_timer_t *t = param;
+   (void)node;
+
+   // Due in the first tick that is not before the expiry; late if that
+   // tick had already been reached by the previous advance, unless the
+   // timer was armed already due.
+   uint64_t due = (t->expires_us + TICK_US - 1) / TICK_US;
+   t->nfired++;
+   pending--;
+   if (sim_now < t->expires_us) {
+      t->early = true;
+   }
+   if (sim_prev / TICK_US >= due && t->armed_at / TICK_US < due) {
+      t->late = true;
+   }
+
+   if (t->nrepeat) {
+      t->nrepeat--;
+      t->nexpected++;
+      pending++;
+      t->expires_us = sim_now + 1 + rng () % (TICK_US * 100);
+      t->armed_at = sim_now;
+      osal_wheel_arm (wheel, &t->node, t->expires_us);
+   }
+}
+
+static void never_fire (osal_wheel_node_t *node, void *param)
+{
+   bool *fired_flag = param;
+   (void)node;
+   *fired_flag = true;
+}
+
+static uint64_t random_timeout (void)
+{
+   // Mostly near, some far, a few beyond the top level.
+   switch (rng () % 8) {
+      case 0:  return rng () % (TICK_US * 64);
+      case 7:  return rng () % ((uint64_t)TICK_US << 40);
+      default: return rng () % ((uint64_t)TICK_US << 24);
+   }
+}
+
+static bool simulated_test (void)
+{
+   bool passed = false;
+   struct test_timer_t *timers = NULL;
+
+   sim_now = 123456789;
+   if (!(wheel = osal_wheel_new (TICK_US, sim_now))) {
+      fprintf (stderr, "Failed to create a new wheel\n");
+      goto cleanup;
+   }
+   if (!(timers = calloc (NTIMERS, sizeof *timers))) {
+      fprintf (stderr, "Failed to allocate timers\n");
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<NTIMERS; i++) {
+      struct test_timer_t *t = &timers[i];
+      osal_wheel_node_init (&t->node, fired, t);
+      t->expires_us = sim_now + random_timeout ();
+      t->armed_at = sim_now;
+      t->nexpected = 1;
+      t->nrepeat = i % 97 == 0 ? 3 : 0;
+      pending++;
+      osal_wheel_arm (wheel, &t->node, t->expires_us);
+   }
+
+   for (size_t i=0; i<NTIMERS; i+=10) {
+      struct test_timer_t *t = &timers[i];
+      if (!(osal_wheel_cancel (wheel, &t->node))) {
+         fprintf (stderr, "Timer %zu was not armed\n", i);
+         goto cleanup;
+      }
+      t->nexpected = 0;
+      t->nrepeat = 0;
+      pending--;
+      if (i % 20 == 0) {
+         t->expires_us = sim_now + random_timeout ();
+         t->armed_at = sim_now;
+         t->nexpected = 1;
+         pending++;
+         osal_wheel_arm (wheel, &t->node, t->expires_us);
+      }
+   }
+
+   // Re-arming an armed timer moves it.
+   for (size_t i=1; i<NTIMERS; i+=10) {
+      struct test_timer_t *t = &timers[i];
+      t->expires_us = sim_now + random_timeout ();
+      t->armed_at = sim_now;
+      osal_wheel_arm (wheel, &t->node, t->expires_us);
+   }
+
+   // Steps of up to a quarter of a second, with the occasional jump of
+   // minutes, of weeks or of decades, until everything has fired.
+   size_t nfired = 0;
+   size_t nsteps = 0;
+   uint64_t start = osal_timer_since_start ();
+   while (pending) {
+      uint64_t delta;
+      switch (rng () % 4096) {
+         case 0:  delta = rng () % ((uint64_t)TICK_US << 40); break;
+         case 1:  delta = rng () % ((uint64_t)TICK_US << 30); break;
+         case 2:  delta = rng () % ((uint64_t)TICK_US << 20); break;
+         default: delta = rng () % ((uint64_t)TICK_US << 8); break;
+      }
+      sim_prev = sim_now;
+      sim_now += delta;
+      nfired += osal_wheel_advance (wheel, sim_now);
+      if (++nsteps > 1000 * 1000 * 10) {
+         fprintf (stderr, "%zu timers never fired\n", pending);
+         goto cleanup;
+      }
+   }
+   printf ("Fired %zu timers in %zu steps, %" PRIu64 "us\n", nfired, nsteps,
+           osal_timer_since_start () - start);
+
+   for (size_t i=0; i<NTIMERS; i++) {
+      struct test_timer_t *t = &timers[i];
+      if (t->nfired != t->nexpected || t->early || t->late) {
+         fprintf (stderr, "Timer %zu fired %zu times (expected %zu)%s%s\n",
+                  i, t->nfired, t->nexpected, t->early ? ", early" : "",
+                  t->late ? ", late" : "");
+         goto cleanup;
+      }
+   }
+
+   osal_wheel_dump (wheel);
+   passed = true;
+
+cleanup:
+   osal_wheel_del (wheel);
+   wheel = NULL;
+   free (timers);
+   return passed;
+}
+
+/* A timeout past the end of time must not wrap around into the past
+ * and fire. With a 1us tick the sum overflows for any current time.
+ */
+static bool forever_test (void)
+{
+   bool passed = false;
+   osal_wheel_node_t node;
+   bool node_fired = false;
+
+   osal_wheel_t *w = osal_wheel_new (1, 1000);
+   if (!w) {
+      fprintf (stderr, "Failed to create a new wheel\n");
+      return false;
+   }
+
+   osal_wheel_node_init (&node, never_fire, &node_fired);
+   osal_wheel_arm_in (w, &node, UINT64_MAX);
+   osal_wheel_advance (w, 2000);
+   if (node_fired || !(osal_wheel_cancel (w, &node))) {
+      fprintf (stderr, "Timer armed for UINT64_MAX us %s\n",
+               node_fired ? "fired" : "was not armed");
+      goto cleanup;
+   }
+   passed = true;
+
+cleanup:
+   osal_wheel_del (w);
+   return passed;
+}
+
+/* ********************************************************************** */
+
+#define NREAL           8
+
+static uint32_t real_fired;
+
+static void real_fire (osal_wheel_node_t *node, void *param)
+{
+   uint64_t *when = param;
+   (void)node;
+   *when = osal_timer_since_start ();
+   osal_atomic_fetch_add_u32 (&real_fired, 1, OSAL_ATOMIC_RELEASE);
+}
+
+static bool driver_test (void)
+{
+   bool passed = false;
+   osal_wheel_node_t nodes[NREAL];
+   uint64_t when[NREAL] = { 0 };
+   uint64_t expires[NREAL];
+
+   uint64_t now = osal_timer_since_start ();
+   if (!(wheel = osal_wheel_new (TICK_US, now))) {
+      fprintf (stderr, "Failed to create a new wheel\n");
+      goto cleanup;
+   }
+   for (size_t i=0; i<NREAL; i++) {
+      osal_wheel_node_init (&nodes[i], real_fire, &when[i]);
+      expires[i] = now + 10000 * (i + 1);
+      osal_wheel_arm (wheel, &nodes[i], expires[i]);
+   }
+   if (!(osal_wheel_start (wheel))) {
+      fprintf (stderr, "Failed to start the driver thread\n");
+      goto cleanup;
+   }
+
+   uint64_t deadline = now + 10000 * (NREAL + 50);
+   while (osal_atomic_load_u32 (&real_fired, OSAL_ATOMIC_ACQUIRE) < NREAL
+            && osal_timer_since_start () < deadline) {
+      osal_thread_sleep (1);
+   }
+   osal_wheel_stop (wheel);
+
+   for (size_t i=0; i<NREAL; i++) {
+      if (!when[i] || when[i] < expires[i]) {
+         fprintf (stderr, "Timer %zu fired at %" PRIu64 ", due at %" PRIu64 "\n",
+                  i, when[i], expires[i]);
+         goto cleanup;
+      }
+      printf ("Timer %zu fired %" PRIu64 "us late\n", i, when[i] - expires[i]);
+   }
+   passed = true;
+
+cleanup:
+   osal_wheel_del (wheel);
+   wheel = NULL;
+   return passed;
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+
+   osal_timer_init();
+
+   if (!(simulated_test ())) {
+      goto cleanup;
+   }
+   if (!(forever_test ())) {
+      goto cleanup;
+   }
+   if (!(driver_test ())) {
+      goto cleanup;
+   }
+
+   printf ("Passed\n");
+   ret = EXIT_SUCCESS;
+
+cleanup:
+   return ret;
+}
+